@@ -0,0 +1,400 @@
+/*
+ * bench.c
+ *
+ * This file is the micro-benchmark suite behind `make bench`. It times the
+ * matrix products on the shapes of the MNIST example in main.c, transposes,
+ * the element-wise operations, eval, test-set evaluation and one training
+ * step, for the dense network, a pruned copy and a small convolutional one,
+ * and reports for each the time per call, GFLOP/s, ns per element and heap
+ * allocations per call. Results are printed as a table and written as JSON so that runs on
+ * different commits can be compared.
+ *
+ * Usage: bench_suite [results.json [label]]
+ *
+ * The allocation counts come from the linker: bench_suite is linked with
+ * --wrap for malloc, calloc, realloc and aligned_alloc, which routes every
+ * call the library makes through the counting wrappers in profile.c.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "matrix.h"
+#include "bench_util.h"
+#include "neural_net.h"
+#include "profile.h"
+#include "thread_pool.h"
+
+// Timed runs per case; the reported time is their median.
+#define RUNS 7
+// Minimum duration of one timed run.
+#define RUN_SECONDS 0.05
+#define WARMUP_CALLS 3
+
+// Operands of one case. Which fields are used depends on the operation.
+struct bench_args {
+    struct matrix *A;
+    struct matrix *B;
+    struct matrix *C;
+    struct neural_net *neural_net;
+    struct workspace *workspace;
+    struct evaluation *evaluation;
+};
+
+struct bench_case {
+    const char *name;
+    void (*run)(struct bench_args *args);
+    double flops;    // Floating point operations per call, or 0 if not meaningful
+    double elements; // Output elements per call
+    struct bench_args args;
+};
+
+struct bench_result {
+    double seconds;     // Median time per call
+    double min_seconds; // Fastest run's time per call
+    double allocations; // Heap allocations per call
+};
+
+static void run_mat_mult(struct bench_args *args)
+{
+    destruct_matrix(mat_mult(args->A, args->B));
+}
+
+static void run_mat_mult_into(struct bench_args *args)
+{
+    mat_mult_into(args->A, args->B, args->C);
+}
+
+static void run_gemm_nt(struct bench_args *args)
+{
+    gemm(false, true, 1.0f, args->A, args->B, 0.0f, args->C);
+}
+
+static void run_gemm_tn(struct bench_args *args)
+{
+    gemm(true, false, 1.0f, args->A, args->B, 0.0f, args->C);
+}
+
+static void run_transpose(struct bench_args *args)
+{
+    destruct_matrix(transpose(args->A));
+}
+
+static void run_transpose_into(struct bench_args *args)
+{
+    transpose_into(args->A, args->C);
+}
+
+static void run_matrix_add(struct bench_args *args)
+{
+    matrix_add(args->A, args->B);
+}
+
+static void run_hadamard_product(struct bench_args *args)
+{
+    hadamard_product(args->A, args->B);
+}
+
+static void run_scale_matrix(struct bench_args *args)
+{
+    scale_matrix(args->A, 1.0f);
+}
+
+static void run_matrix_axpy(struct bench_args *args)
+{
+    matrix_axpy(1e-6f, args->B, args->A);
+}
+
+static void run_bias_activation(struct bench_args *args)
+{
+    bias_activation(args->A, args->B, ACTIVATION_SIGMOID, args->C, NULL);
+}
+
+static void run_eval(struct bench_args *args)
+{
+    destruct_matrix(eval(args->neural_net, args->A));
+}
+
+static void run_eval_workspace(struct bench_args *args)
+{
+    eval_workspace(args->neural_net, args->workspace, args->A);
+}
+
+static void run_eval_single(struct bench_args *args)
+{
+    eval_single(args->neural_net, args->A->entries, args->C->entries);
+}
+
+static void run_evaluate(struct bench_args *args)
+{
+    evaluate(args->neural_net, args->A, args->B, args->evaluation);
+}
+
+static void run_back_propagate(struct bench_args *args)
+{
+    back_propagate(args->neural_net, args->A, args->B, 1e-3f);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * time_case
+ *
+ * Runs a case WARMUP_CALLS times, then RUNS times for at least RUN_SECONDS
+ * each, counting the heap allocations of the timed calls.
+ *
+ * Returns:
+ * The median and minimum time per call and the allocations per call.
+ */
+static struct bench_result time_case(struct bench_case *bench_case)
+{
+    for (int i = 0; i < WARMUP_CALLS; ++i)
+    {
+        bench_case->run(&bench_case->args);
+    }
+    double times[RUNS];
+    long total_calls = 0;
+    uint64_t allocations_before = allocation_count();
+    for (int run = 0; run < RUNS; ++run)
+    {
+        long calls = 0;
+        double start = now();
+        double elapsed;
+        do
+        {
+            bench_case->run(&bench_case->args);
+            ++calls;
+            elapsed = now() - start;
+        } while (elapsed < RUN_SECONDS);
+        times[run] = elapsed / calls;
+        total_calls += calls;
+    }
+    uint64_t allocated = allocation_count() - allocations_before;
+    qsort(times, RUNS, sizeof(double), compare_doubles);
+    struct bench_result result = {times[RUNS / 2], times[0], (double)allocated / total_calls};
+    return result;
+}
+
+/*
+ * json_string
+ *
+ * Writes a string as a JSON string literal, escaping quotes, backslashes and
+ * control characters.
+ */
+static void json_string(FILE *out, const char *string)
+{
+    fputc('"', out);
+    for (const char *c = string; *c != '\0'; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(out, "\\%c", *c);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+int main(int argc, char **argv)
+{
+    const char *json_path = (argc > 1) ? argv[1] : "bench.json";
+    const char *label = (argc > 2) ? argv[2] : "";
+
+    // Operands of the products one training step of the 784-16-16-10 network
+    // with batches of 96 performs, and of the test-set evaluation.
+    struct matrix *W0 = random_matrix(16, 784);
+    struct matrix *W1 = random_matrix(16, 16);
+    struct matrix *W2 = random_matrix(10, 16);
+    struct matrix *X = random_matrix(784, 96);
+    struct matrix *H = random_matrix(16, 96);
+    struct matrix *dZ0 = random_matrix(16, 96);
+    struct matrix *dZ2 = random_matrix(10, 96);
+    struct matrix *X_test = random_matrix(784, 10000);
+    struct matrix *square = random_matrix(512, 512);
+    struct matrix *Z0 = construct_matrix(16, 96);
+    struct matrix *Z2 = construct_matrix(10, 96);
+    struct matrix *Z_test = construct_matrix(16, 10000);
+    struct matrix *dW0 = construct_matrix(16, 784);
+    struct matrix *dA1 = construct_matrix(16, 96);
+    struct matrix *square_out = construct_matrix(512, 512);
+    struct matrix *X_transposed = construct_matrix(96, 784);
+    struct matrix *square_transposed = construct_matrix(512, 512);
+
+    // Element-wise operands: one hidden layer batch and one input batch. The
+    // factors of the Hadamard product are ones so that repeated calls keep
+    // the values normal.
+    struct matrix *small = random_matrix(16, 96);
+    struct matrix *small_other = random_matrix(16, 96);
+    struct matrix *small_ones = filled_matrix(16, 96, 1.0f);
+    struct matrix *small_bias = random_matrix(16, 1);
+    struct matrix *small_out = construct_matrix(16, 96);
+    struct matrix *large = random_matrix(784, 96);
+    struct matrix *large_other = random_matrix(784, 96);
+    struct matrix *large_ones = filled_matrix(784, 96, 1.0f);
+    struct matrix *large_bias = random_matrix(784, 1);
+    struct matrix *large_out = construct_matrix(784, 96);
+
+    int layers[] = {784, 16, 16, 10};
+    char *activations[3] = {"sigmoid", "sigmoid", "sigmoid"};
+    struct neural_net *neural_net = construct_neural_net(4, layers, activations);
+    struct workspace *workspace = construct_workspace(neural_net, 96);
+    struct neural_net *adam_net = construct_neural_net(4, layers, activations);
+    set_neural_net_optimizer(adam_net, "adam");
+    char *softmax_activations[3] = {"sigmoid", "sigmoid", "softmax"};
+    struct neural_net *softmax_net = construct_neural_net(4, layers, softmax_activations);
+    struct matrix *expected = construct_matrix(10, 96);
+    for (int col = 0; col < 96; ++col)
+    {
+        expected->entries[(col % 10) * 96 + col] = 1.0f;
+    }
+    struct matrix *expected_test = construct_matrix(10, 10000);
+    for (int col = 0; col < 10000; ++col)
+    {
+        expected_test->entries[(col % 10) * 10000 + col] = 1.0f;
+    }
+    struct evaluation *evaluation = construct_evaluation(10);
+    struct matrix *sample = random_matrix(784, 1);
+
+    // A small CNN on the same images: the 5x5 convolution is computed
+    // directly, the 3x3 one over 8 channels through im2col and gemm.
+    struct layer_spec cnn_specs[] = {
+        {LAYER_CONV2D, 8, 5, 1, 0, "relu"},    // 8x24x24
+        {LAYER_MAX_POOL, 0, 2, 2, 0, NULL},    // 8x12x12
+        {LAYER_CONV2D, 16, 3, 1, 1, "relu"},   // 16x12x12
+        {LAYER_MAX_POOL, 0, 2, 2, 0, NULL},    // 16x6x6
+        {LAYER_DENSE, 10, 0, 0, 0, "softmax"},
+    };
+    struct neural_net *cnn = construct_conv_net(1, 28, 28, 5, cnn_specs);
+    double cnn_flops = 2.0 * (8 * 24 * 24 * 25 + 16 * 12 * 12 * 72 + 10 * 576);
+    struct matrix *sample_output = construct_matrix(10, 1);
+
+    // The softmax network with 90% of its weights pruned in blocks of four
+    // rows. Its random weights leave every layer sparse enough for spmm.
+    struct neural_net *pruned_net = construct_neural_net(4, layers, softmax_activations);
+    prune_neural_net(pruned_net, 0.9f, 4);
+    double pruned_weights = 0;
+    for (int layer = 0; layer < 3; ++layer)
+    {
+        pruned_weights += sparse_density(pruned_net->sparse_weights[layer]) * pruned_net->weights[layer]->size;
+    }
+
+    struct bench_case cases[] = {
+        {"mat_mult 16x784 * 784x96", run_mat_mult, 2.0 * 16 * 96 * 784, 16 * 96, {.A = W0, .B = X}},
+        {"mat_mult_into 16x784 * 784x96", run_mat_mult_into, 2.0 * 16 * 96 * 784, 16 * 96, {.A = W0, .B = X, .C = Z0}},
+        {"mat_mult_into 16x16 * 16x96", run_mat_mult_into, 2.0 * 16 * 96 * 16, 16 * 96, {.A = W1, .B = H, .C = Z0}},
+        {"mat_mult_into 10x16 * 16x96", run_mat_mult_into, 2.0 * 10 * 96 * 16, 10 * 96, {.A = W2, .B = H, .C = Z2}},
+        {"mat_mult_into 16x784 * 784x10000", run_mat_mult_into, 2.0 * 16 * 10000 * 784, 16 * 10000,
+         {.A = W0, .B = X_test, .C = Z_test}},
+        {"mat_mult_into 512x512 * 512x512", run_mat_mult_into, 2.0 * 512 * 512 * 512, 512 * 512,
+         {.A = square, .B = square, .C = square_out}},
+        {"gemm dW0 = dZ * X^T", run_gemm_nt, 2.0 * 16 * 784 * 96, 16 * 784, {.A = dZ0, .B = X, .C = dW0}},
+        {"gemm dA1 = W2^T * dZ", run_gemm_tn, 2.0 * 16 * 96 * 10, 16 * 96, {.A = W2, .B = dZ2, .C = dA1}},
+        {"transpose 784x96", run_transpose, 0, 784 * 96, {.A = X}},
+        {"transpose_into 784x96", run_transpose_into, 0, 784 * 96, {.A = X, .C = X_transposed}},
+        {"transpose_into 512x512", run_transpose_into, 0, 512 * 512, {.A = square, .C = square_transposed}},
+        {"matrix_add 16x96", run_matrix_add, 16 * 96, 16 * 96, {.A = small, .B = small_other}},
+        {"matrix_add 784x96", run_matrix_add, 784 * 96, 784 * 96, {.A = large, .B = large_other}},
+        {"hadamard_product 16x96", run_hadamard_product, 16 * 96, 16 * 96, {.A = small, .B = small_ones}},
+        {"hadamard_product 784x96", run_hadamard_product, 784 * 96, 784 * 96, {.A = large, .B = large_ones}},
+        {"scale_matrix 16x96", run_scale_matrix, 16 * 96, 16 * 96, {.A = small}},
+        {"scale_matrix 784x96", run_scale_matrix, 784 * 96, 784 * 96, {.A = large}},
+        {"matrix_axpy 16x96", run_matrix_axpy, 2.0 * 16 * 96, 16 * 96, {.A = small, .B = small_other}},
+        {"matrix_axpy 784x96", run_matrix_axpy, 2.0 * 784 * 96, 784 * 96, {.A = large, .B = large_other}},
+        {"bias_activation sigmoid 16x96", run_bias_activation, 0, 16 * 96,
+         {.A = small, .B = small_bias, .C = small_out}},
+        {"bias_activation sigmoid 784x96", run_bias_activation, 0, 784 * 96,
+         {.A = large, .B = large_bias, .C = large_out}},
+        {"eval 784-16-16-10 batch 96", run_eval, 2.0 * 96 * (784 * 16 + 16 * 16 + 16 * 10), 10 * 96,
+         {.A = X, .neural_net = neural_net}},
+        {"eval_workspace 784-16-16-10 batch 96", run_eval_workspace, 2.0 * 96 * (784 * 16 + 16 * 16 + 16 * 10), 10 * 96,
+         {.A = X, .neural_net = neural_net, .workspace = workspace}},
+        {"eval_single 784-16-16-10", run_eval_single, 2.0 * (784 * 16 + 16 * 16 + 16 * 10), 10,
+         {.A = sample, .C = sample_output, .neural_net = neural_net}},
+        {"evaluate 784-16-16-10 10000 samples", run_evaluate, 2.0 * 10000 * (784 * 16 + 16 * 16 + 16 * 10), 10000,
+         {.A = X_test, .B = expected_test, .neural_net = softmax_net, .evaluation = evaluation}},
+        {"back_propagate 784-16-16-10 batch 96", run_back_propagate, 3 * 2.0 * 96 * (784 * 16 + 16 * 16 + 16 * 10),
+         96, {.A = X, .B = expected, .neural_net = neural_net}},
+        {"back_propagate adam 784-16-16-10 batch 96", run_back_propagate,
+         3 * 2.0 * 96 * (784 * 16 + 16 * 16 + 16 * 10), 96, {.A = X, .B = expected, .neural_net = adam_net}},
+        {"back_propagate softmax 784-16-16-10 batch 96", run_back_propagate,
+         3 * 2.0 * 96 * (784 * 16 + 16 * 16 + 16 * 10), 96, {.A = X, .B = expected, .neural_net = softmax_net}},
+        {"eval pruned 90% 784-16-16-10 batch 96", run_eval, 2.0 * 96 * pruned_weights, 10 * 96,
+         {.A = X, .neural_net = pruned_net}},
+        {"evaluate pruned 90% 784-16-16-10 10000 samples", run_evaluate, 2.0 * 10000 * pruned_weights, 10000,
+         {.A = X_test, .B = expected_test, .neural_net = pruned_net, .evaluation = evaluation}},
+        {"eval cnn 28x28 batch 96", run_eval, 96 * cnn_flops, 10 * 96, {.A = X, .neural_net = cnn}},
+        {"back_propagate cnn 28x28 batch 96", run_back_propagate, 3 * 96 * cnn_flops, 96,
+         {.A = X, .B = expected, .neural_net = cnn}},
+    };
+    int num_cases = sizeof(cases) / sizeof(cases[0]);
+
+    FILE *json = fopen(json_path, "w");
+    if (json == NULL)
+    {
+        perror(json_path);
+        return 1;
+    }
+    fprintf(json, "{\n  \"label\": ");
+    json_string(json, label);
+    fprintf(json, ",\n  \"isa\": \"%s\",\n  \"gemm_backend\": \"%s\",\n  \"threads\": %d,\n", matrix_get_isa(),
+            matrix_get_gemm_backend(), get_num_threads());
+    fprintf(json, "  \"runs\": %d,\n  \"results\": [\n", RUNS);
+
+    printf("isa %s, gemm backend %s, %d threads\n", matrix_get_isa(), matrix_get_gemm_backend(), get_num_threads());
+    printf("%-38s %12s %12s %10s %10s %10s\n", "case", "ns/call", "min ns/call", "GFLOP/s", "ns/elem", "allocs");
+    for (int c = 0; c < num_cases; ++c)
+    {
+        struct bench_result result = time_case(&cases[c]);
+        double ns_per_element = result.seconds * 1e9 / cases[c].elements;
+        char gflops[32] = "-", gflops_json[32] = "null";
+        if (cases[c].flops > 0)
+        {
+            snprintf(gflops, sizeof(gflops), "%.2f", cases[c].flops / result.seconds * 1e-9);
+            snprintf(gflops_json, sizeof(gflops_json), "%.3f", cases[c].flops / result.seconds * 1e-9);
+        }
+        printf("%-38s %12.1f %12.1f %10s %10.3f %10.2f\n", cases[c].name, result.seconds * 1e9,
+               result.min_seconds * 1e9, gflops, ns_per_element, result.allocations);
+        fprintf(json, "    {\"name\": ");
+        json_string(json, cases[c].name);
+        fprintf(json, ", \"ns_per_call\": %.1f, \"min_ns_per_call\": %.1f, \"gflops\": %s, \"ns_per_element\": %.4f, "
+                      "\"allocations_per_call\": %.2f}%s\n",
+                result.seconds * 1e9, result.min_seconds * 1e9, gflops_json, ns_per_element, result.allocations,
+                (c + 1 < num_cases) ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+    if (fclose(json) != 0)
+    {
+        perror(json_path);
+        return 1;
+    }
+    printf("wrote %s\n", json_path);
+
+    struct matrix *operands[] = {W0, W1, W2, X, H, dZ0, dZ2, X_test, square, Z0, Z2, Z_test, dW0, dA1, square_out,
+                                 X_transposed, square_transposed, small, small_other, small_ones, small_bias,
+                                 small_out, large, large_other, large_ones, large_bias, large_out, expected,
+                                 expected_test, sample, sample_output};
+    for (int i = 0; i < (int)(sizeof(operands) / sizeof(operands[0])); ++i)
+    {
+        destruct_matrix(operands[i]);
+    }
+    destruct_workspace(workspace);
+    destruct_neural_net(neural_net);
+    destruct_neural_net(adam_net);
+    destruct_neural_net(softmax_net);
+    destruct_neural_net(cnn);
+    destruct_neural_net(pruned_net);
+    destruct_evaluation(evaluation);
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * bench_codegen.c
+ *
+ * This file times the prediction function that nn_codegen generated from a
+ * checkpoint against eval_single and eval on the same network, and checks
+ * that they agree. Build with `make bench_codegen`, which generates
+ * mnist_model.c from mnist.nn (written by my_program) first.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "matrix.h"
+#include "bench_util.h"
+#include "neural_net.h"
+
+// Defined by the generated source.
+extern const int predict_num_layers;
+extern const int predict_layers[];
+void predict(const float *input, float *output);
+
+#define SAMPLES 1000
+
+enum path {
+    PATH_PREDICT,
+    PATH_EVAL_SINGLE,
+    PATH_EVAL
+};
+
+static void run(enum path path, struct neural_net *neural_net, struct matrix *column, float *output)
+{
+    switch (path)
+    {
+    case PATH_PREDICT:
+        predict(column->entries, output);
+        break;
+    case PATH_EVAL_SINGLE:
+        eval_single(neural_net, column->entries, output);
+        break;
+    case PATH_EVAL:
+        destruct_matrix(eval(neural_net, column));
+        break;
+    }
+}
+
+/*
+ * time_path
+ *
+ * Evaluates the samples in turn, after one warm-up pass, for at least 0.2 s.
+ *
+ * Returns:
+ * The mean time per sample in seconds.
+ */
+static double time_path(enum path path, struct neural_net *neural_net, struct matrix **columns, float *output)
+{
+    for (int i = 0; i < SAMPLES; ++i)
+    {
+        run(path, neural_net, columns[i], output);
+    }
+    long calls = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < SAMPLES; ++i)
+        {
+            run(path, neural_net, columns[i], output);
+        }
+        calls += SAMPLES;
+        elapsed = now() - start;
+    } while (elapsed < 0.2);
+    return elapsed / calls;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = (argc > 1) ? argv[1] : "mnist.nn";
+    struct neural_net *neural_net = load_neural_net(path);
+    if (neural_net == NULL)
+    {
+        return 1;
+    }
+    int mismatch = neural_net->num_layers != predict_num_layers;
+    for (int layer = 0; !mismatch && layer < predict_num_layers; ++layer)
+    {
+        mismatch = neural_net->layers[layer] != predict_layers[layer];
+    }
+    if (mismatch)
+    {
+        fprintf(stderr, "%s does not match the generated network; rerun nn_codegen\n", path);
+        destruct_neural_net(neural_net);
+        return 1;
+    }
+
+    int inputs = neural_net->layers[0];
+    int outputs = neural_net->layers[neural_net->num_layers - 1];
+    struct matrix *columns[SAMPLES];
+    for (int i = 0; i < SAMPLES; ++i)
+    {
+        columns[i] = construct_matrix(inputs, 1);
+        for (int entry = 0; entry < inputs; ++entry)
+        {
+            columns[i]->entries[entry] = (float)rand() / (float)RAND_MAX;
+        }
+    }
+
+    float output[outputs];
+    float difference = 0.0f;
+    for (int i = 0; i < SAMPLES; ++i)
+    {
+        struct matrix *expected = eval(neural_net, columns[i]);
+        predict(columns[i]->entries, output);
+        for (int row = 0; row < outputs; ++row)
+        {
+            float delta = fabsf(expected->entries[row] - output[row]);
+            difference = (delta > difference) ? delta : difference;
+        }
+        destruct_matrix(expected);
+    }
+
+    const char *names[] = {"predict (generated)", "eval_single", "eval"};
+    printf("%-22s %10s\n", "path", "ns/sample");
+    for (int p = PATH_PREDICT; p <= PATH_EVAL; ++p)
+    {
+        printf("%-22s %10.1f\n", names[p], time_path(p, neural_net, columns, output) * 1e9);
+    }
+    printf("max difference from eval: %g\n", difference);
+
+    for (int i = 0; i < SAMPLES; ++i)
+    {
+        destruct_matrix(columns[i]);
+    }
+    destruct_neural_net(neural_net);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * bench_gemm.c
+ *
+ * This file times gemm on the layer shapes of the MNIST example in main.c for
+ * every available backend, to show when linking a BLAS library pays off.
+ * Build with `make bench_gemm` or `make BLAS=openblas bench_gemm`.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "matrix.h"
+#include "bench_util.h"
+
+struct gemm_shape {
+    const char *name;
+    bool trans_a;
+    bool trans_b;
+    int m, n, k;
+};
+
+// The products one training step and one test-set evaluation of the
+// 784-16-16-10 network with batches of 96 perform.
+static const struct gemm_shape shapes[] = {
+    {"forward W0*X (16x784 * 784x96)", false, false, 16, 96, 784},
+    {"forward W1*A (16x16 * 16x96)", false, false, 16, 96, 16},
+    {"forward W2*A (10x16 * 16x96)", false, false, 10, 96, 16},
+    {"backward dW0 = dZ*X^T", false, true, 16, 784, 96},
+    {"backward dW2 = dZ*A^T", false, true, 10, 16, 96},
+    {"backward dA1 = W2^T*dZ", true, false, 16, 96, 10},
+    {"test eval W0*X (784 x 10000)", false, false, 16, 10000, 784},
+};
+
+/*
+ * time_gemm
+ *
+ * Runs a few warm-up calls, then repeats the product for at least 0.2 s.
+ *
+ * Returns:
+ * The mean time per call in seconds.
+ */
+static double time_gemm(const struct gemm_shape *shape, struct matrix *A, struct matrix *B, struct matrix *C)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        gemm(shape->trans_a, shape->trans_b, 1.0f, A, B, 0.0f, C);
+    }
+    int reps = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        gemm(shape->trans_a, shape->trans_b, 1.0f, A, B, 0.0f, C);
+        ++reps;
+        elapsed = now() - start;
+    } while (elapsed < 0.2);
+    return elapsed / reps;
+}
+
+int main()
+{
+    const char *backends[] = {"builtin", "cblas"};
+    printf("%-34s %-8s %-8s %12s %10s\n", "shape", "backend", "isa", "us/call", "GFLOP/s");
+    for (int s = 0; s < (int)(sizeof(shapes) / sizeof(shapes[0])); ++s)
+    {
+        const struct gemm_shape *shape = &shapes[s];
+        struct matrix *A = shape->trans_a ? random_matrix(shape->k, shape->m) : random_matrix(shape->m, shape->k);
+        struct matrix *B = shape->trans_b ? random_matrix(shape->n, shape->k) : random_matrix(shape->k, shape->n);
+        struct matrix *C = construct_matrix(shape->m, shape->n);
+        for (int b = 0; b < 2; ++b)
+        {
+            if (matrix_set_gemm_backend(backends[b]) != 0)
+            {
+                continue;
+            }
+            double seconds = time_gemm(shape, A, B, C);
+            double flops = 2.0 * shape->m * shape->n * shape->k;
+            printf("%-34s %-8s %-8s %12.2f %10.2f\n", shape->name, backends[b],
+                   (b == 0) ? matrix_get_isa() : "-", seconds * 1e6, flops / seconds * 1e-9);
+        }
+        destruct_matrix(A);
+        destruct_matrix(B);
+        destruct_matrix(C);
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * bench_util.c
+ *
+ * This file holds the clock and the input fixtures shared by the benchmark
+ * programs (bench.c, bench_gemm.c and bench_codegen.c).
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "matrix.h"
+#include "bench_util.h"
+
+/*
+ * now
+ *
+ * Returns the monotonic clock in seconds.
+ */
+double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*
+ * random_matrix
+ *
+ * Constructs a rows x cols matrix of values drawn uniformly from
+ * [-0.5, 0.5] with rand, so runs with the same seed see the same inputs.
+ */
+struct matrix *random_matrix(int rows, int cols)
+{
+    struct matrix *matrix = construct_matrix(rows, cols);
+    for (int entry = 0; entry < matrix->size; ++entry)
+    {
+        matrix->entries[entry] = (float)rand() / (float)RAND_MAX - 0.5f;
+    }
+    return matrix;
+}
+
+/*
+ * filled_matrix
+ *
+ * Constructs a rows x cols matrix with every entry set to value.
+ */
+struct matrix *filled_matrix(int rows, int cols, float value)
+{
+    struct matrix *matrix = construct_matrix(rows, cols);
+    for (int entry = 0; entry < matrix->size; ++entry)
+    {
+        matrix->entries[entry] = value;
+    }
+    return matrix;
+}
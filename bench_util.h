@@ -0,0 +1,11 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include "matrix.h"
+
+// Function declarations
+double now(void);
+struct matrix *random_matrix(int rows, int cols);
+struct matrix *filled_matrix(int rows, int cols, float value);
+
+#endif // BENCH_UTIL_H
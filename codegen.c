@@ -0,0 +1,427 @@
+/*
+ * codegen.c
+ *
+ * This file turns a trained network into a standalone C source file: the
+ * weights become static const arrays, the loops get the exact layer shapes as
+ * constants and the activations are inlined, so the result needs no heap, no
+ * runtime dispatch and nothing from this library.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "codegen.h"
+#include "matrix.h"
+#include "neural_net.h"
+
+// Expressions for the activations, with the same definitions as neural_net.c.
+// Softmax has no scalar form: write_softmax normalizes the logits instead.
+static const char *const activation_names[] = {"sigmoid", "relu", "tanh", "softmax"};
+static const char *const activation_bodies[] = {
+    "1.0f / (1.0f + expf(-x))",
+    "(x > 0.0f) ? x : 0.01f * x",
+    "tanhf(x)",
+};
+
+static int panels(int rows)
+{
+    return (rows + CODEGEN_PANEL_ROWS - 1) / CODEGEN_PANEL_ROWS;
+}
+
+// Whether an input of a panel has a nonzero weight in any of its rows.
+static bool panel_column_kept(struct matrix *weights, int panel, int col)
+{
+    for (int i = 0; i < CODEGEN_PANEL_ROWS; ++i)
+    {
+        int row = panel * CODEGEN_PANEL_ROWS + i;
+        if (row < weights->rows && weights->entries[(size_t)row * weights->cols + col] != 0.0f)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int kept_columns(struct matrix *weights)
+{
+    int kept = 0;
+    for (int panel = 0; panel < panels(weights->rows); ++panel)
+    {
+        for (int col = 0; col < weights->cols; ++col)
+        {
+            kept += panel_column_kept(weights, panel, col);
+        }
+    }
+    return kept;
+}
+
+/*
+ * sparse_layer
+ *
+ * Whether a layer is generated in sparse form: its panels keep at most
+ * SPARSE_MAX_DENSITY of their columns, as after prune_neural_net.
+ */
+static bool sparse_layer(struct matrix *weights)
+{
+    return kept_columns(weights) <= SPARSE_MAX_DENSITY * panels(weights->rows) * weights->cols;
+}
+
+// Bytes of constant data the weights of a layer take in the generated file.
+static size_t weight_bytes(struct matrix *weights)
+{
+    size_t padded = (size_t)panels(weights->rows) * CODEGEN_PANEL_ROWS;
+    if (!sparse_layer(weights))
+    {
+        return (padded * weights->cols + padded) * sizeof(float);
+    }
+    size_t index_size = (weights->cols <= 65536) ? sizeof(unsigned short) : sizeof(int);
+    return (size_t)kept_columns(weights) * (CODEGEN_PANEL_ROWS * sizeof(float) + index_size) +
+           (panels(weights->rows) + 1) * sizeof(int) + padded * sizeof(float);
+}
+
+/*
+ * write_weights
+ *
+ * Writes the weights of one layer as panels of CODEGEN_PANEL_ROWS rows
+ * interleaved along the inputs, one input per line, and its biases padded to
+ * whole panels. Rows past the end of the layer are zero. A sparse layer keeps
+ * only the inputs of each panel with a nonzero weight, listed in
+ * name_columns_layer, and name_starts_layer gives where each panel's inputs
+ * begin.
+ */
+static void write_weights(FILE *out, const char *name, int layer, struct matrix *weights, struct matrix *biases)
+{
+    bool sparse = sparse_layer(weights);
+    if (sparse)
+    {
+        fprintf(out, "static const int %s_starts_%d[%d] = {\n   ", name, layer, panels(weights->rows) + 1);
+        int start = 0;
+        for (int panel = 0; panel < panels(weights->rows); ++panel)
+        {
+            fprintf(out, " %d,", start);
+            for (int col = 0; col < weights->cols; ++col)
+            {
+                start += panel_column_kept(weights, panel, col);
+            }
+        }
+        fprintf(out, " %d,\n};\n\n", start);
+        fprintf(out, "static const %s %s_columns_%d[%d] = {\n", (weights->cols <= 65536) ? "unsigned short" : "int", name,
+                layer, (start > 0) ? start : 1);
+        for (int panel = 0; panel < panels(weights->rows); ++panel)
+        {
+            fprintf(out, "   ");
+            for (int col = 0; col < weights->cols; ++col)
+            {
+                if (panel_column_kept(weights, panel, col))
+                {
+                    fprintf(out, " %d,", col);
+                }
+            }
+            fprintf(out, "\n");
+        }
+        fprintf(out, "};\n\n");
+    }
+    fprintf(out, "static const float %s_weights_%d[%d] = {\n", name, layer,
+            (sparse ? ((kept_columns(weights) > 0) ? kept_columns(weights) : 1) : panels(weights->rows) * weights->cols) *
+                CODEGEN_PANEL_ROWS);
+    for (int panel = 0; panel < panels(weights->rows); ++panel)
+    {
+        for (int col = 0; col < weights->cols; ++col)
+        {
+            if (sparse && !panel_column_kept(weights, panel, col))
+            {
+                continue;
+            }
+            fprintf(out, "   ");
+            for (int i = 0; i < CODEGEN_PANEL_ROWS; ++i)
+            {
+                int row = panel * CODEGEN_PANEL_ROWS + i;
+                float value = (row < weights->rows) ? weights->entries[(size_t)row * weights->cols + col] : 0.0f;
+                fprintf(out, " %.8ef,", value);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const float %s_biases_%d[%d] = {\n   ", name, layer, panels(biases->rows) * CODEGEN_PANEL_ROWS);
+    for (int row = 0; row < panels(biases->rows) * CODEGEN_PANEL_ROWS; ++row)
+    {
+        fprintf(out, " %.8ef,", (row < biases->rows) ? biases->entries[row] : 0.0f);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+/*
+ * write_panel_store
+ *
+ * Writes the end of the loop body of a panel: the accumulated sum of each
+ * row plus its bias, through the activation, stored to the output. Hidden
+ * layers fill whole panels; the last layer stores only its real rows.
+ */
+static void write_panel_store(FILE *out, const char *name, int layer, int rows, enum activation activation,
+                              const char *output, bool last, const char *sum)
+{
+    if (last && rows % CODEGEN_PANEL_ROWS != 0)
+    {
+        fprintf(out, "        for (int i = 0; i < %d && panel * %d + i < %d; ++i)\n", CODEGEN_PANEL_ROWS, CODEGEN_PANEL_ROWS, rows);
+    }
+    else
+    {
+        fprintf(out, "        for (int i = 0; i < %d; ++i)\n", CODEGEN_PANEL_ROWS);
+    }
+    fprintf(out, "        {\n");
+    fprintf(out, "            int row = panel * %d + i;\n", CODEGEN_PANEL_ROWS);
+    if (activation == ACTIVATION_SOFTMAX)
+    {
+        fprintf(out, "            %s[row] = %s + %s_biases_%d[row];\n", output, sum, name, layer);
+    }
+    else
+    {
+        fprintf(out, "            %s[row] = %s_%s(%s + %s_biases_%d[row]);\n", output, name, activation_names[activation], sum,
+                name, layer);
+    }
+    fprintf(out, "        }\n");
+}
+
+/*
+ * write_layer
+ *
+ * Writes the loop nest of one layer inside the prediction function. Each
+ * input multiplies the CODEGEN_PANEL_ROWS consecutive weights of a panel, and
+ * four consecutive inputs feed four separate accumulator arrays, so the loop
+ * over the panel rows vectorizes without reordering any additions.
+ */
+static void write_layer(FILE *out, const char *name, int layer, int rows, int cols, enum activation activation,
+                        const char *input, const char *output, bool last)
+{
+    int unrolled = cols / 4 * 4;
+    fprintf(out, "    // Layer %d: %d -> %d, %s\n", layer, cols, rows, activation_names[activation]);
+    fprintf(out, "    for (int panel = 0; panel < %d; ++panel)\n", panels(rows));
+    fprintf(out, "    {\n");
+    fprintf(out, "        const float *w = %s_weights_%d + panel * %d;\n", name, layer, cols * CODEGEN_PANEL_ROWS);
+    fprintf(out, "        float acc0[%d] = {0}, acc1[%d] = {0}, acc2[%d] = {0}, acc3[%d] = {0};\n", CODEGEN_PANEL_ROWS,
+            CODEGEN_PANEL_ROWS, CODEGEN_PANEL_ROWS, CODEGEN_PANEL_ROWS);
+    if (unrolled > 0)
+    {
+        fprintf(out, "        for (int k = 0; k < %d; k += 4)\n", unrolled);
+        fprintf(out, "        {\n");
+        fprintf(out, "            for (int i = 0; i < %d; ++i)\n", CODEGEN_PANEL_ROWS);
+        fprintf(out, "            {\n");
+        fprintf(out, "                acc0[i] += w[k * %d + i] * %s[k];\n", CODEGEN_PANEL_ROWS, input);
+        for (int u = 1; u < 4; ++u)
+        {
+            fprintf(out, "                acc%d[i] += w[(k + %d) * %d + i] * %s[k + %d];\n", u, u, CODEGEN_PANEL_ROWS, input, u);
+        }
+        fprintf(out, "            }\n");
+        fprintf(out, "        }\n");
+    }
+    if (unrolled < cols)
+    {
+        fprintf(out, "        for (int k = %d; k < %d; ++k)\n", unrolled, cols);
+        fprintf(out, "        {\n");
+        fprintf(out, "            for (int i = 0; i < %d; ++i)\n", CODEGEN_PANEL_ROWS);
+        fprintf(out, "            {\n");
+        fprintf(out, "                acc0[i] += w[k * %d + i] * %s[k];\n", CODEGEN_PANEL_ROWS, input);
+        fprintf(out, "            }\n");
+        fprintf(out, "        }\n");
+    }
+    write_panel_store(out, name, layer, rows, activation, output, last, "(acc0[i] + acc1[i]) + (acc2[i] + acc3[i])");
+    fprintf(out, "    }\n");
+}
+
+/*
+ * write_sparse_layer
+ *
+ * Writes the loop nest of a layer generated in sparse form: each panel
+ * gathers only the inputs it keeps, so the work and the weights read scale
+ * with the kept columns.
+ */
+static void write_sparse_layer(FILE *out, const char *name, int layer, int rows, int cols, enum activation activation,
+                               const char *input, const char *output, bool last)
+{
+    fprintf(out, "    // Layer %d: %d -> %d, %s, sparse\n", layer, cols, rows, activation_names[activation]);
+    fprintf(out, "    for (int panel = 0; panel < %d; ++panel)\n", panels(rows));
+    fprintf(out, "    {\n");
+    fprintf(out, "        float acc0[%d] = {0};\n", CODEGEN_PANEL_ROWS);
+    fprintf(out, "        for (int k = %s_starts_%d[panel]; k < %s_starts_%d[panel + 1]; ++k)\n", name, layer, name, layer);
+    fprintf(out, "        {\n");
+    fprintf(out, "            const float x = %s[%s_columns_%d[k]];\n", input, name, layer);
+    fprintf(out, "            for (int i = 0; i < %d; ++i)\n", CODEGEN_PANEL_ROWS);
+    fprintf(out, "            {\n");
+    fprintf(out, "                acc0[i] += %s_weights_%d[k * %d + i] * x;\n", name, layer, CODEGEN_PANEL_ROWS);
+    fprintf(out, "            }\n");
+    fprintf(out, "        }\n");
+    write_panel_store(out, name, layer, rows, activation, output, last, "acc0[i]");
+    fprintf(out, "    }\n");
+}
+
+/*
+ * write_softmax
+ *
+ * Writes the normalization of a softmax output layer whose logits are already
+ * in output, with the largest logit subtracted before exponentiating.
+ */
+static void write_softmax(FILE *out, int rows, const char *output)
+{
+    fprintf(out, "    float top = %s[0];\n", output);
+    fprintf(out, "    for (int row = 1; row < %d; ++row)\n", rows);
+    fprintf(out, "    {\n");
+    fprintf(out, "        top = (%s[row] > top) ? %s[row] : top;\n", output, output);
+    fprintf(out, "    }\n");
+    fprintf(out, "    float total = 0.0f;\n");
+    fprintf(out, "    for (int row = 0; row < %d; ++row)\n", rows);
+    fprintf(out, "    {\n");
+    fprintf(out, "        %s[row] = expf(%s[row] - top);\n", output, output);
+    fprintf(out, "        total += %s[row];\n", output);
+    fprintf(out, "    }\n");
+    fprintf(out, "    for (int row = 0; row < %d; ++row)\n", rows);
+    fprintf(out, "    {\n");
+    fprintf(out, "        %s[row] /= total;\n", output);
+    fprintf(out, "    }\n");
+}
+
+/*
+ * generate_neural_net_source
+ *
+ * Writes a C source file that evaluates a trained network on one sample with
+ * the function
+ *
+ *     void name(const float *input, float *output);
+ *
+ * and also defines name_num_layers and name_layers with the topology. The
+ * file includes only <math.h>.
+ *
+ * Parameters:
+ * neural_net: A pointer to the trained network.
+ * path: The path of the source file to write.
+ * name: The name of the prediction function, which also prefixes every
+ *       other symbol in the file.
+ * origin: A description of where the network came from, such as the
+ *         checkpoint path, for the file's header comment.
+ *
+ * Returns:
+ * 0 on success, or -1 if the network has convolution or pooling layers,
+ * which are not supported, or the file cannot be written.
+ *
+ * Side effects:
+ * Creates or overwrites the source file.
+ */
+int generate_neural_net_source(struct neural_net *neural_net, const char *path, const char *name, const char *origin)
+{
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            fprintf(stderr, "%s: layer %d is not dense; only dense networks can be generated\n", origin, layer);
+            return -1;
+        }
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    int num_layers = neural_net->num_layers;
+    size_t constant_bytes = 0;
+    size_t stack_floats = 0;
+    bool used[4] = {false, false, false, false};
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        int padded = panels(neural_net->layers[layer + 1]) * CODEGEN_PANEL_ROWS;
+        constant_bytes += weight_bytes(neural_net->weights[layer]);
+        stack_floats += (layer < num_layers - 2) ? padded : 0;
+        used[neural_net->activation_types[layer]] = true;
+    }
+
+    fprintf(out, "/*\n * Generated by nn_codegen from %s; do not edit.\n *\n * Network:", origin);
+    for (int layer = 0; layer < num_layers; ++layer)
+    {
+        fprintf(out, "%s%d", (layer == 0) ? " " : "-", neural_net->layers[layer]);
+    }
+    fprintf(out, ", activations");
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        fprintf(out, "%s%s", (layer == 0) ? " " : ", ", activation_names[neural_net->activation_types[layer]]);
+    }
+    fprintf(out, ".\n *\n");
+    fprintf(out, " * void %s(const float input[%d], float output[%d]);\n *\n", name, neural_net->layers[0],
+            neural_net->layers[num_layers - 1]);
+    fprintf(out, " * Weights are stored as panels of %d rows interleaved along the inputs\n", CODEGEN_PANEL_ROWS);
+    fprintf(out, " * (%zu bytes of constant data); sparse layers keep only the inputs of each\n", constant_bytes);
+    fprintf(out, " * panel that have a nonzero weight. %s uses no heap and %zu bytes of stack\n", name,
+            stack_floats * sizeof(float));
+    fprintf(out, " * for hidden activations.\n */\n\n");
+    fprintf(out, "#include <math.h>\n\n");
+
+    fprintf(out, "const int %s_num_layers = %d;\n", name, num_layers);
+    fprintf(out, "const int %s_layers[%d] = {", name, num_layers);
+    for (int layer = 0; layer < num_layers; ++layer)
+    {
+        fprintf(out, "%s%d", (layer == 0) ? "" : ", ", neural_net->layers[layer]);
+    }
+    fprintf(out, "};\n\n");
+
+    for (int activation = 0; activation < ACTIVATION_SOFTMAX; ++activation)
+    {
+        if (used[activation])
+        {
+            fprintf(out, "static inline float %s_%s(float x)\n{\n    return %s;\n}\n\n", name, activation_names[activation],
+                    activation_bodies[activation]);
+        }
+    }
+
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        write_weights(out, name, layer, neural_net->weights[layer], neural_net->biases[layer]);
+    }
+
+    fprintf(out, "void %s(const float *input, float *output)\n{\n", name);
+    for (int layer = 1; layer < num_layers - 1; ++layer)
+    {
+        fprintf(out, "    float hidden_%d[%d];\n", layer, panels(neural_net->layers[layer]) * CODEGEN_PANEL_ROWS);
+    }
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        char input[32] = "input", output[32] = "output";
+        if (layer > 0)
+        {
+            snprintf(input, sizeof(input), "hidden_%d", layer);
+        }
+        if (layer < num_layers - 2)
+        {
+            snprintf(output, sizeof(output), "hidden_%d", layer + 1);
+        }
+        fprintf(out, "\n");
+        if (sparse_layer(neural_net->weights[layer]))
+        {
+            write_sparse_layer(out, name, layer, neural_net->layers[layer + 1], neural_net->layers[layer],
+                               neural_net->activation_types[layer], input, output, layer == num_layers - 2);
+        }
+        else
+        {
+            write_layer(out, name, layer, neural_net->layers[layer + 1], neural_net->layers[layer],
+                        neural_net->activation_types[layer], input, output, layer == num_layers - 2);
+        }
+    }
+    if (neural_net->activation_types[num_layers - 2] == ACTIVATION_SOFTMAX)
+    {
+        fprintf(out, "\n");
+        write_softmax(out, neural_net->layers[num_layers - 1], "output");
+    }
+    fprintf(out, "}\n");
+
+    int status = 0;
+    if (ferror(out))
+    {
+        perror(path);
+        status = -1;
+    }
+    if (fclose(out) != 0)
+    {
+        status = -1;
+    }
+    return status;
+}
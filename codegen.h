@@ -0,0 +1,12 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include "neural_net.h"
+
+// Rows per panel of the weights in generated sources.
+#define CODEGEN_PANEL_ROWS 8
+
+// Function declarations
+int generate_neural_net_source(struct neural_net *neural_net, const char *path, const char *name, const char *origin);
+
+#endif // CODEGEN_H
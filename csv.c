@@ -1,17 +1,604 @@
-#include <stdio.h>
+/*
+ * csv.c
+ *
+ * This file implements a parallel CSV reader. The file is memory-mapped and
+ * split on line boundaries into chunks; one pass counts the rows of every
+ * chunk, and a second parses them on the thread pool, each chunk writing its
+ * rows straight into the destination at the row index it was given.
+ */
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "csv.h"
+#include "thread_pool.h"
+
+// Chunks are at least this large so that tiny files are not split at all.
+#define MIN_CHUNK_BYTES (64 * 1024)
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static bool is_digit(char c)
+{
+    return (unsigned)(c - '0') < 10;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// The start of the line after the one containing p, or end.
+static const char *next_line(const char *p, const char *end)
+{
+    const char *newline = memchr(p, '\n', end - p);
+    return (newline != NULL) ? newline + 1 : end;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * digit_run
+ *
+ * Returns the number of leading ASCII digits among the 8 bytes of chunk, the
+ * first byte in memory being the least significant. A byte is a digit when its
+ * high nibble is 3 both before and after adding 6; a carry out of a non-digit
+ * byte only disturbs the bytes after it.
+ */
+static int digit_run(uint64_t chunk)
+{
+    uint64_t high = chunk & 0xF0F0F0F0F0F0F0F0ULL;
+    uint64_t shifted = (chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL;
+    uint64_t bad = (high ^ 0x3030303030303030ULL) | (shifted ^ 0x3030303030303030ULL);
+    return (bad != 0) ? __builtin_ctzll(bad) / 8 : 8;
+}
+
+/*
+ * eight_digits
+ *
+ * Combines 8 digit values, one per byte with the most significant first in
+ * memory, into their integer value using three multiplies.
+ */
+static uint64_t eight_digits(uint64_t digits)
+{
+    digits = (digits * 10 + (digits >> 8)) & 0x00FF00FF00FF00FFULL;
+    digits = (digits * 100 + (digits >> 16)) & 0x0000FFFF0000FFFFULL;
+    return (digits * 10000 + (digits >> 32)) & 0xFFFFFFFFULL;
+}
+#endif
+
+/*
+ * scan_digits
+ *
+ * Appends the run of digits at p to *mantissa. Runs are consumed 8 bytes at a
+ * time while they fit, then one byte at a time. Only the first 19 significant
+ * digits fit in the mantissa; later ones are counted in *dropped.
+ *
+ * Returns:
+ * A pointer to the first byte after the run.
+ */
+static const char *scan_digits(const char *p, const char *end, uint64_t *mantissa, int *significant, int *dropped)
+{
+    static const uint64_t powers[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+    uint64_t value = *mantissa;
+    int count = *significant;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - p >= 8 && count <= 11)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+        int run = digit_run(chunk);
+        if (run == 0)
+        {
+            break;
+        }
+        // Moving the run to the top bytes turns the bytes before it into
+        // leading zeros.
+        uint64_t digits = (chunk & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - run));
+        value = value * powers[run] + eight_digits(digits);
+        count += (value != 0) ? run : 0;
+        p += run;
+        if (run < 8)
+        {
+            *mantissa = value;
+            *significant = count;
+            return p;
+        }
+    }
+#endif
+    for (; p < end && is_digit(*p); ++p)
+    {
+        if (count < 19)
+        {
+            value = value * 10 + (*p - '0');
+            count += (value != 0);
+        }
+        else
+        {
+            ++*dropped;
+        }
+    }
+    *mantissa = value;
+    *significant = count;
+    return p;
+}
+
+static double power_of_10(int exponent)
+{
+    static const double exact[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    return (exponent < 23) ? exact[exponent] : pow(10.0, exponent);
+}
+
+/*
+ * parse_value
+ *
+ * Parses a decimal number with an optional sign, fraction and exponent.
+ *
+ * Returns:
+ * A pointer to the first byte after the number, or NULL if p does not start
+ * with one.
+ */
+static const char *parse_value(const char *p, const char *end, float *value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Fast path for short unsigned integers, which is most of a typical file:
+    // one load, no branches on the number of digits and no floating point.
+    if (end - p >= 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, p, 8);
+        int run = digit_run(chunk);
+        if (run > 0 && run < 8 && p[run] != '.' && p[run] != 'e' && p[run] != 'E')
+        {
+            *value = (float)eight_digits((chunk & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - run)));
+            return p + run;
+        }
+    }
+#endif
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        ++p;
+    }
+
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int dropped = 0;
+    const char *start = p;
+    p = scan_digits(p, end, &mantissa, &significant, &dropped);
+    ptrdiff_t digits = p - start;
+    int exponent = dropped;
+    if (p < end && *p == '.')
+    {
+        const char *fraction = ++p;
+        dropped = 0;
+        p = scan_digits(p, end, &mantissa, &significant, &dropped);
+        digits += p - fraction;
+        exponent -= (int)(p - fraction) - dropped;
+    }
+    if (digits == 0)
+    {
+        return NULL;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative_exponent = (*p == '-');
+            ++p;
+        }
+        if (p == end || !is_digit(*p))
+        {
+            return NULL;
+        }
+        int power = 0;
+        for (; p < end && is_digit(*p); ++p)
+        {
+            power = (power < 10000) ? power * 10 + (*p - '0') : power;
+        }
+        exponent += negative_exponent ? -power : power;
+    }
+
+    double result = (double)mantissa;
+    if (mantissa != 0 && exponent > 0)
+    {
+        result *= power_of_10(exponent);
+    }
+    else if (mantissa != 0 && exponent < 0)
+    {
+        result /= power_of_10(-exponent);
+    }
+    *value = (float)(negative ? -result : result);
+    return p;
+}
+
+/*
+ * parse_line
+ *
+ * Parses one row of exactly num_cols comma separated values into values.
+ *
+ * Returns:
+ * A pointer to the start of the next line, or NULL if the row is malformed.
+ */
+static const char *parse_line(const char *p, const char *end, int num_cols, float *values)
+{
+    for (int col = 0; col < num_cols; ++col)
+    {
+        while (p < end && is_blank(*p))
+        {
+            ++p;
+        }
+        p = parse_value(p, end, &values[col]);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        while (p < end && is_blank(*p))
+        {
+            ++p;
+        }
+        if (col + 1 < num_cols)
+        {
+            if (p == end || *p != ',')
+            {
+                return NULL;
+            }
+            ++p;
+        }
+    }
+    if (p < end && *p == '\r')
+    {
+        ++p;
+    }
+    if (p < end && *p++ != '\n')
+    {
+        return NULL;
+    }
+    return p;
+}
 
-int main()
-{
-    FILE *file;
-    int character;
-    file = fopen("mnist_test.csv", "r");
-    printf("%d\n", (int) fgetc(file) - 48);
-    fgetc(file);
-    printf("%d\n", (int) fgetc(file) - 48);
-    // while ((character = fgetc(file)) != EOF)
-    // {
-    //     printf((int) character);              // It displays the right character (UTF8) in the terminal
-    // }
-    return 0;
-}
\ No newline at end of file
+static void count_task(int index, void *arg)
+{
+    struct csv *csv = arg;
+    const char *p = csv->data + csv->chunk_offsets[index];
+    const char *end = csv->data + csv->chunk_offsets[index + 1];
+    int rows = 0;
+    while (p < end)
+    {
+        rows += (*p != '\n' && *p != '\r');
+        p = next_line(p, end);
+    }
+    csv->chunk_rows[index + 1] = rows;
+}
+
+/*
+ * open_csv
+ *
+ * Maps a CSV file, detects a header row, takes the column count from the first
+ * data row and counts the rows of every chunk in parallel.
+ *
+ * Parameters:
+ * path: The path of the CSV file.
+ *
+ * Returns:
+ * A pointer to the opened file, or NULL if it cannot be read.
+ *
+ * Side effects:
+ * Maps the file read-only until close_csv.
+ */
+struct csv *open_csv(const char *path)
+{
+    double start = now();
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    const char *data = "";
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+        madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    struct csv *csv = malloc(sizeof(struct csv));
+    csv->path = strdup(path);
+    csv->data = data;
+    csv->size = st.st_size;
+    const char *end = data + csv->size;
+
+    // A header row is any first line that does not start with a number.
+    const char *body = data;
+    while (body < end && is_blank(*body))
+    {
+        ++body;
+    }
+    csv->header = (body < end && !is_digit(*body) && *body != '-' && *body != '+' && *body != '.' &&
+                   *body != '\n' && *body != '\r');
+    body = csv->header ? next_line(data, end) : data;
+
+    const char *first = body;
+    while (first < end && (*first == '\n' || *first == '\r'))
+    {
+        first = next_line(first, end);
+    }
+    csv->num_cols = 0;
+    if (first < end)
+    {
+        const char *line_end = next_line(first, end);
+        csv->num_cols = 1;
+        for (const char *c = first; c < line_end; ++c)
+        {
+            csv->num_cols += (*c == ',');
+        }
+    }
+
+    size_t body_size = end - body;
+    int num_chunks = 4 * get_num_threads();
+    if ((size_t)num_chunks > body_size / MIN_CHUNK_BYTES)
+    {
+        num_chunks = (body_size / MIN_CHUNK_BYTES > 0) ? (int)(body_size / MIN_CHUNK_BYTES) : 1;
+    }
+    csv->num_chunks = num_chunks;
+    csv->chunk_offsets = malloc((num_chunks + 1) * sizeof(size_t));
+    csv->chunk_rows = malloc((num_chunks + 1) * sizeof(int));
+    csv->chunk_offsets[0] = body - data;
+    for (int chunk = 1; chunk < num_chunks; ++chunk)
+    {
+        const char *split = next_line(body + body_size * chunk / num_chunks, end);
+        csv->chunk_offsets[chunk] = split - data;
+        if (csv->chunk_offsets[chunk] < csv->chunk_offsets[chunk - 1])
+        {
+            csv->chunk_offsets[chunk] = csv->chunk_offsets[chunk - 1];
+        }
+    }
+    csv->chunk_offsets[num_chunks] = csv->size;
+
+    parallel_for(num_chunks, count_task, csv);
+    csv->chunk_rows[0] = 0;
+    for (int chunk = 0; chunk < num_chunks; ++chunk)
+    {
+        csv->chunk_rows[chunk + 1] += csv->chunk_rows[chunk];
+    }
+    csv->num_rows = csv->chunk_rows[num_chunks];
+    csv->seconds = now() - start;
+    return csv;
+}
+
+/*
+ * close_csv
+ *
+ * Unmaps a CSV file and deallocates it.
+ */
+void close_csv(struct csv *csv)
+{
+    if (csv->size > 0)
+    {
+        munmap((void *)csv->data, csv->size);
+    }
+    free(csv->chunk_offsets);
+    free(csv->chunk_rows);
+    free(csv->path);
+    free(csv);
+}
+
+// Where parsed rows go: either a column-per-sample batch or uint8 arrays.
+struct parse_job {
+    struct csv *csv;
+    float scale;
+    struct matrix *inputs;
+    struct matrix *outputs;
+    uint8_t *labels;
+    uint8_t *features;
+    int *error_rows;          // Per chunk, the first bad row or -1
+    const char **errors;      // Per chunk, what was wrong with it
+};
+
+static bool is_byte(float value)
+{
+    return value >= 0.0f && value <= 255.0f && value == (float)(int)value;
+}
+
+// Stores one parsed row, returning an error message or NULL.
+static const char *store_row(struct parse_job *job, int row, const float *values)
+{
+    if (job->labels != NULL)
+    {
+        int num_features = job->csv->num_cols - 1;
+        if (!is_byte(values[0]))
+        {
+            return "label is not an integer in [0, 255]";
+        }
+        job->labels[row] = (uint8_t)values[0];
+        uint8_t *sample = job->features + (size_t)row * num_features;
+        for (int feature = 0; feature < num_features; ++feature)
+        {
+            if (!is_byte(values[feature + 1]))
+            {
+                return "feature is not an integer in [0, 255]";
+            }
+            sample[feature] = (uint8_t)values[feature + 1];
+        }
+        return NULL;
+    }
+
+    int first = 0;
+    if (job->outputs != NULL)
+    {
+        struct matrix *outputs = job->outputs;
+        int label = (int)values[0];
+        if (values[0] != (float)label || label < 0 || label >= outputs->rows)
+        {
+            return "label is not a class index";
+        }
+        for (int class = 0; class < outputs->rows; ++class)
+        {
+            outputs->entries[(size_t)class * outputs->cols + row] = (class == label) ? 1.0f : 0.0f;
+        }
+        first = 1;
+    }
+    struct matrix *inputs = job->inputs;
+    for (int feature = 0; feature < inputs->rows; ++feature)
+    {
+        inputs->entries[(size_t)feature * inputs->cols + row] = values[first + feature] * job->scale;
+    }
+    return NULL;
+}
+
+static void parse_task(int index, void *arg)
+{
+    struct parse_job *job = arg;
+    struct csv *csv = job->csv;
+    const char *p = csv->data + csv->chunk_offsets[index];
+    const char *end = csv->data + csv->chunk_offsets[index + 1];
+    int row = csv->chunk_rows[index];
+    float *values = malloc(csv->num_cols * sizeof(float));
+    job->error_rows[index] = -1;
+    while (p < end)
+    {
+        if (*p == '\n' || *p == '\r')
+        {
+            p = next_line(p, end);
+            continue;
+        }
+        const char *error = NULL;
+        const char *next = parse_line(p, end, csv->num_cols, values);
+        if (next == NULL)
+        {
+            error = "wrong number of values or not a number";
+        }
+        else
+        {
+            error = store_row(job, row, values);
+        }
+        if (error != NULL)
+        {
+            job->error_rows[index] = row;
+            job->errors[index] = error;
+            break;
+        }
+        p = next;
+        ++row;
+    }
+    free(values);
+}
+
+// Parses every chunk in parallel and reports the first bad row, if any.
+static int run_parse(struct parse_job *job)
+{
+    struct csv *csv = job->csv;
+    double start = now();
+    job->error_rows = malloc(csv->num_chunks * sizeof(int));
+    job->errors = malloc(csv->num_chunks * sizeof(const char *));
+    parallel_for(csv->num_chunks, parse_task, job);
+    csv->seconds += now() - start;
+
+    int status = 0;
+    for (int chunk = 0; chunk < csv->num_chunks; ++chunk)
+    {
+        if (job->error_rows[chunk] >= 0)
+        {
+            fprintf(stderr, "%s: data row %d of %d columns: %s\n", csv->path, job->error_rows[chunk] + 1,
+                    csv->num_cols, job->errors[chunk]);
+            status = -1;
+            break;
+        }
+    }
+    free(job->error_rows);
+    free(job->errors);
+    return status;
+}
+
+/*
+ * csv_read_batch
+ *
+ * Parses every row into the column-per-sample layout used for training: row i
+ * becomes column i of inputs and, if outputs is given, the first value of the
+ * row is one-hot encoded into column i of outputs.
+ *
+ * Parameters:
+ * csv: A pointer to the opened file.
+ * scale: The factor applied to every feature, e.g. 1/255 for pixels.
+ * inputs: A matrix with one row per feature and num_rows columns.
+ * outputs: A matrix with one row per class and num_rows columns, or NULL if
+ *          every column of the file is a feature.
+ *
+ * Returns:
+ * 0 on success, or -1 if a row is malformed or a label is out of range.
+ *
+ * Side effects:
+ * Overwrites inputs and outputs.
+ */
+int csv_read_batch(struct csv *csv, float scale, struct matrix *inputs, struct matrix *outputs)
+{
+    int first = (outputs != NULL) ? 1 : 0;
+    if (inputs->rows != csv->num_cols - first || inputs->cols != csv->num_rows ||
+        (outputs != NULL && outputs->cols != csv->num_rows))
+    {
+        fprintf(stderr, "%s: %d rows of %d values do not fit the batch\n", csv->path, csv->num_rows, csv->num_cols);
+        return -1;
+    }
+    struct parse_job job = {.csv = csv, .scale = scale, .inputs = inputs, .outputs = outputs};
+    return run_parse(&job);
+}
+
+/*
+ * csv_read_bytes
+ *
+ * Parses every row as a label followed by features that are integers in
+ * [0, 255], which is what the binary dataset format stores.
+ *
+ * Parameters:
+ * csv: A pointer to the opened file.
+ * labels: Receives num_rows labels.
+ * features: Receives num_rows x (num_cols - 1) features, one row per sample.
+ *
+ * Returns:
+ * 0 on success, or -1 if a row is malformed or a value is out of range.
+ *
+ * Side effects:
+ * Overwrites labels and features.
+ */
+int csv_read_bytes(struct csv *csv, uint8_t *labels, uint8_t *features)
+{
+    struct parse_job job = {.csv = csv, .labels = labels, .features = features};
+    return (csv->num_rows == 0) ? 0 : run_parse(&job);
+}
+
+/*
+ * csv_throughput
+ *
+ * Returns the rate at which the file was scanned and parsed, in MB/s.
+ */
+double csv_throughput(const struct csv *csv)
+{
+    return (csv->seconds > 0) ? csv->size / csv->seconds / 1e6 : 0.0;
+}
@@ -0,0 +1,35 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+ * A CSV file mapped into memory and split on line boundaries into chunks that
+ * are parsed in parallel. Rows are counted when the file is opened, so every
+ * chunk knows the index of its first row and can write its values straight
+ * into their final place.
+ */
+struct csv {
+    char *path;
+    const char *data;
+    size_t size;
+    bool header;            // The first line is a header row and is skipped
+    int num_cols;           // Values per row, taken from the first data row
+    int num_rows;           // Non-blank data rows
+    int num_chunks;
+    size_t *chunk_offsets;  // num_chunks + 1 byte offsets, each at a line start
+    int *chunk_rows;        // num_chunks + 1 row indices, the first row of each chunk
+    double seconds;         // Time spent scanning and parsing so far
+};
+
+// Function declarations
+struct csv *open_csv(const char *path);
+void close_csv(struct csv *csv);
+int csv_read_batch(struct csv *csv, float scale, struct matrix *inputs, struct matrix *outputs);
+int csv_read_bytes(struct csv *csv, uint8_t *labels, uint8_t *features);
+double csv_throughput(const struct csv *csv);
+
+#endif // CSV_H
@@ -0,0 +1,30 @@
+/*
+ * csv_to_dataset.c
+ *
+ * Command line tool that converts a CSV dataset (label first, then integer
+ * features in [0, 255]) into the binary format read by open_dataset.
+ */
+
+#include <stdio.h>
+#include "dataset.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s input.csv output.bin\n", argv[0]);
+        return 2;
+    }
+    if (convert_csv_to_dataset(argv[1], argv[2]) != 0)
+    {
+        return 1;
+    }
+    struct dataset *dataset = open_dataset(argv[2]);
+    if (dataset == NULL)
+    {
+        return 1;
+    }
+    printf("%s: %d samples, %d features, %d classes\n", argv[2], dataset->num_samples, dataset->num_features, dataset->num_classes);
+    close_dataset(dataset);
+    return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * dataset.c
+ *
+ * This file implements the binary dataset format: conversion from CSV,
+ * memory-mapping a converted file, and assembling normalized batches straight
+ * from the mapping.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "matrix.h"
+#include "dataset.h"
+#include "csv.h"
+
+static uint64_t align_64(uint64_t offset)
+{
+    return (offset + 63) / 64 * 64;
+}
+
+/*
+ * open_dataset
+ *
+ * Maps a dataset file written by convert_csv_to_dataset.
+ *
+ * Parameters:
+ * path: The path of the dataset file.
+ *
+ * Returns:
+ * A pointer to the mapped dataset, or NULL if the file cannot be opened, is
+ * not a valid dataset, or has a label that is not below num_classes.
+ *
+ * Side effects:
+ * Maps the file read-only. Only the labels are read here, to check them;
+ * feature pages are loaded on demand by the kernel, so opening stays cheap
+ * regardless of the number of features.
+ */
+struct dataset *open_dataset(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct dataset_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    const struct dataset_header *header = mapping;
+    uint64_t labels_end = header->labels_offset + header->num_samples;
+    uint64_t features_end = header->features_offset + (uint64_t)header->num_samples * header->num_features;
+    if (memcmp(header->magic, DATASET_MAGIC, 4) != 0 || header->version != DATASET_VERSION ||
+        labels_end > (uint64_t)st.st_size || features_end > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "%s: not a version %d dataset file\n", path, DATASET_VERSION);
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    // Labels index the rows of the one-hot outputs, so a bad one would make
+    // assemble_batch write out of bounds.
+    const uint8_t *labels = (const uint8_t *)mapping + header->labels_offset;
+    for (uint32_t sample = 0; sample < header->num_samples; ++sample)
+    {
+        if (labels[sample] >= header->num_classes)
+        {
+            fprintf(stderr, "%s: sample %u has label %d, but there are %u classes\n", path, sample, labels[sample],
+                    header->num_classes);
+            munmap(mapping, st.st_size);
+            return NULL;
+        }
+    }
+
+    struct dataset *dataset = malloc(sizeof(struct dataset));
+    dataset->num_samples = header->num_samples;
+    dataset->num_features = header->num_features;
+    dataset->num_classes = header->num_classes;
+    dataset->labels = labels;
+    dataset->features = (const uint8_t *)mapping + header->features_offset;
+    dataset->mapping = mapping;
+    dataset->mapping_size = st.st_size;
+    return dataset;
+}
+
+/*
+ * close_dataset
+ *
+ * Unmaps a dataset and deallocates it.
+ */
+void close_dataset(struct dataset *dataset)
+{
+    munmap(dataset->mapping, dataset->mapping_size);
+    free(dataset);
+}
+
+/*
+ * assemble_batch
+ *
+ * Copies count samples into the column-per-sample batch layout. Column i comes
+ * from sample indices[i], or from sample start + i when indices is NULL.
+ */
+static void assemble_batch(struct dataset *dataset, const int *indices, int start, int count, struct matrix *inputs, struct matrix *outputs)
+{
+    assert((inputs->rows == dataset->num_features) && (inputs->cols == count));
+    assert((outputs->rows == dataset->num_classes) && (outputs->cols == count));
+
+    // Transpose in tiles of 16 samples so that both the reads of each sample
+    // and the writes of each feature row stay within a few cache lines.
+    const int tile = 16;
+    const uint8_t *samples[16];
+    for (int first = 0; first < count; first += tile)
+    {
+        int last = (first + tile < count) ? first + tile : count;
+        for (int sample = first; sample < last; ++sample)
+        {
+            int index = (indices != NULL) ? indices[sample] : start + sample;
+            assert(index >= 0 && index < dataset->num_samples);
+            samples[sample - first] = dataset->features + (size_t)index * dataset->num_features;
+        }
+        for (int feature = 0; feature < dataset->num_features; ++feature)
+        {
+            float *row = inputs->entries + (size_t)feature * count;
+            for (int sample = first; sample < last; ++sample)
+            {
+                row[sample] = samples[sample - first][feature] * (1.0f / 255.0f);
+            }
+        }
+    }
+
+    memset(outputs->entries, 0, outputs->size * sizeof(float));
+    for (int sample = 0; sample < count; ++sample)
+    {
+        int index = (indices != NULL) ? indices[sample] : start + sample;
+        outputs->entries[dataset->labels[index] * count + sample] = 1.0f;
+    }
+}
+
+/*
+ * dataset_batch
+ *
+ * Assembles samples [start, start + count) into the column-per-sample layout
+ * used for training, scaling features from [0, 255] to [0, 1] on the way and
+ * one-hot encoding the labels.
+ *
+ * Parameters:
+ * dataset: A pointer to the dataset.
+ * start: The index of the first sample.
+ * count: The number of samples.
+ * inputs: A num_features x count matrix that receives the features.
+ * outputs: A num_classes x count matrix that receives the one-hot labels.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites inputs and outputs; no memory is allocated.
+ */
+void dataset_batch(struct dataset *dataset, int start, int count, struct matrix *inputs, struct matrix *outputs)
+{
+    assert(start >= 0 && start + count <= dataset->num_samples);
+    assemble_batch(dataset, NULL, start, count, inputs, outputs);
+}
+
+/*
+ * dataset_gather
+ *
+ * Like dataset_batch, but column i holds sample indices[i], which is how
+ * shuffled batches are assembled.
+ *
+ * Parameters:
+ * dataset: A pointer to the dataset.
+ * indices: The sample index for each column.
+ * count: The number of samples.
+ * inputs: A num_features x count matrix that receives the features.
+ * outputs: A num_classes x count matrix that receives the one-hot labels.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites inputs and outputs; no memory is allocated.
+ */
+void dataset_gather(struct dataset *dataset, const int *indices, int count, struct matrix *inputs, struct matrix *outputs)
+{
+    assemble_batch(dataset, indices, 0, count, inputs, outputs);
+}
+
+/*
+ * convert_csv_to_dataset
+ *
+ * Converts a CSV file with one sample per line, the label first and then the
+ * features as integers in [0, 255], into a dataset file. A header line is
+ * skipped if the file starts with one. The CSV is parsed in parallel straight
+ * into the mapped output file.
+ *
+ * Parameters:
+ * csv: The path of the CSV file.
+ * path: The path of the dataset file to write.
+ *
+ * Returns:
+ * 0 on success, or -1 if a file cannot be read or written or the CSV is
+ * malformed.
+ *
+ * Side effects:
+ * Creates or overwrites the dataset file and prints the parsing throughput.
+ */
+int convert_csv_to_dataset(const char *csv, const char *path)
+{
+    struct csv *file = open_csv(csv);
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct dataset_header header = {0};
+    memcpy(header.magic, DATASET_MAGIC, 4);
+    header.version = DATASET_VERSION;
+    header.num_samples = file->num_rows;
+    header.num_features = (file->num_cols > 0) ? file->num_cols - 1 : 0;
+    header.features_offset = sizeof(struct dataset_header);
+    header.labels_offset = align_64(header.features_offset + (uint64_t)header.num_samples * header.num_features);
+    size_t size = header.labels_offset + header.num_samples;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror(path);
+        if (fd >= 0)
+        {
+            close(fd);
+            remove(path);
+        }
+        close_csv(file);
+        return -1;
+    }
+    uint8_t *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror(path);
+        remove(path);
+        close_csv(file);
+        return -1;
+    }
+
+    uint8_t *labels = mapping + header.labels_offset;
+    int status = csv_read_bytes(file, labels, mapping + header.features_offset);
+    if (status == 0)
+    {
+        for (uint32_t sample = 0; sample < header.num_samples; ++sample)
+        {
+            if (labels[sample] >= header.num_classes)
+            {
+                header.num_classes = labels[sample] + 1;
+            }
+        }
+        memcpy(mapping, &header, sizeof(header));
+        printf("Parsed %s: %d rows, %.1f MB at %.0f MB/s\n", csv, file->num_rows, file->size / 1e6, csv_throughput(file));
+    }
+    if (munmap(mapping, size) != 0)
+    {
+        perror(path);
+        status = -1;
+    }
+    close_csv(file);
+    if (status != 0)
+    {
+        remove(path);
+    }
+    return status;
+}
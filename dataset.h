@@ -0,0 +1,46 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+#define DATASET_MAGIC "NNDS"
+#define DATASET_VERSION 1
+
+/*
+ * On-disk layout of a dataset file: this 64-byte header, then the uint8
+ * features of each sample stored contiguously, then one uint8 label per
+ * sample. Both arrays start on a 64-byte boundary; all integers are little
+ * endian.
+ */
+struct dataset_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_samples;
+    uint32_t num_features;
+    uint32_t num_classes;
+    uint32_t reserved;
+    uint64_t labels_offset;
+    uint64_t features_offset;
+    uint8_t padding[24];
+};
+
+// A dataset file mapped into memory.
+struct dataset {
+    int num_samples;
+    int num_features;
+    int num_classes;
+    const uint8_t *labels;
+    const uint8_t *features;
+    void *mapping;
+    size_t mapping_size;
+};
+
+// Function declarations
+struct dataset *open_dataset(const char *path);
+void close_dataset(struct dataset *dataset);
+void dataset_batch(struct dataset *dataset, int start, int count, struct matrix *inputs, struct matrix *outputs);
+void dataset_gather(struct dataset *dataset, const int *indices, int count, struct matrix *inputs, struct matrix *outputs);
+int convert_csv_to_dataset(const char *csv, const char *path);
+
+#endif // DATASET_H
@@ -0,0 +1,205 @@
+/*
+ * loader.c
+ *
+ * This file implements the streaming minibatch loader: a background thread
+ * that shuffles sample indices every epoch and assembles batches from a
+ * memory-mapped dataset into a ring of reusable buffers.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "loader.h"
+
+/*
+ * next_random
+ *
+ * xorshift64* generator; the loader keeps its own state so that shuffling is
+ * reproducible and does not disturb rand().
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * shuffle_order
+ *
+ * Fisher-Yates shuffle of the sample order for a new epoch.
+ */
+static void shuffle_order(struct loader *loader)
+{
+    for (int i = loader->dataset->num_samples - 1; i > 0; --i)
+    {
+        int j = (int)(next_random(&loader->rng_state) % (uint64_t)(i + 1));
+        int swap = loader->order[i];
+        loader->order[i] = loader->order[j];
+        loader->order[j] = swap;
+    }
+}
+
+static void *loader_main(void *arg)
+{
+    struct loader *loader = arg;
+    int batch = loader->batches_per_epoch;
+    for (;;)
+    {
+        pthread_mutex_lock(&loader->mutex);
+        while (loader->filled == loader->num_buffers && !loader->stop)
+        {
+            pthread_cond_wait(&loader->released, &loader->mutex);
+        }
+        if (loader->stop)
+        {
+            pthread_mutex_unlock(&loader->mutex);
+            return NULL;
+        }
+        // The slot after the filled ones is not visible to the caller until
+        // filled is incremented, so it can be written without the lock.
+        int slot = (loader->head + loader->filled) % loader->num_buffers;
+        pthread_mutex_unlock(&loader->mutex);
+
+        if (batch == loader->batches_per_epoch)
+        {
+            if (loader->shuffle)
+            {
+                shuffle_order(loader);
+            }
+            batch = 0;
+        }
+        dataset_gather(loader->dataset, loader->order + batch * loader->batch_size, loader->batch_size,
+                       loader->inputs[slot], loader->outputs[slot]);
+        ++batch;
+
+        pthread_mutex_lock(&loader->mutex);
+        ++loader->filled;
+        pthread_cond_signal(&loader->ready);
+        pthread_mutex_unlock(&loader->mutex);
+    }
+}
+
+/*
+ * construct_loader
+ *
+ * Constructs a loader and starts its background thread, which begins filling
+ * buffers immediately.
+ *
+ * Parameters:
+ * dataset: A pointer to the dataset; it must outlive the loader.
+ * batch_size: The number of samples per batch.
+ * num_buffers: The number of batch buffers in the ring (at least 2: one held
+ *              by the caller, one being filled).
+ * shuffle: Whether to visit the samples in a new random order every epoch.
+ * seed: The seed of the shuffle.
+ *
+ * Returns:
+ * A pointer to the newly constructed loader.
+ *
+ * Side effects:
+ * Allocates the batch buffers and starts a thread.
+ */
+struct loader *construct_loader(struct dataset *dataset, int batch_size, int num_buffers, bool shuffle, uint64_t seed)
+{
+    assert(num_buffers >= 2 && batch_size <= dataset->num_samples);
+    struct loader *loader = malloc(sizeof(struct loader));
+    loader->dataset = dataset;
+    loader->batch_size = batch_size;
+    loader->batches_per_epoch = dataset->num_samples / batch_size;
+    loader->shuffle = shuffle;
+    loader->rng_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    loader->order = malloc(dataset->num_samples * sizeof(int));
+    for (int i = 0; i < dataset->num_samples; ++i)
+    {
+        loader->order[i] = i;
+    }
+
+    loader->num_buffers = num_buffers;
+    loader->inputs = malloc(num_buffers * sizeof(struct matrix *));
+    loader->outputs = malloc(num_buffers * sizeof(struct matrix *));
+    for (int i = 0; i < num_buffers; ++i)
+    {
+        loader->inputs[i] = construct_matrix(dataset->num_features, batch_size);
+        loader->outputs[i] = construct_matrix(dataset->num_classes, batch_size);
+    }
+    loader->head = 0;
+    loader->filled = 0;
+    loader->stop = false;
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+    pthread_cond_init(&loader->released, NULL);
+    if (pthread_create(&loader->thread, NULL, loader_main, loader) != 0)
+    {
+        perror("loader");
+        exit(1);
+    }
+    return loader;
+}
+
+/*
+ * destruct_loader
+ *
+ * Stops the background thread and deallocates the loader and its buffers.
+ */
+void destruct_loader(struct loader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    loader->stop = true;
+    pthread_cond_signal(&loader->released);
+    pthread_mutex_unlock(&loader->mutex);
+    pthread_join(loader->thread, NULL);
+
+    pthread_mutex_destroy(&loader->mutex);
+    pthread_cond_destroy(&loader->ready);
+    pthread_cond_destroy(&loader->released);
+    destruct_matrix_array(loader->num_buffers, loader->inputs);
+    destruct_matrix_array(loader->num_buffers, loader->outputs);
+    free(loader->order);
+    free(loader);
+}
+
+/*
+ * loader_next
+ *
+ * Waits for the next batch. Batches follow each other across epoch
+ * boundaries; every batches_per_epoch batches cover one epoch.
+ *
+ * Parameters:
+ * loader: A pointer to the loader.
+ * inputs: Receives the batch inputs, one sample per column.
+ * outputs: Receives the one-hot expected outputs.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * The buffers belong to the caller until loader_release is called.
+ */
+void loader_next(struct loader *loader, struct matrix **inputs, struct matrix **outputs)
+{
+    pthread_mutex_lock(&loader->mutex);
+    while (loader->filled == 0)
+    {
+        pthread_cond_wait(&loader->ready, &loader->mutex);
+    }
+    *inputs = loader->inputs[loader->head];
+    *outputs = loader->outputs[loader->head];
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+/*
+ * loader_release
+ *
+ * Hands the batch returned by loader_next back to the loader for refilling.
+ */
+void loader_release(struct loader *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    assert(loader->filled > 0);
+    loader->head = (loader->head + 1) % loader->num_buffers;
+    --loader->filled;
+    pthread_cond_signal(&loader->released);
+    pthread_mutex_unlock(&loader->mutex);
+}
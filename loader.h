@@ -0,0 +1,42 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "matrix.h"
+#include "dataset.h"
+
+/*
+ * Streams minibatches from a dataset. A background thread assembles batches
+ * into a ring of preallocated buffers while the caller trains on the current
+ * one, so memory use is a few batches regardless of the dataset size.
+ */
+struct loader {
+    struct dataset *dataset;
+    int batch_size;
+    int batches_per_epoch;  // Trailing samples that do not fill a batch are skipped
+    bool shuffle;
+    uint64_t rng_state;
+    int *order;             // Sample indices of the epoch being produced
+
+    int num_buffers;
+    struct matrix **inputs;
+    struct matrix **outputs;
+    int head;               // Next buffer handed to the caller
+    int filled;             // Buffers ready or held by the caller
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;    // Signalled when a buffer is filled
+    pthread_cond_t released; // Signalled when a buffer is released
+    bool stop;
+};
+
+// Function declarations
+struct loader *construct_loader(struct dataset *dataset, int batch_size, int num_buffers, bool shuffle, uint64_t seed);
+void destruct_loader(struct loader *loader);
+void loader_next(struct loader *loader, struct matrix **inputs, struct matrix **outputs);
+void loader_release(struct loader *loader);
+
+#endif // LOADER_H
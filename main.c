@@ -6,67 +6,44 @@
 
 #include "matrix.h"
 #include "neural_net.h"
+#include "profile.h"
+#include "thread_pool.h"
+#include "dataset.h"
+#include "loader.h"
+#include "quantize.h"
 #include <string.h>
+#include <math.h>
+#include <time.h>
 
-float *read_csv(char *csv, int size)
+double seconds(void)
 {
-    float *data = calloc(size, sizeof(int));
-    FILE *file;
-    file = fopen(csv, "r");
-    int current_num = 0;
-    while (current_num < size)
-    {
-        int character = fgetc(file);
-        if (character < 48 || character > 57)
-        {
-            --current_num;
-        }
-        while (48 <= character && character <= 57)
-        {
-            data[current_num] = data[current_num] * 10 + ((float)(character - 48));
-            character = fgetc(file);
-        }
-        data[current_num] = data[current_num];
-        ++current_num;
-    }
-    return data;
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
 }
 
-void get_batches(char *csv, int batch_size, int rows, int cols, struct matrix ***inputs, struct matrix ***outputs)
+/*
+ * open_mnist
+ *
+ * Maps the binary form of an MNIST split, converting it from the CSV file on
+ * the first run.
+ */
+struct dataset *open_mnist(char *csv, char *bin)
 {
-    int batches = rows / batch_size;
-    float *data = read_csv(csv, rows * cols);
-    *inputs = malloc(batches * sizeof(struct matrix *));
-    *outputs = malloc(batches * sizeof(struct matrix *));
-
-    int batch_size_flat = batch_size * cols;
-    for (int batch = 0; batch < batches; ++batch)
+    struct dataset *dataset = open_dataset(bin);
+    if (dataset == NULL)
     {
-        struct matrix batch_matrix = {0};
-        batch_matrix.rows = batch_size;
-        batch_matrix.cols = cols;
-        batch_matrix.size = batch_size_flat;
-        batch_matrix.entries = data + (batch * batch_size_flat);
-
-        struct matrix *batch_transposed = transpose(&batch_matrix);
-        (*inputs)[batch] = scale_matrix(slice_row(batch_transposed, 1, batch_transposed->rows), 1.0f / 255.0f);
-
-        destruct_matrix(batch_transposed);
-
-        struct matrix *output = construct_matrix(10, batch_size);
-        for (int i = 0; i < batch_size; ++i)
+        printf("Converting %s to %s...\n", csv, bin);
+        if (convert_csv_to_dataset(csv, bin) != 0 || (dataset = open_dataset(bin)) == NULL)
         {
-            output->entries[((int)data[(batch * batch_size + i) * cols]) * output->cols + i] = 1.0f;
+            exit(1);
         }
-
-        (*outputs)[batch] = output;
     }
-    free(data);
+    return dataset;
 }
 
-float test_accuracy(struct neural_net *neural_net, struct matrix *input_test, struct matrix *output_test)
+float output_accuracy(struct matrix *test, struct matrix *output_test)
 {
-    struct matrix *test = eval(neural_net, input_test);
     int correct = 0;
     for (int col = 0; col < output_test->cols; ++col)
     {
@@ -84,7 +61,7 @@ float test_accuracy(struct neural_net *neural_net, struct matrix *input_test, st
             if (test->entries[row * test->cols + col] > max_net)
             {
                 max_index_net = row;
-                max_net = test->entries[row * output_test->cols + col];
+                max_net = test->entries[row * test->cols + col];
             }
         }
         if (max_index_real == max_index_net)
@@ -92,10 +69,111 @@ float test_accuracy(struct neural_net *neural_net, struct matrix *input_test, st
             ++correct;
         }
     }
-    destruct_matrix(test);
     return ((float)correct) / ((float)output_test->cols);
 }
 
+/*
+ * test_accuracy
+ *
+ * Returns the fraction of the test set the network classifies correctly, and
+ * stores the mean loss per sample in *loss unless it is NULL; both come from
+ * one chunked pass over the test set.
+ */
+float test_accuracy(struct neural_net *neural_net, struct matrix *input_test, struct matrix *output_test, float *loss)
+{
+    struct evaluation *evaluation = construct_evaluation(output_test->rows);
+    evaluate(neural_net, input_test, output_test, evaluation);
+    if (loss != NULL)
+    {
+        *loss = evaluation->loss / evaluation->samples;
+    }
+    float accuracy = ((float)evaluation->correct) / ((float)evaluation->samples);
+    destruct_evaluation(evaluation);
+    return accuracy;
+}
+
+/*
+ * print_confusion
+ *
+ * Prints the confusion matrix of a network on the test set, one row per
+ * expected digit and one column per predicted digit.
+ */
+void print_confusion(struct neural_net *neural_net, struct matrix *input_test, struct matrix *output_test)
+{
+    struct evaluation *evaluation = construct_evaluation(output_test->rows);
+    evaluate(neural_net, input_test, output_test, evaluation);
+    printf("Confusion matrix (rows: expected, columns: predicted):\n     ");
+    for (int col = 0; col < evaluation->num_classes; ++col)
+    {
+        printf("%6d", col);
+    }
+    putchar('\n');
+    for (int row = 0; row < evaluation->num_classes; ++row)
+    {
+        printf("%5d", row);
+        for (int col = 0; col < evaluation->num_classes; ++col)
+        {
+            printf("%6d", evaluation->confusion[row * evaluation->num_classes + col]);
+        }
+        putchar('\n');
+    }
+    destruct_evaluation(evaluation);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * latency_benchmark
+ *
+ * Times single-sample inference on each test sample, through eval_single and
+ * through eval on a one-column matrix, and prints the median and 99th
+ * percentile latency of both along with the largest difference between their
+ * outputs.
+ */
+void latency_benchmark(struct neural_net *neural_net, struct matrix *input_test)
+{
+    int samples = (input_test->cols < 10000) ? input_test->cols : 10000;
+    int outputs = neural_net->layers[neural_net->num_layers - 1];
+    double *single_times = malloc(samples * sizeof(double));
+    double *batch_times = malloc(samples * sizeof(double));
+    struct matrix *column = construct_matrix(input_test->rows, 1);
+    float output[outputs];
+    float difference = 0.0f;
+    for (int i = 0; i < samples; ++i)
+    {
+        slice_col_into(input_test, i, i + 1, column);
+
+        double start = seconds();
+        eval_single(neural_net, column->entries, output);
+        single_times[i] = seconds() - start;
+
+        start = seconds();
+        struct matrix *out = eval(neural_net, column);
+        batch_times[i] = seconds() - start;
+
+        for (int row = 0; row < outputs; ++row)
+        {
+            float delta = fabsf(out->entries[row] - output[row]);
+            difference = (delta > difference) ? delta : difference;
+        }
+        destruct_matrix(out);
+    }
+    qsort(single_times, samples, sizeof(double), compare_doubles);
+    qsort(batch_times, samples, sizeof(double), compare_doubles);
+    printf("Single-sample latency over %d samples: eval_single p50 %.2f us, p99 %.2f us; "
+           "eval p50 %.2f us, p99 %.2f us (max difference %g)\n", samples,
+           1e6 * single_times[samples / 2], 1e6 * single_times[samples * 99 / 100],
+           1e6 * batch_times[samples / 2], 1e6 * batch_times[samples * 99 / 100], difference);
+    destruct_matrix(column);
+    free(single_times);
+    free(batch_times);
+}
+
 void display_mnist_image(struct matrix *images, int col)
 {
     char shades[] = " .:-=+*#%@"; // ASCII intensity mapping
@@ -113,47 +191,176 @@ void display_mnist_image(struct matrix *images, int col)
     }
 }
 
-int main()
+int main(int argc, char **argv)
 {
     int layers[] = {784, 16, 16, 10};
-    char *activations[3] = {"sigmoid", "sigmoid", "sigmoid"};
+    // Softmax outputs train with the cross-entropy loss.
+    char *activations[3] = {"sigmoid", "sigmoid", "softmax"};
     struct neural_net *neural_net = construct_neural_net(4, layers, activations);
 
+    // The network trains with Adam; "sgd" with a learning rate of 0.05
+    // reproduces plain gradient descent.
+    float learning_rate = 0.003f;
+    set_neural_net_optimizer(neural_net, "adam");
+
+    // With --bf16 a twin network starting from the same parameters trains
+    // alongside with bf16 weights and activations for the products and fp32
+    // master weights, so the two convergence curves can be compared epoch by
+    // epoch. It doubles the training time, so it is off by default.
+    struct neural_net *mixed_net = NULL;
+    if (argc > 1 && strcmp(argv[1], "--bf16") == 0)
+    {
+        mixed_net = construct_neural_net(4, layers, activations);
+        for (int layer = 0; layer < 3; ++layer)
+        {
+            copy_matrix_into(neural_net->weights[layer], mixed_net->weights[layer]);
+            copy_matrix_into(neural_net->biases[layer], mixed_net->biases[layer]);
+        }
+        set_neural_net_precision(mixed_net, ELEMENT_BF16, ELEMENT_BF16);
+        set_neural_net_optimizer(mixed_net, "adam");
+    }
+
     int batch_size = 96;
-    int rows_train = 60000;
-    int rows_test = 10000;
-    int cols = 28 * 28 + 1;
-    int batches = rows_train / batch_size;
-    struct matrix **inputs_train = NULL;
-    struct matrix **outputs_train = NULL;
-    struct matrix **inputs_test = NULL;
-    struct matrix **outputs_test = NULL;
 
     printf("Loading data from persistent storage...\n");
 
-    get_batches("mnist_train.csv", batch_size, rows_train, cols, &inputs_train, &outputs_train);
-    get_batches("mnist_test.csv", rows_test, rows_test, cols, &inputs_test, &outputs_test);
+    double load_start = seconds();
+    struct dataset *train = open_mnist("mnist_train.csv", "mnist_train.bin");
+    struct dataset *test = open_mnist("mnist_test.csv", "mnist_test.bin");
 
-    printf("Data loaded. Training...\n");
+    // Training batches are shuffled and assembled from the mapped file on a
+    // background thread into a ring of three buffers, so only the test set is
+    // held in memory as floats.
+    struct loader *loader = construct_loader(train, batch_size, 3, true, 1);
+    int batches = loader->batches_per_epoch;
+    struct matrix *input_test = construct_matrix(test->num_features, test->num_samples);
+    struct matrix *output_test = construct_matrix(test->num_classes, test->num_samples);
+    dataset_batch(test, 0, test->num_samples, input_test, output_test);
+
+    printf("Data loaded in %.1f ms. Training...\n", 1000.0 * (seconds() - load_start));
 
     int epochs = 20;
     for (int epoch = 0; epoch < epochs; ++epoch)
     {
         float cost = 0;
+        float mixed_cost = 0;
         for (int batch = 0; batch < batches; ++batch)
         {
-            cost += back_propagate(neural_net, inputs_train[batch], outputs_train[batch], 0.05f);
+            struct matrix *input_batch, *output_batch;
+            loader_next(loader, &input_batch, &output_batch);
+            cost += back_propagate_parallel(neural_net, input_batch, output_batch, learning_rate, get_num_threads());
+            if (mixed_net != NULL)
+            {
+                mixed_cost += back_propagate_parallel(mixed_net, input_batch, output_batch, learning_rate,
+                                                      get_num_threads());
+            }
+            loader_release(loader);
+        }
+#ifdef NN_PROFILE
+        // Printed before the test-set evaluation so the table covers training
+        // only; the counters are cleared after it.
+        printf("Epoch %d profile of the fp32 network:\n", epoch);
+        print_profile(neural_net->profile, stdout);
+#endif
+        float test_loss;
+        float accuracy = test_accuracy(neural_net, input_test, output_test, &test_loss);
+        printf("Epoch %d - Cost: %f, Test loss: %f, Accuracy: %f%%", epoch, cost, test_loss, accuracy * 100.0f);
+        if (mixed_net != NULL)
+        {
+            float mixed_test_loss;
+            float mixed_accuracy = test_accuracy(mixed_net, input_test, output_test, &mixed_test_loss);
+            printf(" (bf16: Cost: %f, Test loss: %f, Accuracy: %f%%)", mixed_cost, mixed_test_loss,
+                   mixed_accuracy * 100.0f);
         }
-        printf("Epoch %d - Cost: %f, Accuracy: %f%%\n", epoch, cost, test_accuracy(neural_net, inputs_test[0], outputs_test[0]) * 100.0f);
+        putchar('\n');
+#ifdef NN_PROFILE
+        reset_profile(neural_net->profile);
+#endif
     }
 
     printf("Training completed. Testing...\n");
+    print_confusion(neural_net, input_test, output_test);
+
+    // Round-trip the trained network through a checkpoint; the loaded copy
+    // maps the file, so its start-up time does not depend on the model size.
+    if (save_neural_net(neural_net, "mnist.nn") == 0)
+    {
+        double checkpoint_start = seconds();
+        struct neural_net *loaded = load_neural_net("mnist.nn");
+        double checkpoint_time = seconds() - checkpoint_start;
+        if (loaded != NULL)
+        {
+            printf("Checkpoint loaded in %.3f ms, accuracy %f%%\n", 1000.0 * checkpoint_time,
+                   test_accuracy(loaded, input_test, output_test, NULL) * 100.0f);
+            destruct_neural_net(neural_net);
+            neural_net = loaded;
+        }
+    }
+
+    // Quantize to int8, calibrating on a slice of the training set, and
+    // compare against the float network on the test set.
+    int calibration_size = (train->num_samples < 1000) ? train->num_samples : 1000;
+    struct matrix *calibration_in = construct_matrix(train->num_features, calibration_size);
+    struct matrix *calibration_out = construct_matrix(train->num_classes, calibration_size);
+    dataset_batch(train, 0, calibration_size, calibration_in, calibration_out);
+    struct quantized_net *quantized_net = quantize_neural_net(neural_net, calibration_in);
+    double float_start = seconds();
+    struct matrix *float_out = eval(neural_net, input_test);
+    double float_time = seconds() - float_start;
+    double int8_start = seconds();
+    struct matrix *int8_out = eval_quantized(quantized_net, input_test);
+    double int8_time = seconds() - int8_start;
+    float float_accuracy = output_accuracy(float_out, output_test);
+    float int8_accuracy = output_accuracy(int8_out, output_test);
+    printf("float32: accuracy %f%%, %.2f ms\n", float_accuracy * 100.0f, 1000.0 * float_time);
+    if (mixed_net != NULL)
+    {
+        double bf16_start = seconds();
+        struct matrix *bf16_out = eval(mixed_net, input_test);
+        double bf16_time = seconds() - bf16_start;
+        float bf16_accuracy = output_accuracy(bf16_out, output_test);
+        printf("bf16:    accuracy %f%% (delta %+f%%), %.2f ms, trained with bf16 weights and activations\n",
+               bf16_accuracy * 100.0f, (bf16_accuracy - float_accuracy) * 100.0f, 1000.0 * bf16_time);
+        destruct_matrix(bf16_out);
+    }
+    printf("int8:    accuracy %f%% (delta %+f%%), %.2f ms, weights %zu bytes instead of %zu\n", int8_accuracy * 100.0f,
+           (int8_accuracy - float_accuracy) * 100.0f, 1000.0 * int8_time, quantized_weight_bytes(quantized_net),
+           quantized_weight_bytes(quantized_net) * sizeof(float));
+    destruct_matrix(float_out);
+    destruct_matrix(int8_out);
+    destruct_matrix(calibration_in);
+    destruct_matrix(calibration_out);
+    destruct_quantized_net(quantized_net);
+
+    latency_benchmark(neural_net, input_test);
+
+    // Prune 90% of the weights in blocks of four rows, then fine-tune the
+    // rest for one epoch with the pruned ones held at zero; the pruned layers
+    // evaluate with sparse products.
+    size_t dense_bytes = sparse_weight_bytes(neural_net);
+    prune_neural_net(neural_net, 0.9f, 4);
+    float pruned_accuracy = test_accuracy(neural_net, input_test, output_test, NULL);
+    set_neural_net_optimizer(neural_net, "adam");
+    for (int batch = 0; batch < batches; ++batch)
+    {
+        struct matrix *input_batch, *output_batch;
+        loader_next(loader, &input_batch, &output_batch);
+        back_propagate_parallel(neural_net, input_batch, output_batch, learning_rate, get_num_threads());
+        loader_release(loader);
+    }
+    double sparse_start = seconds();
+    struct matrix *sparse_out = eval(neural_net, input_test);
+    double sparse_time = seconds() - sparse_start;
+    printf("pruned:  accuracy %f%% before fine-tuning, %f%% after, %.2f ms, weights %zu bytes instead of %zu\n",
+           pruned_accuracy * 100.0f, output_accuracy(sparse_out, output_test) * 100.0f, 1000.0 * sparse_time,
+           sparse_weight_bytes(neural_net), dense_bytes);
+    destruct_matrix(sparse_out);
 
     int i = 0;
-    struct matrix *out = eval(neural_net, inputs_test[0]);
+    struct matrix *out = eval(neural_net, input_test);
     while (getchar())
     {
-        display_mnist_image(inputs_test[0], i);
+        display_mnist_image(input_test, i);
         for (int row = 0; row < out->rows; ++row)
         {
             printf("%f ", out->entries[i + row * out->cols]);
@@ -163,11 +370,17 @@ int main()
     }
     destruct_matrix(out);
 
-    destruct_matrix_array(batches, inputs_train);
-    destruct_matrix_array(batches, outputs_train);
-    destruct_matrix_array(1, inputs_test);
-    destruct_matrix_array(1, outputs_test);
+    destruct_loader(loader);
+    destruct_matrix(input_test);
+    destruct_matrix(output_test);
+    close_dataset(train);
+    close_dataset(test);
     destruct_neural_net(neural_net);
+    if (mixed_net != NULL)
+    {
+        destruct_neural_net(mixed_net);
+    }
+    destruct_thread_pool();
     return 0;
 }
 
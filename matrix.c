@@ -7,8 +7,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include "matrix.h" // This includes the definition of struct matrix
+#include "matrix_kernels.h"
+#include "thread_pool.h"
+
+#if defined(USE_MKL)
+#include <mkl_cblas.h>
+#define USE_CBLAS
+#elif defined(USE_CBLAS)
+#include <cblas.h>
+#endif
 
 /*
  * print_array
@@ -103,15 +113,58 @@ void print_matrix(struct matrix *matrix)
  * Allocates memory for the matrix structure and its entries.
  */
 struct matrix *construct_matrix(int rows, int cols)
+{
+    return construct_matrix_typed(rows, cols, ELEMENT_FP32);
+}
+
+/*
+ * construct_matrix_typed
+ *
+ * Constructs a zeroed matrix whose entries are stored in the given format.
+ *
+ * Parameters:
+ * rows: The number of rows in the matrix.
+ * cols: The number of columns in the matrix.
+ * type: The storage format of the entries.
+ *
+ * Returns:
+ * A pointer to the newly constructed matrix.
+ *
+ * Side effects:
+ * Allocates memory for the matrix structure and its entries.
+ */
+struct matrix *construct_matrix_typed(int rows, int cols, enum element_type type)
 {
     struct matrix *matrix = malloc(sizeof(struct matrix));
     matrix->rows = rows;
     matrix->cols = cols;
     matrix->size = rows * cols;
-    matrix->entries = calloc(matrix->size, sizeof(float));
+    matrix->entries = calloc(matrix->size, element_size(type));
+    matrix->type = type;
     return matrix;
 }
 
+/*
+ * element_size
+ *
+ * Returns the number of bytes taken by one entry of the given format.
+ */
+size_t element_size(enum element_type type)
+{
+    return (type == ELEMENT_FP32) ? sizeof(float) : sizeof(uint16_t);
+}
+
+/*
+ * element_type_name
+ *
+ * Returns the short name of a storage format: "fp32", "fp16" or "bf16".
+ */
+const char *element_type_name(enum element_type type)
+{
+    static const char *const names[] = {"fp32", "fp16", "bf16"};
+    return names[type];
+}
+
 /*
  * destruct_matrix
  *
@@ -157,177 +210,1624 @@ void destruct_matrix_array(int size, struct matrix **matrix_array)
  */
 struct matrix *copy_matrix(struct matrix *matrix)
 {
-    struct matrix *copy = construct_matrix(matrix->rows, matrix->cols);
-    for (int entry = 0; entry < matrix->size; ++entry)
+    return copy_matrix_into(matrix, construct_matrix_typed(matrix->rows, matrix->cols, matrix->type));
+}
+
+// Entries converted at a time between two reduced formats.
+#define CONVERT_STRIP 1024
+
+/*
+ * convert_entries
+ *
+ * Copies n entries from one storage format to another. Reduced formats are
+ * widened to float or rounded from it by the conversion kernels; between two
+ * different reduced formats the values pass through a float strip.
+ */
+static void convert_entries(int n, enum element_type from, const void *x, enum element_type to, void *y)
+{
+    if (from == to)
     {
-        (copy->entries)[entry] = (matrix->entries)[entry];
+        memcpy(y, x, (size_t)n * element_size(from));
+    }
+    else if (from == ELEMENT_FP32)
+    {
+        matrix_kernels->store_half(to, n, x, y);
+    }
+    else if (to == ELEMENT_FP32)
+    {
+        matrix_kernels->load_half(from, n, x, y);
+    }
+    else
+    {
+        float strip[CONVERT_STRIP];
+        for (int i = 0; i < n; i += CONVERT_STRIP)
+        {
+            int count = (n - i < CONVERT_STRIP) ? n - i : CONVERT_STRIP;
+            matrix_kernels->load_half(from, count, (const uint16_t *)x + i, strip);
+            matrix_kernels->store_half(to, count, strip, (uint16_t *)y + i);
+        }
     }
-    return copy;
 }
 
 /*
- * mat_mult
+ * copy_matrix_into
  *
- * Performs matrix multiplication of two matrices A and B.
+ * Copies the entries of a matrix into an existing matrix of the same shape,
+ * converting them if the two are stored in different formats.
  *
  * Parameters:
- * A: A pointer to the first matrix.
- * B: A pointer to the second matrix.
- * bias: A boolean value indicating whether to include bias in the multiplication.
+ * matrix: A pointer to the matrix to be copied.
+ * copy: A pointer to the destination matrix.
  *
  * Returns:
- * A pointer to the resulting matrix from the multiplication.
+ * copy.
  *
  * Side effects:
- * Allocates memory for the resulting matrix.
+ * Overwrites the entries of copy.
  */
-struct matrix *mat_mult(struct matrix *A, struct matrix *B)
+struct matrix *copy_matrix_into(struct matrix *matrix, struct matrix *copy)
 {
-    assert(A->cols == B->rows);
-    struct matrix *mat_prod = construct_matrix(A->rows, B->cols);
-    for (int row = 0; row < A->rows; ++row)
-    {
-        for (int col = 0; col < B->cols; ++col)
-        {
-            float prod = 0;
-            float *start_row_A = A->entries + (row * A->cols);
-            float *start_col_B = B->entries + col;
-            for (int i = 0; i < A->cols; ++i)
-            {
-                prod += start_row_A[i] * start_col_B[B->cols * i];
-            }
-            (mat_prod->entries)[row * B->cols + col] = prod;
-        }
-    }
-    return mat_prod;
+    assert((copy->rows == matrix->rows) && (copy->cols == matrix->cols));
+    convert_entries(matrix->size, matrix->type, matrix->entries, copy->type, copy->entries);
+    return copy;
 }
 
 /*
- * array_to_column
+ * convert_matrix
  *
- * Converts an array to a column matrix.
+ * Constructs a copy of a matrix stored in another format.
  *
  * Parameters:
- * size: The number of elements in the array.
- * arr: The array to be converted.
+ * matrix: A pointer to the matrix to be converted.
+ * type: The storage format of the copy.
  *
  * Returns:
- * A pointer to the resulting column matrix.
+ * A pointer to the newly constructed matrix.
  *
  * Side effects:
- * Allocates memory for the column matrix.
+ * Allocates memory for the converted matrix and its entries.
  */
-struct matrix *array_to_column(int size, float *arr)
+struct matrix *convert_matrix(struct matrix *matrix, enum element_type type)
 {
-    struct matrix *matrix = construct_matrix(size, 1);
-    for (int entry = 0; entry < size; ++entry)
+    return copy_matrix_into(matrix, construct_matrix_typed(matrix->rows, matrix->cols, type));
+}
+
+/*
+ * GEMM blocking parameters.
+ *
+ * The blocked multiply packs a KC x NC panel of B (sized for the L2/L3 cache)
+ * and an MC x KC block of A (sized for the L2 cache) into contiguous buffers,
+ * then walks them with the MR x NR register-tiled micro-kernel of the active
+ * instruction set (see matrix_kernels.c). GEMM_MC and GEMM_NC must be
+ * multiples of every kernel's MR and NR respectively.
+ */
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 1024
+
+/*
+ * Packing buffers are allocated once per thread and reused by every call, so
+ * the blocked multiply does not allocate in steady state.
+ */
+static _Thread_local float *gemm_pack_a = NULL;
+static _Thread_local float *gemm_pack_b = NULL;
+
+static float *gemm_buffer(float **buffer, size_t count)
+{
+    if (*buffer == NULL)
     {
-        (matrix->entries)[entry] = arr[entry];
+        *buffer = aligned_alloc(64, count * sizeof(float));
     }
-    return matrix;
+    return *buffer;
 }
 
 /*
- * transpose
- *
- * Transposes a matrix.
+ * load_run
  *
- * Parameters:
- * matrix: A pointer to the matrix to be transposed.
+ * Returns n consecutive entries of a matrix buffer, starting at index, as
+ * floats: a pointer into the buffer itself for fp32 storage, otherwise the
+ * entries widened into run. This is how the packing routines read fp16 and
+ * bf16 operands, so the micro-kernels only ever see floats.
+ */
+static inline const float *load_run(const void *X, enum element_type type, size_t index, int n, float *run)
+{
+    if (type == ELEMENT_FP32)
+    {
+        return (const float *)X + index;
+    }
+    matrix_kernels->load_half(type, n, (const uint16_t *)X + index, run);
+    return run;
+}
+
+/*
+ * element_at
  *
- * Returns:
- * A pointer to the transposed matrix.
+ * Returns the address of entry index of a matrix buffer in the given format.
+ */
+static inline const void *element_at(const void *X, enum element_type type, size_t index)
+{
+    return (const char *)X + index * element_size(type);
+}
+
+/*
+ * pack_a
  *
- * Side effects:
- * Allocates memory for the transposed matrix.
+ * Copies an mc x kc block of A, scaled by alpha, into row panels of mr rows,
+ * stored so that the micro-kernel reads mr consecutive floats per k step.
+ * Rows past mc are zero padded. The source is walked along whichever of its
+ * dimensions is contiguous, and reduced-precision entries are widened on the
+ * way. The body is inlined once for fp32 and once for the reduced formats, so
+ * the fp32 loops carry no conversion checks.
  */
-struct matrix *transpose(struct matrix *matrix)
+static inline __attribute__((always_inline)) void pack_a_body(int mc, int kc, float alpha, const void *A, enum element_type type,
+                                                              int rs, int cs, int mr, float *packed)
 {
-    struct matrix *transposed_matrix = construct_matrix(matrix->cols, matrix->rows);
-    for (int row = 0; row < matrix->rows; ++row)
+    float run[GEMM_KC];
+    for (int panel = 0; panel < mc; panel += mr)
     {
-        for (int col = 0; col < matrix->cols; ++col)
+        int rows = (mc - panel < mr) ? mc - panel : mr;
+        if (cs == 1)
         {
-            transposed_matrix->entries[col * transposed_matrix->cols + row] = matrix->entries[row * matrix->cols + col];
+            for (int i = 0; i < rows; ++i)
+            {
+                const float *row = load_run(A, type, (size_t)(panel + i) * rs, kc, run);
+                for (int k = 0; k < kc; ++k)
+                {
+                    packed[k * mr + i] = alpha * row[k];
+                }
+            }
+        }
+        else
+        {
+            assert(rs == 1 || type == ELEMENT_FP32);
+            for (int k = 0; k < kc; ++k)
+            {
+                const float *col = load_run(A, type, (size_t)panel * rs + (size_t)k * cs, rows, run);
+                for (int i = 0; i < rows; ++i)
+                {
+                    packed[k * mr + i] = alpha * col[i * rs];
+                }
+            }
+        }
+        for (int k = 0; k < kc; ++k)
+        {
+            for (int i = rows; i < mr; ++i)
+            {
+                packed[k * mr + i] = 0.0f;
+            }
         }
+        packed += mr * kc;
     }
-    return transposed_matrix;
 }
 
-struct matrix *slice_row(struct matrix *matrix, int a, int b)
+static void pack_a(int mc, int kc, float alpha, const void *A, enum element_type type, int rs, int cs, int mr, float *packed)
 {
-    struct matrix *new = construct_matrix(b - a, matrix->cols);
-    for (int i = 0; i < new->size; ++i)
+    if (type == ELEMENT_FP32)
     {
-        new->entries[i] = matrix->entries[i + a * matrix->cols];
+        pack_a_body(mc, kc, alpha, A, ELEMENT_FP32, rs, cs, mr, packed);
+    }
+    else
+    {
+        pack_a_body(mc, kc, alpha, A, type, rs, cs, mr, packed);
     }
-    return new;
 }
 
-struct matrix *scale_matrix(struct matrix *matrix, float c)
+/*
+ * pack_b
+ *
+ * Copies a kc x nc block of B into column panels of nr columns, stored so that
+ * the micro-kernel reads nr consecutive floats per k step. Columns past nc are
+ * zero padded. The source is walked along whichever of its dimensions is
+ * contiguous, and reduced-precision entries are widened on the way, with the
+ * same fp32 specialization as pack_a.
+ */
+static inline __attribute__((always_inline)) void pack_b_body(int kc, int nc, const void *B, enum element_type type,
+                                                              int rs, int cs, int nr, float *packed)
 {
-    for (int entry = 0; entry < matrix->size; ++entry)
+    float run[GEMM_KC];
+    for (int panel = 0; panel < nc; panel += nr)
     {
-        matrix->entries[entry] = matrix->entries[entry] * c;
+        int cols = (nc - panel < nr) ? nc - panel : nr;
+        if (rs == 1)
+        {
+            for (int j = 0; j < cols; ++j)
+            {
+                const float *col = load_run(B, type, (size_t)(panel + j) * cs, kc, run);
+                for (int k = 0; k < kc; ++k)
+                {
+                    packed[k * nr + j] = col[k];
+                }
+            }
+        }
+        else
+        {
+            assert(cs == 1 || type == ELEMENT_FP32);
+            for (int k = 0; k < kc; ++k)
+            {
+                const float *row = load_run(B, type, (size_t)k * rs + (size_t)panel * cs, cols, run);
+                for (int j = 0; j < cols; ++j)
+                {
+                    packed[k * nr + j] = row[j * cs];
+                }
+            }
+        }
+        for (int k = 0; k < kc; ++k)
+        {
+            for (int j = cols; j < nr; ++j)
+            {
+                packed[k * nr + j] = 0.0f;
+            }
+        }
+        packed += nr * kc;
     }
-    return matrix;
 }
 
-struct matrix *binary_element_wise(struct matrix *A, struct matrix *B, float (*fptr)(float, float))
+static void pack_b(int kc, int nc, const void *B, enum element_type type, int rs, int cs, int nr, float *packed)
 {
-    assert((A->rows == B->rows) && (A->cols == B->cols));
-    for (int entry = 0; entry < A->size; ++entry)
+    if (type == ELEMENT_FP32)
     {
-        A->entries[entry] = fptr(A->entries[entry], B->entries[entry]);
+        pack_b_body(kc, nc, B, ELEMENT_FP32, rs, cs, nr, packed);
+    }
+    else
+    {
+        pack_b_body(kc, nc, B, type, rs, cs, nr, packed);
     }
-    return A;
 }
 
-struct matrix *unary_element_wise(struct matrix *matrix, float (*fptr)(float))
+/*
+ * gemm_blocked
+ *
+ * Accumulates C += alpha * A * B, where A is m x k, B is k x n and C is m x n
+ * with row stride ldc. A and B are addressed through explicit row and column
+ * strides, so transposed operands can be read in place, and may be stored in
+ * any element format; C is always float.
+ */
+static void gemm_blocked(int m, int n, int k, float alpha,
+                         const void *A, enum element_type type_a, int rs_a, int cs_a,
+                         const void *B, enum element_type type_b, int rs_b, int cs_b,
+                         float *C, int ldc)
 {
-    for (int entry = 0; entry < matrix->size; ++entry)
+    const struct matrix_kernels *kernels = matrix_kernels;
+    int MR = kernels->mr;
+    int NR = kernels->nr;
+    float *packed_a = gemm_buffer(&gemm_pack_a, GEMM_MC * GEMM_KC);
+    float *packed_b = gemm_buffer(&gemm_pack_b, GEMM_KC * GEMM_NC);
+
+    for (int jc = 0; jc < n; jc += GEMM_NC)
     {
-        matrix->entries[entry] = fptr(matrix->entries[entry]);
+        int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+        for (int pc = 0; pc < k; pc += GEMM_KC)
+        {
+            int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+            pack_b(kc, nc, element_at(B, type_b, (size_t)pc * rs_b + (size_t)jc * cs_b), type_b, rs_b, cs_b, NR, packed_b);
+            for (int ic = 0; ic < m; ic += GEMM_MC)
+            {
+                int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+                pack_a(mc, kc, alpha, element_at(A, type_a, (size_t)ic * rs_a + (size_t)pc * cs_a), type_a, rs_a, cs_a, MR, packed_a);
+                for (int jr = 0; jr < nc; jr += NR)
+                {
+                    int nr = (nc - jr < NR) ? nc - jr : NR;
+                    for (int ir = 0; ir < mc; ir += MR)
+                    {
+                        int mr = (mc - ir < MR) ? mc - ir : MR;
+                        kernels->gemm_micro(kc, packed_a + ir * kc, packed_b + jr * kc,
+                                            C + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+                    }
+                }
+            }
+        }
     }
-    return matrix;
 }
 
-float add(float a, float b)
+/*
+ * Products smaller than this many multiply-adds run on the calling thread;
+ * below it the cost of waking the pool outweighs the work.
+ */
+#define GEMM_PARALLEL_MIN_MACS (1 << 18)
+
+struct gemm_job {
+    int m, n, k;
+    float alpha;
+    const void *A;
+    enum element_type type_a;
+    int rs_a, cs_a;
+    const void *B;
+    enum element_type type_b;
+    int rs_b, cs_b;
+    float *C;
+    int ldc;
+    bool split_rows;
+    int chunk;
+};
+
+static void gemm_task(int index, void *arg)
 {
-    return a + b;
+    struct gemm_job *job = arg;
+    int start = index * job->chunk;
+    if (job->split_rows)
+    {
+        int rows = (job->m - start < job->chunk) ? job->m - start : job->chunk;
+        gemm_blocked(rows, job->n, job->k, job->alpha,
+                     element_at(job->A, job->type_a, (size_t)start * job->rs_a), job->type_a, job->rs_a, job->cs_a,
+                     job->B, job->type_b, job->rs_b, job->cs_b,
+                     job->C + start * job->ldc, job->ldc);
+    }
+    else
+    {
+        int cols = (job->n - start < job->chunk) ? job->n - start : job->chunk;
+        gemm_blocked(job->m, cols, job->k, job->alpha,
+                     job->A, job->type_a, job->rs_a, job->cs_a,
+                     element_at(job->B, job->type_b, (size_t)start * job->cs_b), job->type_b, job->rs_b, job->cs_b,
+                     job->C + start, job->ldc);
+    }
 }
 
-float sub(float a, float b)
+/*
+ * gemm_parallel
+ *
+ * Accumulates C += alpha * A * B like gemm_blocked, splitting the larger
+ * dimension of C into register-tile aligned slabs that are multiplied on the
+ * thread pool.
+ */
+static void gemm_parallel(int m, int n, int k, float alpha,
+                          const void *A, enum element_type type_a, int rs_a, int cs_a,
+                          const void *B, enum element_type type_b, int rs_b, int cs_b,
+                          float *C, int ldc)
 {
-    return a - b;
+    int threads = get_num_threads();
+    if (threads <= 1 || (long)m * n * k < GEMM_PARALLEL_MIN_MACS)
+    {
+        gemm_blocked(m, n, k, alpha, A, type_a, rs_a, cs_a, B, type_b, rs_b, cs_b, C, ldc);
+        return;
+    }
+    struct gemm_job job = {m, n, k, alpha, A, type_a, rs_a, cs_a, B, type_b, rs_b, cs_b, C, ldc, m > n, 0};
+    int extent = job.split_rows ? m : n;
+    int align = job.split_rows ? matrix_kernels->mr : matrix_kernels->nr;
+    job.chunk = (extent + threads - 1) / threads;
+    job.chunk = (job.chunk + align - 1) / align * align;
+    parallel_for((extent + job.chunk - 1) / job.chunk, gemm_task, &job);
 }
 
-float mult(float a, float b)
+/*
+ * mat_mult
+ *
+ * Performs matrix multiplication of two matrices A and B using the packed,
+ * cache-blocked kernel, split across the thread pool for large products.
+ *
+ * Parameters:
+ * A: A pointer to the first matrix.
+ * B: A pointer to the second matrix.
+ *
+ * Returns:
+ * A pointer to the resulting matrix from the multiplication.
+ *
+ * Side effects:
+ * Allocates memory for the resulting matrix.
+ */
+struct matrix *mat_mult(struct matrix *A, struct matrix *B)
 {
-    return a * b;
+    assert(A->cols == B->rows);
+    return gemm(false, false, 1.0f, A, B, 0.0f, construct_matrix(A->rows, B->cols));
 }
 
-struct matrix *hadamard_product(struct matrix *A, struct matrix *B)
+#ifdef USE_CBLAS
+static bool gemm_use_cblas = true;
+#endif
+
+/*
+ * matrix_set_gemm_backend
+ *
+ * Selects the implementation behind gemm, mat_mult and mat_mult_into.
+ *
+ * Parameters:
+ * name: "builtin" for the blocked kernels in this file, or "cblas" for the
+ *       BLAS library linked with `make BLAS=...`.
+ *
+ * Returns:
+ * 0 on success, or -1 if the backend was not compiled in.
+ *
+ * Side effects:
+ * Changes the backend used by every subsequent product.
+ */
+int matrix_set_gemm_backend(const char *name)
 {
-    return binary_element_wise(A, B, &mult);
+    if (strcmp(name, "builtin") == 0)
+    {
+#ifdef USE_CBLAS
+        gemm_use_cblas = false;
+#endif
+        return 0;
+    }
+#ifdef USE_CBLAS
+    if (strcmp(name, "cblas") == 0)
+    {
+        gemm_use_cblas = true;
+        return 0;
+    }
+#endif
+    return -1;
 }
 
-struct matrix *matrix_add(struct matrix *A, struct matrix *B)
+/*
+ * matrix_get_gemm_backend
+ *
+ * Returns the name of the active gemm backend.
+ */
+const char *matrix_get_gemm_backend(void)
 {
-    return binary_element_wise(A, B, &add);
+#ifdef USE_CBLAS
+    if (gemm_use_cblas)
+    {
+        return "cblas";
+    }
+#endif
+    return "builtin";
 }
 
-struct matrix *matrix_sub(struct matrix *A, struct matrix *B)
+/*
+ * mat_mult_into
+ *
+ * Performs matrix multiplication of two matrices A and B into an existing
+ * matrix C, so that no memory is allocated.
+ *
+ * Parameters:
+ * A: A pointer to the first matrix.
+ * B: A pointer to the second matrix.
+ * C: A pointer to the output matrix, which must be A->rows x B->cols.
+ *
+ * Returns:
+ * C.
+ *
+ * Side effects:
+ * Overwrites the entries of C.
+ */
+struct matrix *mat_mult_into(struct matrix *A, struct matrix *B, struct matrix *C)
 {
-    return binary_element_wise(A, B, &sub);
+    return gemm(false, false, 1.0f, A, B, 0.0f, C);
 }
 
-float squared_2_norm(struct matrix *matrix)
+/*
+ * gemm
+ *
+ * General matrix multiply in the BLAS style: C = alpha * op(A) * op(B) +
+ * beta * C, where op(X) is X or its transpose. Transposed operands are read in
+ * place while packing, so no transposed copy is made. A and B may be stored in
+ * fp16 or bf16; their entries are widened to float while packing, so the
+ * products and sums are computed in float.
+ *
+ * Parameters:
+ * trans_a: Whether to use the transpose of A.
+ * trans_b: Whether to use the transpose of B.
+ * alpha: The scale applied to the product.
+ * A: A pointer to the first matrix.
+ * B: A pointer to the second matrix.
+ * beta: The scale applied to the existing entries of C. With beta == 0 the
+ *       old entries are ignored, and with beta == 1 the product is
+ *       accumulated into C.
+ * C: A pointer to the output matrix, which must be rows(op(A)) x cols(op(B))
+ *    and stored in fp32.
+ *
+ * Returns:
+ * C.
+ *
+ * Side effects:
+ * Overwrites the entries of C.
+ */
+struct matrix *gemm(bool trans_a, bool trans_b, float alpha, struct matrix *A, struct matrix *B, float beta, struct matrix *C)
 {
-    float sum = 0;
-    for (int entry = 0; entry < matrix->size; ++entry)
+    int m = trans_a ? A->cols : A->rows;
+    int k = trans_a ? A->rows : A->cols;
+    int n = trans_b ? B->rows : B->cols;
+    assert((trans_b ? B->cols : B->rows) == k);
+    assert((C->rows == m) && (C->cols == n) && (C->type == ELEMENT_FP32));
+
+#ifdef USE_CBLAS
+    if (gemm_use_cblas && A->type == ELEMENT_FP32 && B->type == ELEMENT_FP32)
     {
-        sum += matrix->entries[entry] * matrix->entries[entry];
+        cblas_sgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans, trans_b ? CblasTrans : CblasNoTrans,
+                    m, n, k, alpha, A->entries, A->cols, B->entries, B->cols, beta, C->entries, C->cols);
+        return C;
     }
-    return sum;
+#endif
+
+    if (beta == 0.0f)
+    {
+        memset(C->entries, 0, C->size * sizeof(float));
+    }
+    else if (beta != 1.0f)
+    {
+        scale_matrix(C, beta);
+    }
+    gemm_parallel(m, n, k, alpha,
+                  A->entries, A->type, trans_a ? 1 : A->cols, trans_a ? A->cols : 1,
+                  B->entries, B->type, trans_b ? 1 : B->cols, trans_b ? B->cols : 1,
+                  C->entries, C->cols);
+    return C;
+}
+
+/*
+ * mat_mult_reference
+ *
+ * Performs matrix multiplication of two matrices A and B with the naive triple
+ * loop. This is kept as the correctness reference for mat_mult.
+ *
+ * Parameters:
+ * A: A pointer to the first matrix.
+ * B: A pointer to the second matrix.
+ *
+ * Returns:
+ * A pointer to the resulting matrix from the multiplication.
+ *
+ * Side effects:
+ * Allocates memory for the resulting matrix.
+ */
+struct matrix *mat_mult_reference(struct matrix *A, struct matrix *B)
+{
+    assert(A->cols == B->rows);
+    struct matrix *mat_prod = construct_matrix(A->rows, B->cols);
+    for (int row = 0; row < A->rows; ++row)
+    {
+        for (int col = 0; col < B->cols; ++col)
+        {
+            float prod = 0;
+            float *start_row_A = A->entries + (row * A->cols);
+            float *start_col_B = B->entries + col;
+            for (int i = 0; i < A->cols; ++i)
+            {
+                prod += start_row_A[i] * start_col_B[B->cols * i];
+            }
+            (mat_prod->entries)[row * B->cols + col] = prod;
+        }
+    }
+    return mat_prod;
+}
+
+/*
+ * array_to_column
+ *
+ * Converts an array to a column matrix.
+ *
+ * Parameters:
+ * size: The number of elements in the array.
+ * arr: The array to be converted.
+ *
+ * Returns:
+ * A pointer to the resulting column matrix.
+ *
+ * Side effects:
+ * Allocates memory for the column matrix.
+ */
+struct matrix *array_to_column(int size, float *arr)
+{
+    struct matrix *matrix = construct_matrix(size, 1);
+    for (int entry = 0; entry < size; ++entry)
+    {
+        (matrix->entries)[entry] = arr[entry];
+    }
+    return matrix;
+}
+
+/*
+ * transpose
+ *
+ * Transposes a matrix.
+ *
+ * Parameters:
+ * matrix: A pointer to the matrix to be transposed.
+ *
+ * Returns:
+ * A pointer to the transposed matrix.
+ *
+ * Side effects:
+ * Allocates memory for the transposed matrix.
+ */
+struct matrix *transpose(struct matrix *matrix)
+{
+    return transpose_into(matrix, construct_matrix(matrix->cols, matrix->rows));
+}
+
+/*
+ * transpose_into
+ *
+ * Transposes a matrix into an existing matrix of the transposed shape.
+ *
+ * Parameters:
+ * matrix: A pointer to the matrix to be transposed.
+ * transposed_matrix: A pointer to the output matrix.
+ *
+ * Returns:
+ * transposed_matrix.
+ *
+ * Side effects:
+ * Overwrites the entries of transposed_matrix.
+ */
+struct matrix *transpose_into(struct matrix *matrix, struct matrix *transposed_matrix)
+{
+    assert((transposed_matrix->rows == matrix->cols) && (transposed_matrix->cols == matrix->rows));
+    for (int row = 0; row < matrix->rows; ++row)
+    {
+        for (int col = 0; col < matrix->cols; ++col)
+        {
+            transposed_matrix->entries[col * transposed_matrix->cols + row] = matrix->entries[row * matrix->cols + col];
+        }
+    }
+    return transposed_matrix;
+}
+
+struct matrix *slice_row(struct matrix *matrix, int a, int b)
+{
+    struct matrix *new = construct_matrix(b - a, matrix->cols);
+    for (int i = 0; i < new->size; ++i)
+    {
+        new->entries[i] = matrix->entries[i + a * matrix->cols];
+    }
+    return new;
+}
+
+struct matrix *slice_col(struct matrix *matrix, int a, int b)
+{
+    return slice_col_into(matrix, a, b, construct_matrix(matrix->rows, b - a));
+}
+
+struct matrix *slice_col_into(struct matrix *matrix, int a, int b, struct matrix *new)
+{
+    assert((new->rows == matrix->rows) && (new->cols == b - a));
+    for (int row = 0; row < new->rows; ++row)
+    {
+        memcpy(new->entries + row * new->cols, matrix->entries + row * matrix->cols + a, new->cols * sizeof(float));
+    }
+    return new;
+}
+
+struct matrix *scale_matrix(struct matrix *matrix, float c)
+{
+    matrix_kernels->scale(matrix->size, matrix->entries, c);
+    return matrix;
+}
+
+struct matrix *binary_element_wise(struct matrix *A, struct matrix *B, float (*fptr)(float, float))
+{
+    assert((A->rows == B->rows) && (A->cols == B->cols));
+    for (int entry = 0; entry < A->size; ++entry)
+    {
+        A->entries[entry] = fptr(A->entries[entry], B->entries[entry]);
+    }
+    return A;
+}
+
+// Element-wise passes over fewer entries than this stay on the calling thread.
+#define ELEMENT_WISE_CHUNK 16384
+
+struct unary_job {
+    struct matrix *matrix;
+    float (*fptr)(float);
+};
+
+static void unary_task(int index, void *arg)
+{
+    struct unary_job *job = arg;
+    int start = index * ELEMENT_WISE_CHUNK;
+    int end = (start + ELEMENT_WISE_CHUNK < job->matrix->size) ? start + ELEMENT_WISE_CHUNK : job->matrix->size;
+    float *entries = job->matrix->entries;
+    for (int entry = start; entry < end; ++entry)
+    {
+        entries[entry] = job->fptr(entries[entry]);
+    }
+}
+
+struct matrix *unary_element_wise(struct matrix *matrix, float (*fptr)(float))
+{
+    struct unary_job job = {matrix, fptr};
+    parallel_for((matrix->size + ELEMENT_WISE_CHUNK - 1) / ELEMENT_WISE_CHUNK, unary_task, &job);
+    return matrix;
+}
+
+struct bias_activation_job {
+    struct matrix *Z;
+    struct matrix *bias;
+    enum activation activation;
+    struct matrix *A;
+    struct matrix *derivative;
+    int rows_per_task;
+};
+
+static void bias_activation_task(int index, void *arg)
+{
+    struct bias_activation_job *job = arg;
+    int start = index * job->rows_per_task;
+    int rows = (job->Z->rows - start < job->rows_per_task) ? job->Z->rows - start : job->rows_per_task;
+    int cols = job->Z->cols;
+    size_t offset = (size_t)start * cols;
+    if (job->A->type == ELEMENT_FP32)
+    {
+        matrix_kernels->bias_activation(job->activation, rows, cols, job->bias->entries + start,
+                                        job->Z->entries + offset, job->A->entries + offset,
+                                        (job->derivative != NULL) ? job->derivative->entries + offset : NULL);
+        return;
+    }
+    // Reduced-precision output: activate a strip at a time into floats, then
+    // round the strip into A. The derivative stays in float.
+    float strip[CONVERT_STRIP];
+    for (int row = 0; row < rows; ++row)
+    {
+        for (int col = 0; col < cols; col += CONVERT_STRIP)
+        {
+            int count = (cols - col < CONVERT_STRIP) ? cols - col : CONVERT_STRIP;
+            size_t entry = offset + (size_t)row * cols + col;
+            matrix_kernels->bias_activation(job->activation, 1, count, job->bias->entries + start + row,
+                                            job->Z->entries + entry, strip,
+                                            (job->derivative != NULL) ? job->derivative->entries + entry : NULL);
+            matrix_kernels->store_half(job->A->type, count, strip, job->A->halves + entry);
+        }
+    }
+}
+
+/*
+ * bias_activation
+ *
+ * Fused layer epilogue: adds a per-row bias to the pre-activations Z, applies
+ * the activation, and optionally stores its derivative, all in one pass.
+ *
+ * Parameters:
+ * Z: A pointer to the pre-activation matrix (without bias).
+ * bias: A pointer to a column matrix with one bias per row of Z.
+ * activation: The activation to apply.
+ * A: A pointer to the output matrix, the same shape as Z. May be Z, or be
+ *    stored in fp16 or bf16, in which case the activations are rounded.
+ *    Softmax output must be fp32.
+ * derivative: A pointer to a matrix that receives the activation's derivative
+ *             at Z + bias, or NULL. May be Z. Must be NULL for softmax, whose
+ *             gradient comes from softmax_cross_entropy.
+ *
+ * Returns:
+ * A.
+ *
+ * Side effects:
+ * Overwrites A and derivative. Large matrices are split across the thread pool.
+ */
+struct matrix *bias_activation(struct matrix *Z, struct matrix *bias, enum activation activation, struct matrix *A, struct matrix *derivative)
+{
+    assert((bias->rows == Z->rows) && (A->rows == Z->rows) && (A->cols == Z->cols));
+    assert((Z->type == ELEMENT_FP32) && (derivative == NULL || derivative->type == ELEMENT_FP32));
+    assert(derivative == NULL || ((derivative->rows == Z->rows) && (derivative->cols == Z->cols)));
+    if (activation == ACTIVATION_SOFTMAX)
+    {
+        assert((derivative == NULL) && (A->type == ELEMENT_FP32));
+        matrix_kernels->softmax(Z->rows, Z->cols, bias->entries, Z->entries, NULL, A->entries, NULL, NULL);
+        return A;
+    }
+    int tasks = (Z->size + ELEMENT_WISE_CHUNK - 1) / ELEMENT_WISE_CHUNK;
+    tasks = (tasks > Z->rows) ? Z->rows : tasks;
+    tasks = (tasks < 1) ? 1 : tasks;
+    struct bias_activation_job job = {Z, bias, activation, A, derivative, (Z->rows + tasks - 1) / tasks};
+    parallel_for((Z->rows + job.rows_per_task - 1) / job.rows_per_task, bias_activation_task, &job);
+    return A;
+}
+
+/*
+ * softmax_cross_entropy
+ *
+ * Fused softmax output layer and cross-entropy loss: computes A =
+ * softmax(Z + bias) down each column, the loss and, optionally, its gradient
+ * with respect to the logits Z + bias, which is simply A - expected, and the
+ * classification counts in one pass over the strip of samples; the softmax Jacobian is never formed. The
+ * loss is computed from the logits with the largest one subtracted, so it
+ * stays finite however confident the network is.
+ *
+ * Parameters:
+ * Z: A pointer to the output layer's weighted inputs (without bias), one
+ *    sample per column.
+ * bias: A pointer to a column matrix with one bias per row of Z.
+ * expected: A pointer to the expected outputs, usually one-hot columns.
+ * A: A pointer to the fp32 matrix that receives the probabilities. May be Z.
+ * gradient: A pointer to a matrix that receives A - expected, or NULL.
+ * confusion: A rows x rows count matrix, or NULL. Each column adds one at
+ *            [expected class][predicted class], where the classes are the
+ *            rows of the largest expected value and of the most probable
+ *            output.
+ *
+ * Returns:
+ * The cross-entropy summed over the columns.
+ *
+ * Side effects:
+ * Overwrites A and gradient, and adds to confusion.
+ */
+float softmax_cross_entropy(struct matrix *Z, struct matrix *bias, struct matrix *expected, struct matrix *A, struct matrix *gradient, int *confusion)
+{
+    assert((bias->rows == Z->rows) && (expected->rows == Z->rows) && (expected->cols == Z->cols));
+    assert((A->rows == Z->rows) && (A->cols == Z->cols) && (A->type == ELEMENT_FP32));
+    assert(gradient == NULL || ((gradient->rows == Z->rows) && (gradient->cols == Z->cols) && (gradient != Z)));
+    return matrix_kernels->softmax(Z->rows, Z->cols, bias->entries, Z->entries, expected->entries, A->entries,
+                                   (gradient != NULL) ? gradient->entries : NULL, confusion);
+}
+
+/*
+ * squared_error
+ *
+ * Squared-error loss 0.5 |A - expected|^2 of an output layer, with its
+ * gradient A - expected and the classification counts in the same pass.
+ *
+ * Parameters:
+ * A: A pointer to the fp32 outputs, one sample per column.
+ * expected: A pointer to the expected outputs.
+ * gradient: A pointer to a matrix that receives A - expected, or NULL.
+ * confusion: A rows x rows count matrix that gets one more at [row of the
+ *            largest expected value][row of the largest output] for each
+ *            column, or NULL.
+ *
+ * Returns:
+ * The loss summed over the columns.
+ *
+ * Side effects:
+ * Overwrites gradient and adds to confusion.
+ */
+float squared_error(struct matrix *A, struct matrix *expected, struct matrix *gradient, int *confusion)
+{
+    assert((expected->rows == A->rows) && (expected->cols == A->cols) && (A->type == ELEMENT_FP32));
+    assert(gradient == NULL || ((gradient->rows == A->rows) && (gradient->cols == A->cols)));
+    return matrix_kernels->squared_error(A->rows, A->cols, A->entries, expected->entries,
+                                         (gradient != NULL) ? gradient->entries : NULL, confusion);
+}
+
+/*
+ * make_conv_shape
+ *
+ * Describes a square window of kernel x kernel taps sliding with the given
+ * stride over channels x height x width images padded with padding zeros on
+ * each side, and computes the size of its output.
+ *
+ * Returns:
+ * The geometry, with out_height and out_width filled in.
+ */
+struct conv_shape make_conv_shape(int channels, int height, int width, int kernel, int stride, int padding)
+{
+    assert((channels > 0) && (kernel > 0) && (stride > 0) && (padding >= 0) && (padding < kernel));
+    assert((height + 2 * padding >= kernel) && (width + 2 * padding >= kernel));
+    struct conv_shape shape = {channels, height, width, kernel, stride, padding,
+                               (height + 2 * padding - kernel) / stride + 1, (width + 2 * padding - kernel) / stride + 1};
+    return shape;
+}
+
+// Returns the number of taps of a filter: channels x kernel x kernel.
+int conv_taps(const struct conv_shape *shape)
+{
+    return shape->channels * shape->kernel * shape->kernel;
+}
+
+// Whether conv2d convolves filters of this shape directly rather than through im2col.
+bool conv_is_direct(const struct conv_shape *shape)
+{
+    return conv_taps(shape) <= CONV_DIRECT_TAPS;
+}
+
+/*
+ * image_row
+ *
+ * Returns the row of the image matrix holding channel c at (y, x), or NULL if
+ * (y, x) falls in the zero padding.
+ */
+static inline float *image_row(const struct conv_shape *shape, float *images, int cols, int c, int y, int x)
+{
+    if (y < 0 || y >= shape->height || x < 0 || x >= shape->width)
+    {
+        return NULL;
+    }
+    return images + ((size_t)(c * shape->height + y) * shape->width + x) * cols;
+}
+
+struct conv_job {
+    const struct conv_shape *shape;
+    struct matrix *images;
+    struct matrix *columns;
+    const float *filters;    // fp32 filters of conv2d's direct path
+    int num_filters;
+    struct matrix *out;      // Output, or the image gradient of max_pool_backward
+    struct matrix *gradient; // Output gradient of max_pool_backward
+};
+
+// Samples whose pooling windows max_pool_backward searches at a time.
+#define POOL_STRIP 64
+
+static void im2col_task(int row, void *arg)
+{
+    struct conv_job *job = arg;
+    const struct conv_shape *shape = job->shape;
+    int k = shape->kernel;
+    int c = row / (k * k);
+    int i = row / k % k;
+    int j = row % k;
+    int cols = job->images->cols;
+    float *column = job->columns->entries + (size_t)row * job->columns->cols;
+    for (int oy = 0; oy < shape->out_height; ++oy)
+    {
+        for (int ox = 0; ox < shape->out_width; ++ox)
+        {
+            const float *run = image_row(shape, job->images->entries, cols, c, oy * shape->stride + i - shape->padding,
+                                         ox * shape->stride + j - shape->padding);
+            float *to = column + (size_t)(oy * shape->out_width + ox) * cols;
+            if (run != NULL)
+            {
+                memcpy(to, run, cols * sizeof(float));
+            }
+            else
+            {
+                memset(to, 0, cols * sizeof(float));
+            }
+        }
+    }
+}
+
+/*
+ * im2col
+ *
+ * Lowers a batch of images so that a convolution becomes one matrix product:
+ * row (c, i, j) of columns holds, for every output position p and sample n,
+ * the input the filter tap (c, i, j) meets at p, at column p * n_samples + n.
+ * The product of the filters (one per row, taps in (c, i, j) order) with
+ * columns is then the convolution output laid out as filters x out_height x
+ * out_width rows with one sample per column. Because samples are the
+ * contiguous dimension, every tap copies whole runs of samples.
+ *
+ * Parameters:
+ * shape: The geometry of the convolution.
+ * images: A pointer to the fp32 images, channels x height x width rows by
+ *         samples.
+ * columns: A pointer to the fp32 output, conv_taps(shape) rows by out_height x
+ *          out_width x samples.
+ *
+ * Returns:
+ * columns.
+ *
+ * Side effects:
+ * Overwrites columns, split by rows across the thread pool.
+ */
+struct matrix *im2col(const struct conv_shape *shape, struct matrix *images, struct matrix *columns)
+{
+    assert(images->rows == shape->channels * shape->height * shape->width);
+    assert((columns->rows == conv_taps(shape)) &&
+           (columns->cols == shape->out_height * shape->out_width * images->cols));
+    assert((images->type == ELEMENT_FP32) && (columns->type == ELEMENT_FP32));
+    struct conv_job job = {shape, images, columns, NULL, 0, NULL, NULL};
+    parallel_for(columns->rows, im2col_task, &job);
+    return columns;
+}
+
+static void col2im_task(int c, void *arg)
+{
+    struct conv_job *job = arg;
+    const struct conv_shape *shape = job->shape;
+    int k = shape->kernel;
+    int cols = job->images->cols;
+    memset(job->images->entries + (size_t)c * shape->height * shape->width * cols, 0,
+           (size_t)shape->height * shape->width * cols * sizeof(float));
+    for (int i = 0; i < k; ++i)
+    {
+        for (int j = 0; j < k; ++j)
+        {
+            const float *column = job->columns->entries + (size_t)((c * k + i) * k + j) * job->columns->cols;
+            for (int oy = 0; oy < shape->out_height; ++oy)
+            {
+                for (int ox = 0; ox < shape->out_width; ++ox)
+                {
+                    float *run = image_row(shape, job->images->entries, cols, c, oy * shape->stride + i - shape->padding,
+                                           ox * shape->stride + j - shape->padding);
+                    if (run != NULL)
+                    {
+                        matrix_kernels->add(cols, run, column + (size_t)(oy * shape->out_width + ox) * cols);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * col2im
+ *
+ * The adjoint of im2col: sums every entry of columns back into the image
+ * position it was copied from, dropping the padding. Used to turn the
+ * gradient with respect to the lowered input into the gradient with respect
+ * to the images.
+ *
+ * Parameters:
+ * shape: The geometry of the convolution.
+ * columns: A pointer to the fp32 lowered matrix, shaped as for im2col.
+ * images: A pointer to the fp32 images that receive the sums.
+ *
+ * Returns:
+ * images.
+ *
+ * Side effects:
+ * Overwrites images, split by channels across the thread pool.
+ */
+struct matrix *col2im(const struct conv_shape *shape, struct matrix *columns, struct matrix *images)
+{
+    assert(images->rows == shape->channels * shape->height * shape->width);
+    assert((columns->rows == conv_taps(shape)) &&
+           (columns->cols == shape->out_height * shape->out_width * images->cols));
+    assert((images->type == ELEMENT_FP32) && (columns->type == ELEMENT_FP32));
+    struct conv_job job = {shape, images, columns, NULL, 0, NULL, NULL};
+    parallel_for(shape->channels, col2im_task, &job);
+    return images;
+}
+
+static void conv_direct_task(int oy, void *arg)
+{
+    struct conv_job *job = arg;
+    const struct conv_shape *shape = job->shape;
+    int k = shape->kernel;
+    int taps = conv_taps(shape);
+    int cols = job->images->cols;
+    int positions = shape->out_height * shape->out_width;
+    const float *x[CONV_DIRECT_TAPS];
+    for (int ox = 0; ox < shape->out_width; ++ox)
+    {
+        int tap = 0;
+        for (int c = 0; c < shape->channels; ++c)
+        {
+            for (int i = 0; i < k; ++i)
+            {
+                for (int j = 0; j < k; ++j)
+                {
+                    x[tap++] = image_row(shape, job->images->entries, cols, c, oy * shape->stride + i - shape->padding,
+                                         ox * shape->stride + j - shape->padding);
+                }
+            }
+        }
+        matrix_kernels->conv_taps(taps, job->num_filters, cols, job->filters, x,
+                                  job->out->entries + (size_t)(oy * shape->out_width + ox) * cols, positions * cols);
+    }
+}
+
+/*
+ * conv2d
+ *
+ * Convolves a batch of images with a bank of filters, without bias. Filters
+ * with at most CONV_DIRECT_TAPS taps are applied directly: each output row is
+ * accumulated from the input rows under the window, one per tap, so nothing
+ * is lowered. Larger filters go through im2col and the blocked gemm.
+ *
+ * Parameters:
+ * shape: The geometry of the convolution.
+ * filters: A pointer to the filters, one per row with its taps in channel,
+ *          row, column order. May be stored in fp16 or bf16.
+ * images: A pointer to the fp32 images, channels x height x width rows by
+ *         samples.
+ * columns: A pointer to the fp32 matrix that receives the lowered images, as
+ *          for im2col. It is left untouched on the direct path.
+ * out: A pointer to the fp32 output, filters x out_height x out_width rows by
+ *      samples.
+ *
+ * Returns:
+ * out.
+ *
+ * Side effects:
+ * Overwrites out, and columns unless conv_is_direct(shape).
+ */
+struct matrix *conv2d(const struct conv_shape *shape, struct matrix *filters, struct matrix *images, struct matrix *columns, struct matrix *out)
+{
+    int positions = shape->out_height * shape->out_width;
+    assert((filters->cols == conv_taps(shape)) && (out->rows == filters->rows * positions));
+    assert((images->cols == out->cols) && (out->type == ELEMENT_FP32));
+    if (!conv_is_direct(shape))
+    {
+        im2col(shape, images, columns);
+        struct matrix product = {.rows = filters->rows, .cols = positions * out->cols, .size = out->size,
+                                 .entries = out->entries, .type = ELEMENT_FP32};
+        gemm(false, false, 1.0f, filters, columns, 0.0f, &product);
+        return out;
+    }
+    assert((images->rows == shape->channels * shape->height * shape->width) && (images->type == ELEMENT_FP32));
+    // The filters are small, so reduced-precision ones are widened up front.
+    float widened[(filters->type == ELEMENT_FP32) ? 1 : filters->size];
+    const float *entries = filters->entries;
+    if (filters->type != ELEMENT_FP32)
+    {
+        matrix_kernels->load_half(filters->type, filters->size, filters->halves, widened);
+        entries = widened;
+    }
+    struct conv_job job = {shape, images, columns, entries, filters->rows, out, NULL};
+    parallel_for(shape->out_height, conv_direct_task, &job);
+    return out;
+}
+
+static void max_pool_task(int c, void *arg)
+{
+    struct conv_job *job = arg;
+    const struct conv_shape *shape = job->shape;
+    int cols = job->images->cols;
+    for (int oy = 0; oy < shape->out_height; ++oy)
+    {
+        for (int ox = 0; ox < shape->out_width; ++ox)
+        {
+            float *to = job->out->entries + ((size_t)(c * shape->out_height + oy) * shape->out_width + ox) * cols;
+            bool first = true;
+            for (int i = 0; i < shape->kernel; ++i)
+            {
+                for (int j = 0; j < shape->kernel; ++j)
+                {
+                    const float *run = image_row(shape, job->images->entries, cols, c,
+                                                 oy * shape->stride + i - shape->padding,
+                                                 ox * shape->stride + j - shape->padding);
+                    if (run == NULL)
+                    {
+                        continue;
+                    }
+                    if (first)
+                    {
+                        memcpy(to, run, cols * sizeof(float));
+                        first = false;
+                        continue;
+                    }
+                    for (int n = 0; n < cols; ++n)
+                    {
+                        to[n] = (run[n] > to[n]) ? run[n] : to[n];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * max_pool
+ *
+ * Takes the largest input under each window, channel by channel. Taps in the
+ * padding are ignored rather than read as zeros.
+ *
+ * Parameters:
+ * shape: The geometry of the pooling window.
+ * images: A pointer to the fp32 images, channels x height x width rows by
+ *         samples.
+ * out: A pointer to the fp32 output, channels x out_height x out_width rows by
+ *      samples.
+ *
+ * Returns:
+ * out.
+ *
+ * Side effects:
+ * Overwrites out, split by channels across the thread pool.
+ */
+struct matrix *max_pool(const struct conv_shape *shape, struct matrix *images, struct matrix *out)
+{
+    assert(images->rows == shape->channels * shape->height * shape->width);
+    assert((out->rows == shape->channels * shape->out_height * shape->out_width) && (out->cols == images->cols));
+    assert((images->type == ELEMENT_FP32) && (out->type == ELEMENT_FP32));
+    struct conv_job job = {shape, images, NULL, NULL, 0, out, NULL};
+    parallel_for(shape->channels, max_pool_task, &job);
+    return out;
+}
+
+static void max_pool_backward_task(int c, void *arg)
+{
+    struct conv_job *job = arg;
+    const struct conv_shape *shape = job->shape;
+    int cols = job->images->cols;
+    float *image_gradient = job->out->entries;
+    memset(image_gradient + (size_t)c * shape->height * shape->width * cols, 0,
+           (size_t)shape->height * shape->width * cols * sizeof(float));
+    const float *runs[shape->kernel * shape->kernel];
+    size_t offsets[shape->kernel * shape->kernel];
+    for (int oy = 0; oy < shape->out_height; ++oy)
+    {
+        for (int ox = 0; ox < shape->out_width; ++ox)
+        {
+            int taps = 0;
+            for (int i = 0; i < shape->kernel; ++i)
+            {
+                for (int j = 0; j < shape->kernel; ++j)
+                {
+                    const float *run = image_row(shape, job->images->entries, cols, c,
+                                                 oy * shape->stride + i - shape->padding,
+                                                 ox * shape->stride + j - shape->padding);
+                    if (run != NULL)
+                    {
+                        runs[taps] = run;
+                        offsets[taps++] = run - job->images->entries;
+                    }
+                }
+            }
+            const float *gradient = job->gradient->entries + ((size_t)(c * shape->out_height + oy) * shape->out_width + ox) * cols;
+            for (int first = 0; first < cols; first += POOL_STRIP)
+            {
+                int count = (cols - first < POOL_STRIP) ? cols - first : POOL_STRIP;
+                float top[POOL_STRIP];
+                int top_tap[POOL_STRIP];
+                for (int n = 0; n < count; ++n)
+                {
+                    top[n] = runs[0][first + n];
+                    top_tap[n] = 0;
+                }
+                for (int tap = 1; tap < taps; ++tap)
+                {
+                    for (int n = 0; n < count; ++n)
+                    {
+                        float value = runs[tap][first + n];
+                        top_tap[n] = (value > top[n]) ? tap : top_tap[n];
+                        top[n] = (value > top[n]) ? value : top[n];
+                    }
+                }
+                for (int n = 0; n < count; ++n)
+                {
+                    image_gradient[offsets[top_tap[n]] + first + n] += gradient[first + n];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * max_pool_backward
+ *
+ * Routes the gradient of each pooled output to the input that max_pool chose
+ * for it, the first largest one of its window. The choice is recomputed from
+ * the inputs, so the forward pass stores no indices.
+ *
+ * Parameters:
+ * shape: The geometry of the pooling window.
+ * images: A pointer to the fp32 inputs of the forward pass.
+ * gradient: A pointer to the fp32 gradient with respect to the outputs.
+ * image_gradient: A pointer to the fp32 matrix that receives the gradient
+ *                 with respect to the inputs, the same shape as images.
+ *
+ * Returns:
+ * image_gradient.
+ *
+ * Side effects:
+ * Overwrites image_gradient, split by channels across the thread pool.
+ */
+struct matrix *max_pool_backward(const struct conv_shape *shape, struct matrix *images, struct matrix *gradient, struct matrix *image_gradient)
+{
+    assert((image_gradient->rows == images->rows) && (image_gradient->cols == images->cols));
+    assert((gradient->rows == shape->channels * shape->out_height * shape->out_width) && (gradient->cols == images->cols));
+    assert((images->type == ELEMENT_FP32) && (gradient->type == ELEMENT_FP32) && (image_gradient->type == ELEMENT_FP32));
+    struct conv_job job = {shape, images, NULL, NULL, 0, image_gradient, gradient};
+    parallel_for(shape->channels, max_pool_backward_task, &job);
+    return image_gradient;
+}
+
+static int block_row_count(const struct sparse_matrix *sparse)
+{
+    return (sparse->rows + sparse->block_rows - 1) / sparse->block_rows;
+}
+
+// Rows of the block row starting at row, which may be short at the end.
+static int block_height(const struct sparse_matrix *sparse, int row)
+{
+    return (sparse->rows - row < sparse->block_rows) ? sparse->rows - row : sparse->block_rows;
+}
+
+/*
+ * construct_sparse_matrix
+ *
+ * Builds the blocked CSR form of a dense matrix (see struct sparse_matrix),
+ * keeping every block that holds a nonzero.
+ *
+ * Parameters:
+ * dense: A pointer to the fp32 matrix to compress.
+ * block_rows: The rows per block, 1 for plain CSR.
+ *
+ * Returns:
+ * A pointer to the newly constructed sparse matrix.
+ *
+ * Side effects:
+ * Allocates the sparse matrix and its arrays.
+ */
+struct sparse_matrix *construct_sparse_matrix(struct matrix *dense, int block_rows)
+{
+    assert((dense->type == ELEMENT_FP32) && (block_rows > 0));
+    struct sparse_matrix *sparse = malloc(sizeof(struct sparse_matrix));
+    sparse->rows = dense->rows;
+    sparse->cols = dense->cols;
+    sparse->block_rows = block_rows;
+    int count = block_row_count(sparse);
+    sparse->row_offsets = malloc((count + 1) * sizeof(int));
+    sparse->row_offsets[0] = 0;
+    sparse->max_blocks = 0;
+    for (int b = 0; b < count; ++b)
+    {
+        int row = b * block_rows, height = block_height(sparse, row), blocks = 0;
+        for (int col = 0; col < dense->cols; ++col)
+        {
+            bool nonzero = false;
+            for (int i = 0; i < height; ++i)
+            {
+                nonzero |= dense->entries[(size_t)(row + i) * dense->cols + col] != 0.0f;
+            }
+            blocks += nonzero;
+        }
+        sparse->row_offsets[b + 1] = sparse->row_offsets[b] + blocks;
+        sparse->max_blocks = (blocks > sparse->max_blocks) ? blocks : sparse->max_blocks;
+    }
+    sparse->num_blocks = sparse->row_offsets[count];
+    sparse->col_indices = malloc(((sparse->num_blocks > 0) ? sparse->num_blocks : 1) * sizeof(int));
+    sparse->values = malloc(((sparse->num_blocks > 0) ? sparse->num_blocks : 1) * (size_t)block_rows * sizeof(float));
+    for (int b = 0; b < count; ++b)
+    {
+        int row = b * block_rows, height = block_height(sparse, row), k = sparse->row_offsets[b];
+        for (int col = 0; col < dense->cols; ++col)
+        {
+            bool nonzero = false;
+            for (int i = 0; i < height; ++i)
+            {
+                nonzero |= dense->entries[(size_t)(row + i) * dense->cols + col] != 0.0f;
+            }
+            if (nonzero)
+            {
+                sparse->col_indices[k++] = col;
+            }
+        }
+    }
+    sparse_refresh(sparse, dense);
+    return sparse;
+}
+
+void destruct_sparse_matrix(struct sparse_matrix *sparse)
+{
+    free(sparse->row_offsets);
+    free(sparse->col_indices);
+    free(sparse->values);
+    free(sparse);
+}
+
+/*
+ * sparse_density
+ *
+ * Returns the fraction of the dense entries that the sparse form stores,
+ * explicit zeros inside kept blocks included.
+ */
+float sparse_density(const struct sparse_matrix *sparse)
+{
+    double stored = 0.0;
+    for (int b = 0; b < block_row_count(sparse); ++b)
+    {
+        int blocks = sparse->row_offsets[b + 1] - sparse->row_offsets[b];
+        stored += (double)block_height(sparse, b * sparse->block_rows) * blocks;
+    }
+    return (float)(stored / ((double)sparse->rows * sparse->cols));
+}
+
+/*
+ * sparse_matrix_bytes
+ *
+ * Returns the memory taken by the values and indices of a sparse matrix.
+ */
+size_t sparse_matrix_bytes(const struct sparse_matrix *sparse)
+{
+    return (size_t)sparse->num_blocks * (sparse->block_rows * sizeof(float) + sizeof(int)) +
+           (block_row_count(sparse) + 1) * sizeof(int);
+}
+
+/*
+ * sparse_refresh
+ *
+ * Brings a sparse matrix up to date with the dense matrix it was built from
+ * after the latter changed, keeping the sparsity pattern: the values of the
+ * stored blocks are copied from the dense matrix, and every dense entry
+ * outside them is reset to zero. Used as a mask, this keeps pruned weights
+ * pruned while the rest train.
+ *
+ * Parameters:
+ * sparse: A pointer to the sparse matrix.
+ * dense: A pointer to the fp32 matrix of the same shape.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites the values of sparse and the unstored entries of dense.
+ */
+void sparse_refresh(struct sparse_matrix *sparse, struct matrix *dense)
+{
+    assert((dense->rows == sparse->rows) && (dense->cols == sparse->cols) && (dense->type == ELEMENT_FP32));
+    for (int b = 0; b < block_row_count(sparse); ++b)
+    {
+        int row = b * sparse->block_rows, height = block_height(sparse, row);
+        int start = sparse->row_offsets[b], blocks = sparse->row_offsets[b + 1] - start;
+        float *panel = sparse->values + (size_t)start * sparse->block_rows;
+        for (int i = 0; i < height; ++i)
+        {
+            float *dense_row = dense->entries + (size_t)(row + i) * dense->cols;
+            int col = 0;
+            for (int k = 0; k < blocks; ++k)
+            {
+                int kept = sparse->col_indices[start + k];
+                memset(dense_row + col, 0, (kept - col) * sizeof(float));
+                panel[(size_t)i * blocks + k] = dense_row[kept];
+                col = kept + 1;
+            }
+            memset(dense_row + col, 0, (dense->cols - col) * sizeof(float));
+        }
+    }
+}
+
+// Columns of B per spmm task, so the rows of B one block row reads are still
+// in cache for the next.
+#define SPMM_COLUMNS 256
+
+struct spmm_job {
+    const struct sparse_matrix *A;
+    struct matrix *B;
+    struct matrix *C;
+    int block_rows;     // Block row count of A
+};
+
+static void spmm_task(int index, void *arg)
+{
+    struct spmm_job *job = arg;
+    const struct sparse_matrix *A = job->A;
+    int b = index % job->block_rows, first = index / job->block_rows * SPMM_COLUMNS;
+    int n = (job->B->cols - first < SPMM_COLUMNS) ? job->B->cols - first : SPMM_COLUMNS;
+    int row = b * A->block_rows, start = A->row_offsets[b], blocks = A->row_offsets[b + 1] - start;
+    const float *x[(A->max_blocks > 0) ? A->max_blocks : 1];
+    for (int k = 0; k < blocks; ++k)
+    {
+        x[k] = job->B->entries + (size_t)A->col_indices[start + k] * job->B->cols + first;
+    }
+    matrix_kernels->conv_taps(blocks, block_height(A, row), n, A->values + (size_t)start * A->block_rows, x,
+                              job->C->entries + (size_t)row * job->C->cols + first, job->C->cols);
+}
+
+/*
+ * spmm
+ *
+ * Multiplies a sparse matrix by a dense one: C = A * B. Each block row is a
+ * weighted sum of the rows of B under its blocks, which is the sum of shifted
+ * input rows a direct convolution computes, so it runs on the conv_taps
+ * kernel with the blocks as taps and the block rows as filters. The work is
+ * proportional to the stored blocks, not to the dense size of A.
+ *
+ * Parameters:
+ * A: A pointer to the sparse matrix.
+ * B: A pointer to the fp32 dense matrix, A->cols rows.
+ * C: A pointer to the fp32 result, A->rows x B->cols.
+ *
+ * Returns:
+ * C.
+ *
+ * Side effects:
+ * Overwrites C, split by block rows and runs of SPMM_COLUMNS columns across
+ * the thread pool.
+ */
+struct matrix *spmm(const struct sparse_matrix *A, struct matrix *B, struct matrix *C)
+{
+    assert((B->rows == A->cols) && (C->rows == A->rows) && (C->cols == B->cols));
+    assert((B->type == ELEMENT_FP32) && (C->type == ELEMENT_FP32));
+    struct spmm_job job = {A, B, C, block_row_count(A)};
+    parallel_for((B->cols + SPMM_COLUMNS - 1) / SPMM_COLUMNS * job.block_rows, spmm_task, &job);
+    return C;
+}
+
+/*
+ * gemv_panel_size
+ *
+ * Returns the number of floats pack_gemv writes for a rows x cols matrix:
+ * rows rounded up to whole panels of GEMV_ROWS rows.
+ */
+size_t gemv_panel_size(int rows, int cols)
+{
+    return (size_t)(rows + GEMV_ROWS - 1) / GEMV_ROWS * GEMV_ROWS * cols;
+}
+
+/*
+ * pack_gemv
+ *
+ * Packs a matrix for gemv_packed: panels of GEMV_ROWS rows interleaved along
+ * the columns, so that the GEMV kernel reads GEMV_ROWS consecutive weights per
+ * input. Rows past the end of the matrix are zero padded.
+ *
+ * Parameters:
+ * matrix: A pointer to the fp32 matrix to be packed.
+ * panels: Where the panels are written; gemv_panel_size floats.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites panels.
+ */
+void pack_gemv(struct matrix *matrix, float *panels)
+{
+    assert(matrix->type == ELEMENT_FP32);
+    for (int panel = 0; panel < matrix->rows; panel += GEMV_ROWS)
+    {
+        for (int col = 0; col < matrix->cols; ++col)
+        {
+            for (int i = 0; i < GEMV_ROWS; ++i)
+            {
+                int row = panel + i;
+                panels[col * GEMV_ROWS + i] = (row < matrix->rows) ? matrix->entries[(size_t)row * matrix->cols + col] : 0.0f;
+            }
+        }
+        panels += (size_t)GEMV_ROWS * matrix->cols;
+    }
+}
+
+/*
+ * gemv_packed
+ *
+ * Fused single-sample layer: y = f(W x + bias) with W packed by pack_gemv.
+ *
+ * Parameters:
+ * rows: The number of rows of W, and of entries in bias and y.
+ * cols: The number of columns of W, and of entries in x.
+ * panels: The packed weights.
+ * bias: One bias per row.
+ * activation: The activation to apply.
+ * x: The input vector.
+ * y: The output vector; it must not overlap x.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites y. Runs on the calling thread and does not allocate.
+ */
+void gemv_packed(int rows, int cols, const float *panels, const float *bias, enum activation activation, const float *x, float *y)
+{
+    matrix_kernels->gemv(activation, rows, cols, panels, bias, x, y);
+}
+
+float add(float a, float b)
+{
+    return a + b;
+}
+
+float sub(float a, float b)
+{
+    return a - b;
+}
+
+float mult(float a, float b)
+{
+    return a * b;
+}
+
+struct matrix *hadamard_product(struct matrix *A, struct matrix *B)
+{
+    assert((A->rows == B->rows) && (A->cols == B->cols));
+    matrix_kernels->mult(A->size, A->entries, B->entries);
+    return A;
+}
+
+struct matrix *matrix_add(struct matrix *A, struct matrix *B)
+{
+    assert((A->rows == B->rows) && (A->cols == B->cols));
+    matrix_kernels->add(A->size, A->entries, B->entries);
+    return A;
+}
+
+struct matrix *matrix_sub(struct matrix *A, struct matrix *B)
+{
+    assert((A->rows == B->rows) && (A->cols == B->cols));
+    matrix_kernels->sub(A->size, A->entries, B->entries);
+    return A;
+}
+
+/*
+ * matrix_axpy
+ *
+ * Accumulates Y += a * X in a single pass.
+ *
+ * Parameters:
+ * a: The scale applied to X.
+ * X: A pointer to the matrix to be added.
+ * Y: A pointer to the matrix to be updated.
+ *
+ * Returns:
+ * Y.
+ *
+ * Side effects:
+ * Modifies Y in place.
+ */
+struct matrix *matrix_axpy(float a, struct matrix *X, struct matrix *Y)
+{
+    assert((X->rows == Y->rows) && (X->cols == Y->cols));
+    matrix_kernels->axpy(X->size, a, X->entries, Y->entries);
+    return Y;
+}
+
+float squared_2_norm(struct matrix *matrix)
+{
+    return matrix_kernels->sum_squares(matrix->size, matrix->entries);
 }
@@ -3,31 +3,132 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Storage formats for matrix entries. Reduced formats hold 16-bit values that
+ * are widened to float when loaded and rounded to nearest even when stored;
+ * arithmetic is always done in float.
+ */
+enum element_type {
+    ELEMENT_FP32,
+    ELEMENT_FP16,
+    ELEMENT_BF16
+};
 
 struct matrix {
     int rows;
     int cols;
     int size;
-    float *entries;
+    union {
+        float *entries;     // ELEMENT_FP32
+        uint16_t *halves;   // ELEMENT_FP16 and ELEMENT_BF16
+    };
+    enum element_type type;
+};
+
+// Activations with fused kernels; the order matches the names in neural_net.c.
+enum activation {
+    ACTIVATION_SIGMOID,
+    ACTIVATION_RELU,
+    ACTIVATION_TANH,
+    ACTIVATION_SOFTMAX  // Across the rows of each column; output layer only
+};
+
+/*
+ * Geometry of a square convolution or pooling window sliding over images that
+ * are stored one per column, as channels x height x width rows: the entry of
+ * channel c at (y, x) of sample n is in row (c * height + y) * width + x.
+ */
+struct conv_shape {
+    int channels;
+    int height;
+    int width;
+    int kernel;     // Window width and height
+    int stride;
+    int padding;    // Zeros added around each side of the input
+    int out_height;
+    int out_width;
+};
+
+// Filters with at most this many taps (channels x kernel x kernel) are
+// convolved directly instead of through im2col and gemm.
+#define CONV_DIRECT_TAPS 32
+
+/*
+ * A sparse matrix in blocked compressed sparse row form. The rows are split
+ * into block rows of block_rows rows (the last may be shorter), and each
+ * block row stores, in column order, the block_rows x 1 blocks that hold a
+ * nonzero; block_rows 1 is plain CSR. Block row b owns blocks row_offsets[b]
+ * to row_offsets[b + 1] - 1, with their columns in col_indices, and keeps
+ * their values as one row-major panel of its rows x its blocks starting at
+ * values + row_offsets[b] * block_rows, so each row of a panel is contiguous.
+ */
+struct sparse_matrix {
+    int rows;
+    int cols;
+    int block_rows;
+    int num_blocks;     // Stored blocks, row_offsets[block row count]
+    int max_blocks;     // Most blocks in one block row
+    int *row_offsets;   // One per block row, plus the end
+    int *col_indices;   // One per block
+    float *values;      // num_blocks * block_rows
 };
 
 // Function declarations
 void print_array(int size, int array[]);
 void print_matrix(struct matrix *matrix);
 struct matrix *construct_matrix(int rows, int cols);
+struct matrix *construct_matrix_typed(int rows, int cols, enum element_type type);
 void destruct_matrix(struct matrix *matrix);
 void destruct_matrix_array(int size, struct matrix **matrix_array);
 struct matrix *copy_matrix(struct matrix *matrix);
+struct matrix *copy_matrix_into(struct matrix *matrix, struct matrix *copy);
+struct matrix *convert_matrix(struct matrix *matrix, enum element_type type);
+size_t element_size(enum element_type type);
+const char *element_type_name(enum element_type type);
 struct matrix *mat_mult(struct matrix *A, struct matrix *B);
+struct matrix *mat_mult_into(struct matrix *A, struct matrix *B, struct matrix *C);
+struct matrix *gemm(bool trans_a, bool trans_b, float alpha, struct matrix *A, struct matrix *B, float beta, struct matrix *C);
+struct matrix *mat_mult_reference(struct matrix *A, struct matrix *B);
 struct matrix *array_to_column(int size, float *arr);
 struct matrix *transpose(struct matrix *matrix);
+struct matrix *transpose_into(struct matrix *matrix, struct matrix *transposed_matrix);
 struct matrix *slice_row(struct matrix *matrix, int a, int b);
+struct matrix *slice_col(struct matrix *matrix, int a, int b);
+struct matrix *slice_col_into(struct matrix *matrix, int a, int b, struct matrix *new);
 struct matrix *scale_matrix(struct matrix *matrix, float c);
 struct matrix *binary_element_wise(struct matrix *A, struct matrix *B, float (*fptr)(float, float));
 struct matrix *unary_element_wise(struct matrix *matrix, float (*fptr)(float));
 struct matrix *matrix_add(struct matrix *A, struct matrix *B);
 struct matrix *matrix_sub(struct matrix *A, struct matrix *B);
 struct matrix *hadamard_product(struct matrix *A, struct matrix *B);
+struct matrix *matrix_axpy(float a, struct matrix *X, struct matrix *Y);
 float squared_2_norm(struct matrix *matrix);
+struct matrix *bias_activation(struct matrix *Z, struct matrix *bias, enum activation activation, struct matrix *A, struct matrix *derivative);
+float softmax_cross_entropy(struct matrix *Z, struct matrix *bias, struct matrix *expected, struct matrix *A, struct matrix *gradient, int *confusion);
+float squared_error(struct matrix *A, struct matrix *expected, struct matrix *gradient, int *confusion);
+struct conv_shape make_conv_shape(int channels, int height, int width, int kernel, int stride, int padding);
+int conv_taps(const struct conv_shape *shape);
+bool conv_is_direct(const struct conv_shape *shape);
+struct matrix *im2col(const struct conv_shape *shape, struct matrix *images, struct matrix *columns);
+struct matrix *col2im(const struct conv_shape *shape, struct matrix *columns, struct matrix *images);
+struct matrix *conv2d(const struct conv_shape *shape, struct matrix *filters, struct matrix *images, struct matrix *columns, struct matrix *out);
+struct matrix *max_pool(const struct conv_shape *shape, struct matrix *images, struct matrix *out);
+struct matrix *max_pool_backward(const struct conv_shape *shape, struct matrix *images, struct matrix *gradient, struct matrix *image_gradient);
+struct sparse_matrix *construct_sparse_matrix(struct matrix *dense, int block_rows);
+void destruct_sparse_matrix(struct sparse_matrix *sparse);
+float sparse_density(const struct sparse_matrix *sparse);
+size_t sparse_matrix_bytes(const struct sparse_matrix *sparse);
+void sparse_refresh(struct sparse_matrix *sparse, struct matrix *dense);
+struct matrix *spmm(const struct sparse_matrix *A, struct matrix *B, struct matrix *C);
+size_t gemv_panel_size(int rows, int cols);
+void pack_gemv(struct matrix *matrix, float *panels);
+void gemv_packed(int rows, int cols, const float *panels, const float *bias, enum activation activation, const float *x, float *y);
+int matrix_set_isa(const char *name);
+const char *matrix_get_isa(void);
+int matrix_set_gemm_backend(const char *name);
+const char *matrix_get_gemm_backend(void);
 
 #endif // MATRIX_H
\ No newline at end of file
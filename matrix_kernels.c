@@ -0,0 +1,2078 @@
+/*
+ * matrix_kernels.c
+ *
+ * This file implements the vectorized inner loops used by matrix.c: the GEMM
+ * micro-kernels, the single-sample GEMV, the int8 product used for quantized
+ * inference, the fp16 and bf16 conversions, the fused optimizer updates, the
+ * fused output losses and the element-wise primitives.
+ * There is one table per instruction set (portable C, SSE2, AVX2, AVX-512 and
+ * NEON) and the best one supported by the CPU is selected at startup.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "matrix.h"
+#include "matrix_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MATRIX_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define MATRIX_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * store_tile
+ *
+ * Adds the top-left m x n corner of a register tile that was spilled to memory
+ * into C. Used by the micro-kernels for the ragged edges of the output.
+ */
+static void store_tile(const float *tile, int ld_tile, float *C, int ldc, int m, int n)
+{
+    for (int i = 0; i < m; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            C[i * ldc + j] += tile[i * ld_tile + j];
+        }
+    }
+}
+
+/*
+ * fast_expf
+ *
+ * Vectorizable exp(x): x = n ln 2 + r with |r| <= ln 2 / 2, exp(r) from the
+ * Cephes degree-6 polynomial, and 2^n built directly in the exponent bits.
+ * Inputs are clamped to [-87.3, 88.3] so the result stays a normal float.
+ * The relative error against exp is below 1.5e-7 (about 1 ulp) on the whole
+ * clamped range. Sigmoid and tanh built on it are within 2e-7 absolute of the
+ * exact functions, and their derivatives within 4e-7.
+ * Rounding uses the 1.5 * 2^23 trick, which relies on strict IEEE evaluation
+ * (no -ffast-math).
+ */
+static inline __attribute__((always_inline)) float fast_expf(float x)
+{
+    x = (x < -87.3f) ? -87.3f : x;
+    x = (x > 88.3f) ? 88.3f : x;
+    float n = (x * 1.44269504088896341f + 12582912.0f) - 12582912.0f;
+    float r = x - n * 0.693359375f;
+    r = r - n * -2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    int bits = ((int)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+/*
+ * bias_activation_body
+ *
+ * Layer epilogue: A = f(Z + bias) and, when D is not NULL, D = f'(Z + bias),
+ * with one bias per row. Each row is a contiguous run of samples sharing one
+ * bias, so the inner loops vectorize. D may alias Z. The body is inlined into
+ * per-ISA wrappers so that each is compiled for its own vector width.
+ * Softmax works across rows and is handled by softmax_body instead.
+ */
+static inline __attribute__((always_inline)) void bias_activation_body(int activation, int rows, int cols, const float *bias,
+                                                                        const float *Z, float *A, float *D)
+{
+    for (int row = 0; row < rows; ++row)
+    {
+        const float b = bias[row];
+        const float *z = Z + (size_t)row * cols;
+        float *a = A + (size_t)row * cols;
+        float *d = (D != NULL) ? D + (size_t)row * cols : NULL;
+        switch (activation)
+        {
+        case ACTIVATION_SIGMOID:
+            for (int col = 0; col < cols; ++col)
+            {
+                a[col] = 1.0f / (1.0f + fast_expf(-(z[col] + b)));
+            }
+            if (d != NULL)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    d[col] = a[col] * (1.0f - a[col]);
+                }
+            }
+            break;
+        case ACTIVATION_TANH:
+            for (int col = 0; col < cols; ++col)
+            {
+                a[col] = 1.0f - 2.0f / (fast_expf(2.0f * (z[col] + b)) + 1.0f);
+            }
+            if (d != NULL)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    d[col] = 1.0f - a[col] * a[col];
+                }
+            }
+            break;
+        case ACTIVATION_RELU:
+            if (d != NULL)
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    float x = z[col] + b;
+                    d[col] = (x > 0.0f) ? 1.0f : 0.01f;
+                    a[col] = (x > 0.0f) ? x : 0.01f * x;
+                }
+            }
+            else
+            {
+                for (int col = 0; col < cols; ++col)
+                {
+                    float x = z[col] + b;
+                    a[col] = (x > 0.0f) ? x : 0.01f * x;
+                }
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * softmax_body
+ *
+ * Output layer with softmax across the rows of each column: A = softmax(Z +
+ * bias), with bias NULL meaning zero. When Y is not NULL it also returns the
+ * cross-entropy -sum(Y log A) over all columns, computed from the logits as
+ * sum(Y) (max + log sum exp(x - max)) - sum(Y x) so that no probability is
+ * ever passed to log, and writes the gradient with respect to the logits,
+ * A - Y, to D if D is not NULL; the softmax Jacobian is never formed. When
+ * confusion is not NULL, each column also adds one to the rows x rows count
+ * confusion[expected * rows + predicted], where predicted is the row of its
+ * largest output and expected the row of its largest entry of Y.
+ * Columns are processed in strips of SOFTMAX_STRIP samples, and every inner
+ * loop runs along a row of the strip, so the loops vectorize across samples.
+ * A may alias Z; D must not.
+ */
+#define SOFTMAX_STRIP 64
+
+static inline __attribute__((always_inline)) float softmax_body(int rows, int cols, const float *bias, const float *Z,
+                                                                const float *Y, float *A, float *D, int *confusion)
+{
+    float loss = 0.0f;
+    for (int first = 0; first < cols; first += SOFTMAX_STRIP)
+    {
+        int n = (cols - first < SOFTMAX_STRIP) ? cols - first : SOFTMAX_STRIP;
+        float top[SOFTMAX_STRIP], label[SOFTMAX_STRIP], total[SOFTMAX_STRIP], mass[SOFTMAX_STRIP], dot[SOFTMAX_STRIP];
+        int top_row[SOFTMAX_STRIP], label_row[SOFTMAX_STRIP];
+        for (int c = 0; c < n; ++c)
+        {
+            top[c] = -INFINITY;
+            label[c] = -INFINITY;
+            top_row[c] = 0;
+            label_row[c] = 0;
+            total[c] = 0.0f;
+            mass[c] = 0.0f;
+            dot[c] = 0.0f;
+        }
+
+        // The largest logit of each sample, and the predicted and expected rows.
+        for (int row = 0; row < rows; ++row)
+        {
+            const float b = (bias != NULL) ? bias[row] : 0.0f;
+            const float *z = Z + (size_t)row * cols + first;
+            for (int c = 0; c < n; ++c)
+            {
+                float x = z[c] + b;
+                top_row[c] = (x > top[c]) ? row : top_row[c];
+                top[c] = (x > top[c]) ? x : top[c];
+            }
+            if (Y != NULL)
+            {
+                const float *y = Y + (size_t)row * cols + first;
+                for (int c = 0; c < n; ++c)
+                {
+                    label_row[c] = (y[c] > label[c]) ? row : label_row[c];
+                    label[c] = (y[c] > label[c]) ? y[c] : label[c];
+                }
+            }
+        }
+
+        // The shifted exponentials and their sums, and the terms of the loss.
+        for (int row = 0; row < rows; ++row)
+        {
+            const float b = (bias != NULL) ? bias[row] : 0.0f;
+            const float *z = Z + (size_t)row * cols + first;
+            float *a = A + (size_t)row * cols + first;
+            if (Y != NULL)
+            {
+                const float *y = Y + (size_t)row * cols + first;
+                for (int c = 0; c < n; ++c)
+                {
+                    float x = z[c] + b;
+                    mass[c] += y[c];
+                    dot[c] += y[c] * x;
+                    a[c] = fast_expf(x - top[c]);
+                    total[c] += a[c];
+                }
+            }
+            else
+            {
+                for (int c = 0; c < n; ++c)
+                {
+                    a[c] = fast_expf(z[c] + b - top[c]);
+                    total[c] += a[c];
+                }
+            }
+        }
+
+        for (int c = 0; c < n; ++c)
+        {
+            if (Y != NULL)
+            {
+                loss += mass[c] * (top[c] + logf(total[c])) - dot[c];
+            }
+            total[c] = 1.0f / total[c];
+        }
+        if (Y != NULL && confusion != NULL)
+        {
+            for (int c = 0; c < n; ++c)
+            {
+                ++confusion[label_row[c] * rows + top_row[c]];
+            }
+        }
+        for (int row = 0; row < rows; ++row)
+        {
+            float *a = A + (size_t)row * cols + first;
+            for (int c = 0; c < n; ++c)
+            {
+                a[c] *= total[c];
+            }
+            if (D != NULL)
+            {
+                const float *y = Y + (size_t)row * cols + first;
+                float *d = D + (size_t)row * cols + first;
+                for (int c = 0; c < n; ++c)
+                {
+                    d[c] = a[c] - y[c];
+                }
+            }
+        }
+    }
+    return loss;
+}
+
+/*
+ * squared_error_body
+ *
+ * Output layer loss 0.5 sum((A - Y)^2) over all columns, with its gradient
+ * A - Y written to D if D is not NULL, and the confusion counts of the
+ * columns' largest entries of A and Y as in softmax_body. Works on strips of
+ * columns like softmax_body.
+ */
+static inline __attribute__((always_inline)) float squared_error_body(int rows, int cols, const float *A, const float *Y,
+                                                                      float *D, int *confusion)
+{
+    float loss = 0.0f;
+    for (int first = 0; first < cols; first += SOFTMAX_STRIP)
+    {
+        int n = (cols - first < SOFTMAX_STRIP) ? cols - first : SOFTMAX_STRIP;
+        float top[SOFTMAX_STRIP], label[SOFTMAX_STRIP], sum[SOFTMAX_STRIP];
+        int top_row[SOFTMAX_STRIP], label_row[SOFTMAX_STRIP];
+        for (int c = 0; c < n; ++c)
+        {
+            top[c] = -INFINITY;
+            label[c] = -INFINITY;
+            top_row[c] = 0;
+            label_row[c] = 0;
+            sum[c] = 0.0f;
+        }
+        for (int row = 0; row < rows; ++row)
+        {
+            const float *a = A + (size_t)row * cols + first;
+            const float *y = Y + (size_t)row * cols + first;
+            for (int c = 0; c < n; ++c)
+            {
+                float error = a[c] - y[c];
+                sum[c] += error * error;
+                top_row[c] = (a[c] > top[c]) ? row : top_row[c];
+                top[c] = (a[c] > top[c]) ? a[c] : top[c];
+                label_row[c] = (y[c] > label[c]) ? row : label_row[c];
+                label[c] = (y[c] > label[c]) ? y[c] : label[c];
+            }
+            if (D != NULL)
+            {
+                float *d = D + (size_t)row * cols + first;
+                for (int c = 0; c < n; ++c)
+                {
+                    d[c] = a[c] - y[c];
+                }
+            }
+        }
+        for (int c = 0; c < n; ++c)
+        {
+            loss += 0.5f * sum[c];
+        }
+        if (confusion != NULL)
+        {
+            for (int c = 0; c < n; ++c)
+            {
+                ++confusion[label_row[c] * rows + top_row[c]];
+            }
+        }
+    }
+    return loss;
+}
+
+/*
+ * conv_taps_body
+ *
+ * Direct convolution at one output position for a bank of filters: row f of
+ * y (at y + f * ldy) is the sum over taps t of w[f * taps + t] x[t], where
+ * each x[t] is the row of n samples of the input under tap t, or NULL for a
+ * tap in the zero padding. Like the GEMM micro-kernels it works on tiles of
+ * CONV_FILTERS filters by CONV_STRIP samples held in accumulators across all
+ * the taps, so each input run loaded feeds every filter of the tile and y is
+ * written once. Partial tiles at the edges take the same loops with shorter
+ * bounds.
+ */
+#define CONV_FILTERS 4
+#define CONV_STRIP 16
+
+static inline __attribute__((always_inline)) void conv_tile_body(int taps, const float *w, const float *const *x,
+                                                                int first, int filters, int count, float *y, int ldy)
+{
+    float acc[CONV_FILTERS][CONV_STRIP] = {{0}};
+    if (filters == CONV_FILTERS && count == CONV_STRIP)
+    {
+        for (int t = 0; t < taps; ++t)
+        {
+            if (x[t] == NULL)
+            {
+                continue;
+            }
+            const float *run = x[t] + first;
+            for (int f = 0; f < CONV_FILTERS; ++f)
+            {
+                const float w_ft = w[f * taps + t];
+                for (int c = 0; c < CONV_STRIP; ++c)
+                {
+                    acc[f][c] += w_ft * run[c];
+                }
+            }
+        }
+    }
+    else
+    {
+        for (int t = 0; t < taps; ++t)
+        {
+            if (x[t] == NULL)
+            {
+                continue;
+            }
+            const float *run = x[t] + first;
+            for (int f = 0; f < filters; ++f)
+            {
+                const float w_ft = w[f * taps + t];
+                for (int c = 0; c < count; ++c)
+                {
+                    acc[f][c] += w_ft * run[c];
+                }
+            }
+        }
+    }
+    for (int f = 0; f < filters; ++f)
+    {
+        memcpy(y + (size_t)f * ldy + first, acc[f], count * sizeof(float));
+    }
+}
+
+static inline __attribute__((always_inline)) void conv_taps_body(int taps, int filters, int n, const float *w,
+                                                                const float *const *x, float *y, int ldy)
+{
+    for (int f = 0; f < filters; f += CONV_FILTERS)
+    {
+        int tile_filters = (filters - f < CONV_FILTERS) ? filters - f : CONV_FILTERS;
+        for (int first = 0; first < n; first += CONV_STRIP)
+        {
+            int count = (n - first < CONV_STRIP) ? n - first : CONV_STRIP;
+            conv_tile_body(taps, w + (size_t)f * taps, x, first, tile_filters, count, y + (size_t)f * ldy, ldy);
+        }
+    }
+}
+
+/*
+ * gemm_s8_body
+ *
+ * Integer product C = A B where A is m x k and B is k x n, both row-major
+ * int8, accumulated exactly in int32 in the rows of C. The inner loop is a
+ * widening multiply-add along a row of B that the compiler vectorizes.
+ */
+static inline __attribute__((always_inline)) void gemm_s8_body(int m, int n, int k, const int8_t *a, const int8_t *b,
+                                                              int ldb, int32_t *C, int ldc)
+{
+    for (int i = 0; i < m; ++i)
+    {
+        int32_t *c_i = C + (size_t)i * ldc;
+        memset(c_i, 0, n * sizeof(int32_t));
+        for (int p = 0; p < k; ++p)
+        {
+            int32_t a_ip = a[(size_t)i * k + p];
+            const int8_t *b_p = b + (size_t)p * ldb;
+            for (int j = 0; j < n; ++j)
+            {
+                c_i[j] += a_ip * b_p[j];
+            }
+        }
+    }
+}
+
+/*
+ * quantize_s8_body
+ *
+ * Rounds x / scale to the nearest int8 step, saturating at +-127 so that
+ * negation never overflows. Written as min, max and a truncating conversion
+ * so that the loop vectorizes.
+ */
+static inline __attribute__((always_inline)) void quantize_s8_body(int n, const float *x, float inverse_scale, int8_t *y)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        float q = x[i] * inverse_scale;
+        q += copysignf(0.5f, q);
+        q = (q < 127.0f) ? q : 127.0f;
+        q = (q > -127.0f) ? q : -127.0f;
+        y[i] = (int8_t)(int)q;
+    }
+}
+
+/*
+ * half_to_float, float_to_half
+ *
+ * IEEE binary16 conversions in integer arithmetic. Normal values are rebiased
+ * in place; subnormals go through a float add against a magic constant that
+ * lines their mantissa up with the binary16 one, which also rounds to nearest
+ * even. Values too large for binary16 become infinity and NaNs stay NaNs.
+ */
+static inline __attribute__((always_inline)) float half_to_float(uint16_t h)
+{
+    uint32_t bits = (uint32_t)(h & 0x7fff) << 13;
+    uint32_t exponent = bits & 0x0f800000u;
+    bits += (uint32_t)(127 - 15) << 23;
+    if (exponent == 0x0f800000u)
+    {
+        bits += (uint32_t)(128 - 16) << 23; // Infinity or NaN
+    }
+    else if (exponent == 0)
+    {
+        // Subnormal: renormalize by subtracting the implicit one.
+        float value, magic = 6.103515625e-05f; // 2^-14
+        bits += 1u << 23;
+        memcpy(&value, &bits, sizeof(value));
+        value -= magic;
+        memcpy(&bits, &value, sizeof(bits));
+    }
+    bits |= (uint32_t)(h & 0x8000) << 16;
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline __attribute__((always_inline)) uint16_t float_to_half(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint16_t h;
+    if (bits >= (uint32_t)(127 + 16) << 23)
+    {
+        h = (bits > 0x7f800000u) ? 0x7e00 : 0x7c00; // NaN or overflow
+    }
+    else if (bits < (uint32_t)(127 - 14) << 23)
+    {
+        // Below the smallest normal: the add shifts the mantissa into place.
+        const uint32_t magic_bits = (uint32_t)((127 - 15) + (23 - 10) + 1) << 23;
+        float value, magic;
+        memcpy(&value, &bits, sizeof(value));
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        value += magic;
+        memcpy(&bits, &value, sizeof(bits));
+        h = (uint16_t)(bits - magic_bits);
+    }
+    else
+    {
+        uint32_t odd = (bits >> 13) & 1;
+        bits += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+        h = (uint16_t)(bits >> 13);
+    }
+    return h | (uint16_t)(sign >> 16);
+}
+
+/*
+ * load_half_body, store_half_body
+ *
+ * Widen n 16-bit values to float and round n floats to 16 bits, in binary16
+ * (ELEMENT_FP16) or bfloat16 (ELEMENT_BF16). A bfloat16 is the top half of a
+ * float, so it widens with a shift and rounds to nearest even with an add.
+ */
+static inline __attribute__((always_inline)) void load_half_body(int type, int n, const uint16_t *x, float *y)
+{
+    if (type == ELEMENT_BF16)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t bits = (uint32_t)x[i] << 16;
+            memcpy(y + i, &bits, sizeof(float));
+        }
+    }
+    else
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            y[i] = half_to_float(x[i]);
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void store_half_body(int type, int n, const float *x, uint16_t *y)
+{
+    if (type == ELEMENT_BF16)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t bits;
+            memcpy(&bits, x + i, sizeof(bits));
+            uint32_t rounded = (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+            // A NaN must not round into infinity, so keep it quiet instead.
+            y[i] = ((bits & 0x7fffffffu) > 0x7f800000u) ? (uint16_t)((bits >> 16) | 0x40) : (uint16_t)rounded;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            y[i] = float_to_half(x[i]);
+        }
+    }
+}
+
+/*
+ * vector_activation_body
+ *
+ * Applies an activation in place to the m outputs of one sample. They form
+ * one row for the element-wise activations, which run along it with no bias,
+ * and one column for softmax.
+ */
+static inline __attribute__((always_inline)) void vector_activation_body(int activation, int m, float *y)
+{
+    if (activation == ACTIVATION_SOFTMAX)
+    {
+        softmax_body(m, 1, NULL, y, NULL, y, NULL, NULL);
+        return;
+    }
+    const float zero = 0.0f;
+    bias_activation_body(activation, 1, m, &zero, y, y, NULL);
+}
+
+/*
+ * gemv_body
+ *
+ * Single-sample layer: y = f(W x + bias), where W is m x k and stored as
+ * panels of GEMV_ROWS rows interleaved along k, so each step multiplies one
+ * input by a contiguous vector of weights and no horizontal sums are needed.
+ * Four partial sums per row hide the latency of the adds. Rows past m in the
+ * last panel are padding and are not stored. y must not alias x.
+ */
+static inline __attribute__((always_inline)) void gemv_body(int activation, int m, int k, const float *panels,
+                                                           const float *bias, const float *x, float *y)
+{
+    for (int panel = 0; panel < m; panel += GEMV_ROWS)
+    {
+        float acc[4][GEMV_ROWS] = {{0}};
+        int p = 0;
+        for (; p + 4 <= k; p += 4)
+        {
+            for (int u = 0; u < 4; ++u)
+            {
+                for (int i = 0; i < GEMV_ROWS; ++i)
+                {
+                    acc[u][i] += panels[(p + u) * GEMV_ROWS + i] * x[p + u];
+                }
+            }
+        }
+        for (; p < k; ++p)
+        {
+            for (int i = 0; i < GEMV_ROWS; ++i)
+            {
+                acc[0][i] += panels[p * GEMV_ROWS + i] * x[p];
+            }
+        }
+        int rows = (m - panel < GEMV_ROWS) ? m - panel : GEMV_ROWS;
+        for (int i = 0; i < rows; ++i)
+        {
+            y[panel + i] = (acc[0][i] + acc[1][i]) + (acc[2][i] + acc[3][i]) + bias[panel + i];
+        }
+        panels += (size_t)GEMV_ROWS * k;
+    }
+    vector_activation_body(activation, m, y);
+}
+
+/*
+ * momentum_body, adam_body
+ *
+ * Fused optimizer updates: one pass over a parameter tensor w, its gradient g
+ * and its optimizer state, with the scalars of the step in struct
+ * optimizer_step.
+ *
+ *     momentum: v = beta1 v + g
+ *               w = decay w - learning_rate v
+ *     adam:     m = beta1 m + (1 - beta1) g
+ *               v = beta2 v + (1 - beta2) g^2
+ *               w = decay w - learning_rate (correction1 m) / (sqrt(correction2 v) + epsilon)
+ *
+ * The vector kernels below evaluate the same expressions in the same order
+ * and fall back to these bodies for their tails.
+ */
+static inline __attribute__((always_inline)) void momentum_body(int n, const struct optimizer_step *step, const float *g,
+                                                               float *v, float *w)
+{
+    const float beta1 = step->beta1;
+    const float learning_rate = step->learning_rate;
+    const float decay = step->decay;
+    for (int i = 0; i < n; ++i)
+    {
+        v[i] = beta1 * v[i] + g[i];
+        w[i] = decay * w[i] - learning_rate * v[i];
+    }
+}
+
+static inline __attribute__((always_inline)) void adam_body(int n, const struct optimizer_step *step, const float *g,
+                                                           float *m, float *v, float *w)
+{
+    const float beta1 = step->beta1;
+    const float beta2 = step->beta2;
+    for (int i = 0; i < n; ++i)
+    {
+        float m_i = beta1 * m[i] + (1.0f - beta1) * g[i];
+        float v_i = beta2 * v[i] + (1.0f - beta2) * (g[i] * g[i]);
+        m[i] = m_i;
+        v[i] = v_i;
+        float update = step->learning_rate * (step->correction1 * m_i) / (sqrtf(step->correction2 * v_i) + step->epsilon);
+        w[i] = step->decay * w[i] - update;
+    }
+}
+
+/*
+ * Portable C kernels. The fixed-size loops are written so that the compiler
+ * can vectorize them for whatever baseline the build targets.
+ */
+#define SCALAR_MR 4
+#define SCALAR_NR 8
+
+static void gemm_micro_scalar(int kc, const float *a, const float *b, float *C, int ldc, int m, int n)
+{
+    float acc[SCALAR_MR][SCALAR_NR] = {{0}};
+    for (int k = 0; k < kc; ++k)
+    {
+        for (int i = 0; i < SCALAR_MR; ++i)
+        {
+            float a_ik = a[i];
+            for (int j = 0; j < SCALAR_NR; ++j)
+            {
+                acc[i][j] += a_ik * b[j];
+            }
+        }
+        a += SCALAR_MR;
+        b += SCALAR_NR;
+    }
+    store_tile(&acc[0][0], SCALAR_NR, C, ldc, m, n);
+}
+
+static void scale_scalar(int n, float *x, float c)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] *= c;
+    }
+}
+
+static void add_scalar(int n, float *x, const float *y)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] += y[i];
+    }
+}
+
+static void sub_scalar(int n, float *x, const float *y)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] -= y[i];
+    }
+}
+
+static void mult_scalar(int n, float *x, const float *y)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        x[i] *= y[i];
+    }
+}
+
+static void axpy_scalar(int n, float a, const float *x, float *y)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+static float sum_squares_scalar(int n, const float *x)
+{
+    float sum = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+static void bias_activation_generic(int activation, int rows, int cols, const float *bias,
+                                    const float *Z, float *A, float *D)
+{
+    bias_activation_body(activation, rows, cols, bias, Z, A, D);
+}
+
+static float softmax_generic(int rows, int cols, const float *bias, const float *Z, const float *Y, float *A, float *D,
+                             int *confusion)
+{
+    return softmax_body(rows, cols, bias, Z, Y, A, D, confusion);
+}
+
+static float squared_error_generic(int rows, int cols, const float *A, const float *Y, float *D, int *confusion)
+{
+    return squared_error_body(rows, cols, A, Y, D, confusion);
+}
+
+static void conv_taps_generic(int taps, int filters, int n, const float *w, const float *const *x, float *y, int ldy)
+{
+    conv_taps_body(taps, filters, n, w, x, y, ldy);
+}
+
+static void gemm_s8_generic(int m, int n, int k, const int8_t *a, const int8_t *b, int ldb, int32_t *C, int ldc)
+{
+    gemm_s8_body(m, n, k, a, b, ldb, C, ldc);
+}
+
+static void quantize_s8_generic(int n, const float *x, float inverse_scale, int8_t *y)
+{
+    quantize_s8_body(n, x, inverse_scale, y);
+}
+
+static void load_half_generic(int type, int n, const uint16_t *x, float *y)
+{
+    load_half_body(type, n, x, y);
+}
+
+static void store_half_generic(int type, int n, const float *x, uint16_t *y)
+{
+    store_half_body(type, n, x, y);
+}
+
+static void gemv_generic(int activation, int m, int k, const float *panels, const float *bias, const float *x, float *y)
+{
+    gemv_body(activation, m, k, panels, bias, x, y);
+}
+
+static void momentum_generic(int n, const struct optimizer_step *step, const float *g, float *v, float *w)
+{
+    momentum_body(n, step, g, v, w);
+}
+
+static void adam_generic(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w)
+{
+    adam_body(n, step, g, m, v, w);
+}
+
+static const struct matrix_kernels kernels_scalar = {
+    "scalar", SCALAR_MR, SCALAR_NR, gemm_micro_scalar,
+    scale_scalar, add_scalar, sub_scalar, mult_scalar, axpy_scalar, sum_squares_scalar,
+    bias_activation_generic, gemm_s8_generic, quantize_s8_generic,
+    load_half_generic, store_half_generic, gemv_generic,
+    momentum_generic, adam_generic, softmax_generic, squared_error_generic,
+    conv_taps_generic};
+
+#ifdef MATRIX_KERNELS_X86
+
+/*
+ * SSE2 kernels: 4 x 8 tile held in 8 xmm accumulators.
+ */
+#define SSE_MR 4
+#define SSE_NR 8
+
+__attribute__((target("sse2")))
+static void gemm_micro_sse(int kc, const float *a, const float *b, float *C, int ldc, int m, int n)
+{
+    __m128 c[SSE_MR][2];
+    for (int i = 0; i < SSE_MR; ++i)
+    {
+        c[i][0] = _mm_setzero_ps();
+        c[i][1] = _mm_setzero_ps();
+    }
+    for (int k = 0; k < kc; ++k)
+    {
+        __m128 b0 = _mm_loadu_ps(b);
+        __m128 b1 = _mm_loadu_ps(b + 4);
+        for (int i = 0; i < SSE_MR; ++i)
+        {
+            __m128 a_ik = _mm_set1_ps(a[i]);
+            c[i][0] = _mm_add_ps(c[i][0], _mm_mul_ps(a_ik, b0));
+            c[i][1] = _mm_add_ps(c[i][1], _mm_mul_ps(a_ik, b1));
+        }
+        a += SSE_MR;
+        b += SSE_NR;
+    }
+    if (m == SSE_MR && n == SSE_NR)
+    {
+        for (int i = 0; i < SSE_MR; ++i)
+        {
+            float *row = C + i * ldc;
+            _mm_storeu_ps(row, _mm_add_ps(_mm_loadu_ps(row), c[i][0]));
+            _mm_storeu_ps(row + 4, _mm_add_ps(_mm_loadu_ps(row + 4), c[i][1]));
+        }
+        return;
+    }
+    float tile[SSE_MR * SSE_NR];
+    for (int i = 0; i < SSE_MR; ++i)
+    {
+        _mm_storeu_ps(tile + i * SSE_NR, c[i][0]);
+        _mm_storeu_ps(tile + i * SSE_NR + 4, c[i][1]);
+    }
+    store_tile(tile, SSE_NR, C, ldc, m, n);
+}
+
+__attribute__((target("sse2")))
+static void scale_sse(int n, float *x, float c)
+{
+    __m128 vc = _mm_set1_ps(c);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), vc));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= c;
+    }
+}
+
+__attribute__((target("sse2")))
+static void add_sse(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] += y[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void sub_sse(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] -= y[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void mult_sse(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= y[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void axpy_sse(int n, float a, const float *x, float *y)
+{
+    __m128 va = _mm_set1_ps(a);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+    }
+    for (; i < n; ++i)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static float sum_squares_sse(int n, const float *x)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128 x0 = _mm_loadu_ps(x + i);
+        __m128 x1 = _mm_loadu_ps(x + i + 4);
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(x0, x0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(x1, x1));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    float sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; ++i)
+    {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static void momentum_sse(int n, const struct optimizer_step *step, const float *g, float *v, float *w)
+{
+    const __m128 beta1 = _mm_set1_ps(step->beta1);
+    const __m128 learning_rate = _mm_set1_ps(step->learning_rate);
+    const __m128 decay = _mm_set1_ps(step->decay);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v_i = _mm_add_ps(_mm_mul_ps(beta1, _mm_loadu_ps(v + i)), _mm_loadu_ps(g + i));
+        _mm_storeu_ps(v + i, v_i);
+        _mm_storeu_ps(w + i, _mm_sub_ps(_mm_mul_ps(decay, _mm_loadu_ps(w + i)), _mm_mul_ps(learning_rate, v_i)));
+    }
+    momentum_body(n - i, step, g + i, v + i, w + i);
+}
+
+__attribute__((target("sse2")))
+static void adam_sse(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w)
+{
+    const __m128 beta1 = _mm_set1_ps(step->beta1);
+    const __m128 beta2 = _mm_set1_ps(step->beta2);
+    const __m128 one_minus_beta1 = _mm_set1_ps(1.0f - step->beta1);
+    const __m128 one_minus_beta2 = _mm_set1_ps(1.0f - step->beta2);
+    const __m128 learning_rate = _mm_set1_ps(step->learning_rate);
+    const __m128 correction1 = _mm_set1_ps(step->correction1);
+    const __m128 correction2 = _mm_set1_ps(step->correction2);
+    const __m128 epsilon = _mm_set1_ps(step->epsilon);
+    const __m128 decay = _mm_set1_ps(step->decay);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 g_i = _mm_loadu_ps(g + i);
+        __m128 m_i = _mm_add_ps(_mm_mul_ps(beta1, _mm_loadu_ps(m + i)), _mm_mul_ps(one_minus_beta1, g_i));
+        __m128 v_i = _mm_add_ps(_mm_mul_ps(beta2, _mm_loadu_ps(v + i)), _mm_mul_ps(one_minus_beta2, _mm_mul_ps(g_i, g_i)));
+        _mm_storeu_ps(m + i, m_i);
+        _mm_storeu_ps(v + i, v_i);
+        __m128 denominator = _mm_add_ps(_mm_sqrt_ps(_mm_mul_ps(correction2, v_i)), epsilon);
+        __m128 update = _mm_div_ps(_mm_mul_ps(learning_rate, _mm_mul_ps(correction1, m_i)), denominator);
+        _mm_storeu_ps(w + i, _mm_sub_ps(_mm_mul_ps(decay, _mm_loadu_ps(w + i)), update));
+    }
+    adam_body(n - i, step, g + i, m + i, v + i, w + i);
+}
+
+static const struct matrix_kernels kernels_sse = {
+    "sse", SSE_MR, SSE_NR, gemm_micro_sse,
+    scale_sse, add_sse, sub_sse, mult_sse, axpy_sse, sum_squares_sse,
+    bias_activation_generic, gemm_s8_generic, quantize_s8_generic,
+    load_half_generic, store_half_generic, gemv_generic,
+    momentum_sse, adam_sse, softmax_generic, squared_error_generic,
+    conv_taps_generic};
+
+/*
+ * AVX2 kernels: 6 x 16 tile held in 12 ymm accumulators, updated with FMA.
+ */
+#define AVX2_MR 6
+#define AVX2_NR 16
+
+__attribute__((target("avx2,fma")))
+static void gemm_micro_avx2(int kc, const float *a, const float *b, float *C, int ldc, int m, int n)
+{
+    __m256 c[AVX2_MR][2];
+    for (int i = 0; i < AVX2_MR; ++i)
+    {
+        c[i][0] = _mm256_setzero_ps();
+        c[i][1] = _mm256_setzero_ps();
+    }
+    for (int k = 0; k < kc; ++k)
+    {
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        for (int i = 0; i < AVX2_MR; ++i)
+        {
+            __m256 a_ik = _mm256_broadcast_ss(a + i);
+            c[i][0] = _mm256_fmadd_ps(a_ik, b0, c[i][0]);
+            c[i][1] = _mm256_fmadd_ps(a_ik, b1, c[i][1]);
+        }
+        a += AVX2_MR;
+        b += AVX2_NR;
+    }
+    if (m == AVX2_MR && n == AVX2_NR)
+    {
+        for (int i = 0; i < AVX2_MR; ++i)
+        {
+            float *row = C + i * ldc;
+            _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), c[i][0]));
+            _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), c[i][1]));
+        }
+        return;
+    }
+    float tile[AVX2_MR * AVX2_NR];
+    for (int i = 0; i < AVX2_MR; ++i)
+    {
+        _mm256_storeu_ps(tile + i * AVX2_NR, c[i][0]);
+        _mm256_storeu_ps(tile + i * AVX2_NR + 8, c[i][1]);
+    }
+    store_tile(tile, AVX2_NR, C, ldc, m, n);
+}
+
+__attribute__((target("avx2,fma")))
+static void scale_avx2(int n, float *x, float c)
+{
+    __m256 vc = _mm256_set1_ps(c);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), vc));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= c;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void add_avx2(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] += y[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void sub_avx2(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(x + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] -= y[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void mult_avx2(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= y[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(int n, float a, const float *x, float *y)
+{
+    __m256 va = _mm256_set1_ps(a);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static float sum_squares_avx2(int n, const float *x)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256 x0 = _mm256_loadu_ps(x + i);
+        __m256 x1 = _mm256_loadu_ps(x + i + 8);
+        acc0 = _mm256_fmadd_ps(x0, x0, acc0);
+        acc1 = _mm256_fmadd_ps(x1, x1, acc1);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    float sum = 0;
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        sum += lanes[lane];
+    }
+    for (; i < n; ++i)
+    {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void bias_activation_avx2(int activation, int rows, int cols, const float *bias,
+                                 const float *Z, float *A, float *D)
+{
+    bias_activation_body(activation, rows, cols, bias, Z, A, D);
+}
+
+__attribute__((target("avx2,fma")))
+static float softmax_avx2(int rows, int cols, const float *bias, const float *Z, const float *Y, float *A, float *D,
+                          int *confusion)
+{
+    return softmax_body(rows, cols, bias, Z, Y, A, D, confusion);
+}
+
+__attribute__((target("avx2,fma")))
+static float squared_error_avx2(int rows, int cols, const float *A, const float *Y, float *D, int *confusion)
+{
+    return squared_error_body(rows, cols, A, Y, D, confusion);
+}
+
+/*
+ * conv_rows_avx2
+ *
+ * One tile of filters of conv_taps_avx2, for a filter count known after
+ * inlining: whole strips of 16 samples are accumulated in two ymm per
+ * filter, each tap loading two vectors of input and meeting them with one
+ * broadcast weight per filter. The samples past the last whole strip go
+ * through conv_tile_body.
+ */
+__attribute__((target("avx2,fma")))
+static inline __attribute__((always_inline)) void conv_rows_avx2(int taps, int filters, int n, const float *w,
+                                                                const float *const *x, float *y, int ldy)
+{
+    int full_n = n / CONV_STRIP * CONV_STRIP;
+    for (int first = 0; first < full_n; first += CONV_STRIP)
+    {
+        __m256 acc[CONV_FILTERS][2];
+        for (int i = 0; i < filters; ++i)
+        {
+            acc[i][0] = _mm256_setzero_ps();
+            acc[i][1] = _mm256_setzero_ps();
+        }
+        for (int t = 0; t < taps; ++t)
+        {
+            if (x[t] == NULL)
+            {
+                continue;
+            }
+            __m256 x0 = _mm256_loadu_ps(x[t] + first);
+            __m256 x1 = _mm256_loadu_ps(x[t] + first + 8);
+            for (int i = 0; i < filters; ++i)
+            {
+                __m256 w_it = _mm256_broadcast_ss(w + i * taps + t);
+                acc[i][0] = _mm256_fmadd_ps(w_it, x0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(w_it, x1, acc[i][1]);
+            }
+        }
+        for (int i = 0; i < filters; ++i)
+        {
+            _mm256_storeu_ps(y + (size_t)i * ldy + first, acc[i][0]);
+            _mm256_storeu_ps(y + (size_t)i * ldy + first + 8, acc[i][1]);
+        }
+    }
+    if (full_n < n)
+    {
+        conv_tile_body(taps, w, x, full_n, filters, n - full_n, y, ldy);
+    }
+}
+
+// conv_taps_body on register tiles of CONV_FILTERS filters by 16 samples.
+__attribute__((target("avx2,fma")))
+static void conv_taps_avx2(int taps, int filters, int n, const float *w, const float *const *x, float *y, int ldy)
+{
+    for (int f = 0; f < filters; f += CONV_FILTERS)
+    {
+        const float *w_f = w + (size_t)f * taps;
+        float *y_f = y + (size_t)f * ldy;
+        switch (filters - f)
+        {
+        case 1:
+            conv_rows_avx2(taps, 1, n, w_f, x, y_f, ldy);
+            break;
+        case 2:
+            conv_rows_avx2(taps, 2, n, w_f, x, y_f, ldy);
+            break;
+        case 3:
+            conv_rows_avx2(taps, 3, n, w_f, x, y_f, ldy);
+            break;
+        default:
+            conv_rows_avx2(taps, CONV_FILTERS, n, w_f, x, y_f, ldy);
+            break;
+        }
+    }
+}
+
+/*
+ * gemv_avx2
+ *
+ * gemv_body with one ymm per panel: each input is broadcast and multiplied by
+ * the eight weights it meets, in four independent FMA chains.
+ */
+__attribute__((target("avx2,fma")))
+static void gemv_avx2(int activation, int m, int k, const float *panels, const float *bias, const float *x, float *y)
+{
+    for (int panel = 0; panel < m; panel += GEMV_ROWS)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        int p = 0;
+        for (; p + 4 <= k; p += 4)
+        {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(panels + p * GEMV_ROWS), _mm256_broadcast_ss(x + p), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(panels + (p + 1) * GEMV_ROWS), _mm256_broadcast_ss(x + p + 1), acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(panels + (p + 2) * GEMV_ROWS), _mm256_broadcast_ss(x + p + 2), acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(panels + (p + 3) * GEMV_ROWS), _mm256_broadcast_ss(x + p + 3), acc3);
+        }
+        for (; p < k; ++p)
+        {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(panels + p * GEMV_ROWS), _mm256_broadcast_ss(x + p), acc0);
+        }
+        float sums[GEMV_ROWS];
+        _mm256_storeu_ps(sums, _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+        int rows = (m - panel < GEMV_ROWS) ? m - panel : GEMV_ROWS;
+        for (int i = 0; i < rows; ++i)
+        {
+            y[panel + i] = sums[i] + bias[panel + i];
+        }
+        panels += (size_t)GEMV_ROWS * k;
+    }
+    vector_activation_body(activation, m, y);
+}
+
+/*
+ * gemm_s8_avx2
+ *
+ * Register tile of 4 rows of C by 16 columns. Two rows of B are sign-extended
+ * to int16 and interleaved so that vpmaddwd multiplies each pair of k values
+ * by a pair of A values and sums them into int32 lanes, which is exact for
+ * int8 inputs. The A pairs of a row tile are packed once per block of k so
+ * the inner loop broadcasts them straight from memory. The interleave works
+ * within 128-bit halves, so the accumulators are put back in column order
+ * when stored. Ragged columns go through a zero-padded copy of B, and ragged
+ * rows repeat row 0 and discard the extra sums.
+ */
+#define S8_KC 512
+
+__attribute__((target("avx2,fma")))
+static void gemm_s8_avx2(int m, int n, int k, const int8_t *a, const int8_t *b, int ldb, int32_t *C, int ldc)
+{
+    int32_t pairs[S8_KC / 2][4];
+    int8_t edge[2][16];
+    for (int i = 0; i < m; i += 4)
+    {
+        int rows = (m - i < 4) ? m - i : 4;
+        for (int pc = 0; pc < k; pc += S8_KC)
+        {
+            int kc = (k - pc < S8_KC) ? k - pc : S8_KC;
+            for (int p = 0; p < kc; p += 2)
+            {
+                for (int r = 0; r < 4; ++r)
+                {
+                    const int8_t *a_r = a + (size_t)(i + ((r < rows) ? r : 0)) * k + pc;
+                    int16_t w1 = (p + 1 < kc) ? a_r[p + 1] : 0;
+                    // Packed unsigned, since shifting a negative int is undefined.
+                    pairs[p / 2][r] = (int32_t)((uint32_t)(uint16_t)a_r[p] | ((uint32_t)(uint16_t)w1 << 16));
+                }
+            }
+            for (int j = 0; j < n; j += 16)
+            {
+                int cols = (n - j < 16) ? n - j : 16;
+                __m256i acc[4][2];
+                for (int r = 0; r < 4; ++r)
+                {
+                    acc[r][0] = _mm256_setzero_si256();
+                    acc[r][1] = _mm256_setzero_si256();
+                }
+                for (int p = 0; p < kc; p += 2)
+                {
+                    const int8_t *b0 = b + (size_t)(pc + p) * ldb + j;
+                    const int8_t *b1 = b0 + ldb;
+                    if (cols < 16 || p + 1 == kc)
+                    {
+                        memset(edge, 0, sizeof(edge));
+                        memcpy(edge[0], b0, cols);
+                        if (p + 1 < kc)
+                        {
+                            memcpy(edge[1], b1, cols);
+                        }
+                        b0 = edge[0];
+                        b1 = edge[1];
+                    }
+                    __m256i x0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)b0));
+                    __m256i x1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)b1));
+                    __m256i lo = _mm256_unpacklo_epi16(x0, x1);
+                    __m256i hi = _mm256_unpackhi_epi16(x0, x1);
+                    for (int r = 0; r < 4; ++r)
+                    {
+                        __m256i w = _mm256_set1_epi32(pairs[p / 2][r]);
+                        acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(lo, w));
+                        acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(hi, w));
+                    }
+                }
+                for (int r = 0; r < rows; ++r)
+                {
+                    int32_t out[16];
+                    int32_t *c = C + (size_t)(i + r) * ldc + j;
+                    _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(acc[r][0], acc[r][1], 0x20));
+                    _mm256_storeu_si256((__m256i *)(out + 8), _mm256_permute2x128_si256(acc[r][0], acc[r][1], 0x31));
+                    for (int col = 0; col < cols; ++col)
+                    {
+                        c[col] = (pc == 0) ? out[col] : c[col] + out[col];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * quantize_s8_avx2
+ *
+ * Clamps 32 floats per step to +-127, converts them with round-to-nearest and
+ * narrows with saturating packs, which interleave 128-bit halves and are
+ * undone by one permute.
+ */
+__attribute__((target("avx2,fma")))
+static void quantize_s8_avx2(int n, const float *x, float inverse_scale, int8_t *y)
+{
+    const __m256 s = _mm256_set1_ps(inverse_scale);
+    const __m256 max = _mm256_set1_ps(127.0f);
+    const __m256 min = _mm256_set1_ps(-127.0f);
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i q[4];
+        for (int v = 0; v < 4; ++v)
+        {
+            __m256 scaled = _mm256_mul_ps(_mm256_loadu_ps(x + i + 8 * v), s);
+            q[v] = _mm256_cvtps_epi32(_mm256_max_ps(_mm256_min_ps(scaled, max), min));
+        }
+        __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)(y + i), packed);
+    }
+    quantize_s8_body(n - i, x + i, inverse_scale, y + i);
+}
+
+/*
+ * load_half_avx2, store_half_avx2
+ *
+ * binary16 uses the F16C conversions, which every AVX2 CPU has. bfloat16 is a
+ * shift when widening and the round-to-nearest-even add when narrowing, with
+ * NaNs kept quiet; the 32-bit results are packed per 128-bit lane and the two
+ * halves joined by one permute.
+ */
+__attribute__((target("avx2,fma,f16c")))
+static void load_half_avx2(int type, int n, const uint16_t *x, float *y)
+{
+    int i = 0;
+    if (type == ELEMENT_BF16)
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(x + i)));
+            _mm256_storeu_ps(y + i, _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+        }
+    }
+    else
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i))));
+        }
+    }
+    load_half_body(type, n - i, x + i, y + i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void store_half_avx2(int type, int n, const float *x, uint16_t *y)
+{
+    int i = 0;
+    if (type == ELEMENT_BF16)
+    {
+        const __m256i bias = _mm256_set1_epi32(0x7fff);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i quiet = _mm256_set1_epi32(0x40);
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 v = _mm256_loadu_ps(x + i);
+            __m256i bits = _mm256_castps_si256(v);
+            __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+            __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(bias, odd)), 16);
+            __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), quiet);
+            rounded = _mm256_blendv_epi8(rounded, nan, _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(rounded, rounded), 0x08);
+            _mm_storeu_si128((__m128i *)(y + i), _mm256_castsi256_si128(packed));
+        }
+    }
+    else
+    {
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm_storeu_si128((__m128i *)(y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+    }
+    store_half_body(type, n - i, x + i, y + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void momentum_avx2(int n, const struct optimizer_step *step, const float *g, float *v, float *w)
+{
+    const __m256 beta1 = _mm256_set1_ps(step->beta1);
+    const __m256 learning_rate = _mm256_set1_ps(step->learning_rate);
+    const __m256 decay = _mm256_set1_ps(step->decay);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 v_i = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(v + i), _mm256_loadu_ps(g + i));
+        _mm256_storeu_ps(v + i, v_i);
+        _mm256_storeu_ps(w + i, _mm256_fmsub_ps(decay, _mm256_loadu_ps(w + i), _mm256_mul_ps(learning_rate, v_i)));
+    }
+    momentum_body(n - i, step, g + i, v + i, w + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void adam_avx2(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w)
+{
+    const __m256 beta1 = _mm256_set1_ps(step->beta1);
+    const __m256 beta2 = _mm256_set1_ps(step->beta2);
+    const __m256 one_minus_beta1 = _mm256_set1_ps(1.0f - step->beta1);
+    const __m256 one_minus_beta2 = _mm256_set1_ps(1.0f - step->beta2);
+    const __m256 learning_rate = _mm256_set1_ps(step->learning_rate);
+    const __m256 correction1 = _mm256_set1_ps(step->correction1);
+    const __m256 correction2 = _mm256_set1_ps(step->correction2);
+    const __m256 epsilon = _mm256_set1_ps(step->epsilon);
+    const __m256 decay = _mm256_set1_ps(step->decay);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 g_i = _mm256_loadu_ps(g + i);
+        __m256 m_i = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(m + i), _mm256_mul_ps(one_minus_beta1, g_i));
+        __m256 v_i = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(v + i), _mm256_mul_ps(one_minus_beta2, _mm256_mul_ps(g_i, g_i)));
+        _mm256_storeu_ps(m + i, m_i);
+        _mm256_storeu_ps(v + i, v_i);
+        __m256 denominator = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(correction2, v_i)), epsilon);
+        __m256 update = _mm256_div_ps(_mm256_mul_ps(learning_rate, _mm256_mul_ps(correction1, m_i)), denominator);
+        _mm256_storeu_ps(w + i, _mm256_fmsub_ps(decay, _mm256_loadu_ps(w + i), update));
+    }
+    adam_body(n - i, step, g + i, m + i, v + i, w + i);
+}
+
+static const struct matrix_kernels kernels_avx2 = {
+    "avx2", AVX2_MR, AVX2_NR, gemm_micro_avx2,
+    scale_avx2, add_avx2, sub_avx2, mult_avx2, axpy_avx2, sum_squares_avx2,
+    bias_activation_avx2, gemm_s8_avx2, quantize_s8_avx2,
+    load_half_avx2, store_half_avx2, gemv_avx2,
+    momentum_avx2, adam_avx2, softmax_avx2, squared_error_avx2,
+    conv_taps_avx2};
+
+/*
+ * AVX-512 kernels: 8 x 32 tile held in 16 zmm accumulators. The element-wise
+ * loops use masked loads and stores for the tail instead of a scalar loop.
+ * 16-bit integer lanes need AVX-512BW, so the int8 and half-precision
+ * kernels reuse AVX2, as does the GEMV, whose panels are eight floats wide.
+ */
+#define AVX512_MR 8
+#define AVX512_NR 32
+
+__attribute__((target("avx512f")))
+static void gemm_micro_avx512(int kc, const float *a, const float *b, float *C, int ldc, int m, int n)
+{
+    __m512 c[AVX512_MR][2];
+    for (int i = 0; i < AVX512_MR; ++i)
+    {
+        c[i][0] = _mm512_setzero_ps();
+        c[i][1] = _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; ++k)
+    {
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        for (int i = 0; i < AVX512_MR; ++i)
+        {
+            __m512 a_ik = _mm512_set1_ps(a[i]);
+            c[i][0] = _mm512_fmadd_ps(a_ik, b0, c[i][0]);
+            c[i][1] = _mm512_fmadd_ps(a_ik, b1, c[i][1]);
+        }
+        a += AVX512_MR;
+        b += AVX512_NR;
+    }
+    if (m == AVX512_MR && n == AVX512_NR)
+    {
+        for (int i = 0; i < AVX512_MR; ++i)
+        {
+            float *row = C + i * ldc;
+            _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), c[i][0]));
+            _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), c[i][1]));
+        }
+        return;
+    }
+    float tile[AVX512_MR * AVX512_NR];
+    for (int i = 0; i < AVX512_MR; ++i)
+    {
+        _mm512_storeu_ps(tile + i * AVX512_NR, c[i][0]);
+        _mm512_storeu_ps(tile + i * AVX512_NR + 16, c[i][1]);
+    }
+    store_tile(tile, AVX512_NR, C, ldc, m, n);
+}
+
+__attribute__((target("avx512f")))
+static void scale_avx512(int n, float *x, float c)
+{
+    __m512 vc = _mm512_set1_ps(c);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), vc));
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, tail, _mm512_mul_ps(_mm512_maskz_loadu_ps(tail, x + i), vc));
+}
+
+__attribute__((target("avx512f")))
+static void add_avx512(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, _mm512_add_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, tail, _mm512_add_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i)));
+}
+
+__attribute__((target("avx512f")))
+static void sub_avx512(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, tail, _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i)));
+}
+
+__attribute__((target("avx512f")))
+static void mult_avx512(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, tail, _mm512_mul_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i)));
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(int n, float a, const float *x, float *y)
+{
+    __m512 va = _mm512_set1_ps(a);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(y + i, tail, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i)));
+}
+
+__attribute__((target("avx512f")))
+static float sum_squares_avx512(int n, const float *x)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m512 x0 = _mm512_loadu_ps(x + i);
+        __m512 x1 = _mm512_loadu_ps(x + i + 16);
+        acc0 = _mm512_fmadd_ps(x0, x0, acc0);
+        acc1 = _mm512_fmadd_ps(x1, x1, acc1);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512 x0 = _mm512_loadu_ps(x + i);
+        acc0 = _mm512_fmadd_ps(x0, x0, acc0);
+    }
+    __mmask16 tail = (__mmask16)((1u << (n - i)) - 1);
+    __m512 x0 = _mm512_maskz_loadu_ps(tail, x + i);
+    acc1 = _mm512_fmadd_ps(x0, x0, acc1);
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static void bias_activation_avx512(int activation, int rows, int cols, const float *bias,
+                                   const float *Z, float *A, float *D)
+{
+    bias_activation_body(activation, rows, cols, bias, Z, A, D);
+}
+
+__attribute__((target("avx512f")))
+static float softmax_avx512(int rows, int cols, const float *bias, const float *Z, const float *Y, float *A, float *D,
+                            int *confusion)
+{
+    return softmax_body(rows, cols, bias, Z, Y, A, D, confusion);
+}
+
+__attribute__((target("avx512f")))
+static float squared_error_avx512(int rows, int cols, const float *A, const float *Y, float *D, int *confusion)
+{
+    return squared_error_body(rows, cols, A, Y, D, confusion);
+}
+
+/*
+ * conv_rows_avx512
+ *
+ * One tile of filters of conv_taps_avx512, for a filter count known after
+ * inlining, on strips of 16 samples in one zmm per filter; the last strip is
+ * masked.
+ */
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void conv_rows_avx512(int taps, int filters, int n, const float *w,
+                                                                  const float *const *x, float *y, int ldy)
+{
+    for (int first = 0; first < n; first += 16)
+    {
+        __mmask16 mask = (n - first >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (n - first)) - 1);
+        __m512 acc[CONV_FILTERS];
+        for (int i = 0; i < filters; ++i)
+        {
+            acc[i] = _mm512_setzero_ps();
+        }
+        for (int t = 0; t < taps; ++t)
+        {
+            if (x[t] == NULL)
+            {
+                continue;
+            }
+            __m512 x_t = _mm512_maskz_loadu_ps(mask, x[t] + first);
+            for (int i = 0; i < filters; ++i)
+            {
+                acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(w[i * taps + t]), x_t, acc[i]);
+            }
+        }
+        for (int i = 0; i < filters; ++i)
+        {
+            _mm512_mask_storeu_ps(y + (size_t)i * ldy + first, mask, acc[i]);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void conv_taps_avx512(int taps, int filters, int n, const float *w, const float *const *x, float *y, int ldy)
+{
+    for (int f = 0; f < filters; f += CONV_FILTERS)
+    {
+        const float *w_f = w + (size_t)f * taps;
+        float *y_f = y + (size_t)f * ldy;
+        switch (filters - f)
+        {
+        case 1:
+            conv_rows_avx512(taps, 1, n, w_f, x, y_f, ldy);
+            break;
+        case 2:
+            conv_rows_avx512(taps, 2, n, w_f, x, y_f, ldy);
+            break;
+        case 3:
+            conv_rows_avx512(taps, 3, n, w_f, x, y_f, ldy);
+            break;
+        default:
+            conv_rows_avx512(taps, CONV_FILTERS, n, w_f, x, y_f, ldy);
+            break;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void momentum_avx512(int n, const struct optimizer_step *step, const float *g, float *v, float *w)
+{
+    const __m512 beta1 = _mm512_set1_ps(step->beta1);
+    const __m512 learning_rate = _mm512_set1_ps(step->learning_rate);
+    const __m512 decay = _mm512_set1_ps(step->decay);
+    for (int i = 0; i < n; i += 16)
+    {
+        __mmask16 mask = (n - i >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 v_i = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, v + i), _mm512_maskz_loadu_ps(mask, g + i));
+        _mm512_mask_storeu_ps(v + i, mask, v_i);
+        __m512 w_i = _mm512_fmsub_ps(decay, _mm512_maskz_loadu_ps(mask, w + i), _mm512_mul_ps(learning_rate, v_i));
+        _mm512_mask_storeu_ps(w + i, mask, w_i);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void adam_avx512(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w)
+{
+    const __m512 beta1 = _mm512_set1_ps(step->beta1);
+    const __m512 beta2 = _mm512_set1_ps(step->beta2);
+    const __m512 one_minus_beta1 = _mm512_set1_ps(1.0f - step->beta1);
+    const __m512 one_minus_beta2 = _mm512_set1_ps(1.0f - step->beta2);
+    const __m512 learning_rate = _mm512_set1_ps(step->learning_rate);
+    const __m512 correction1 = _mm512_set1_ps(step->correction1);
+    const __m512 correction2 = _mm512_set1_ps(step->correction2);
+    const __m512 epsilon = _mm512_set1_ps(step->epsilon);
+    const __m512 decay = _mm512_set1_ps(step->decay);
+    for (int i = 0; i < n; i += 16)
+    {
+        __mmask16 mask = (n - i >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 g_i = _mm512_maskz_loadu_ps(mask, g + i);
+        __m512 m_i = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, m + i), _mm512_mul_ps(one_minus_beta1, g_i));
+        __m512 v_i = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(mask, v + i),
+                                     _mm512_mul_ps(one_minus_beta2, _mm512_mul_ps(g_i, g_i)));
+        _mm512_mask_storeu_ps(m + i, mask, m_i);
+        _mm512_mask_storeu_ps(v + i, mask, v_i);
+        __m512 denominator = _mm512_add_ps(_mm512_sqrt_ps(_mm512_mul_ps(correction2, v_i)), epsilon);
+        __m512 update = _mm512_div_ps(_mm512_mul_ps(learning_rate, _mm512_mul_ps(correction1, m_i)), denominator);
+        _mm512_mask_storeu_ps(w + i, mask, _mm512_fmsub_ps(decay, _mm512_maskz_loadu_ps(mask, w + i), update));
+    }
+}
+
+// The slots without an avx512 version take the avx2 kernels, so
+// isa_supported also requires avx2 and fma for this table.
+static const struct matrix_kernels kernels_avx512 = {
+    "avx512", AVX512_MR, AVX512_NR, gemm_micro_avx512,
+    scale_avx512, add_avx512, sub_avx512, mult_avx512, axpy_avx512, sum_squares_avx512,
+    bias_activation_avx512, gemm_s8_avx2, quantize_s8_avx2,
+    load_half_avx2, store_half_avx2, gemv_avx2,
+    momentum_avx512, adam_avx512, softmax_avx512, squared_error_avx512,
+    conv_taps_avx512};
+
+#endif // MATRIX_KERNELS_X86
+
+#ifdef MATRIX_KERNELS_NEON
+
+/*
+ * NEON kernels: 8 x 8 tile held in 16 q-register accumulators. AArch64 has a
+ * fused multiply-add; 32-bit ARM falls back to multiply-accumulate.
+ */
+#define NEON_MR 8
+#define NEON_NR 8
+
+#ifdef __aarch64__
+#define NEON_FMA_N(acc, b, a) vfmaq_n_f32(acc, b, a)
+#define NEON_FMA(acc, b, a) vfmaq_f32(acc, b, a)
+#else
+#define NEON_FMA_N(acc, b, a) vmlaq_n_f32(acc, b, a)
+#define NEON_FMA(acc, b, a) vmlaq_f32(acc, b, a)
+#endif
+
+static void gemm_micro_neon(int kc, const float *a, const float *b, float *C, int ldc, int m, int n)
+{
+    float32x4_t c[NEON_MR][2];
+    for (int i = 0; i < NEON_MR; ++i)
+    {
+        c[i][0] = vdupq_n_f32(0.0f);
+        c[i][1] = vdupq_n_f32(0.0f);
+    }
+    for (int k = 0; k < kc; ++k)
+    {
+        float32x4_t b0 = vld1q_f32(b);
+        float32x4_t b1 = vld1q_f32(b + 4);
+        for (int i = 0; i < NEON_MR; ++i)
+        {
+            c[i][0] = NEON_FMA_N(c[i][0], b0, a[i]);
+            c[i][1] = NEON_FMA_N(c[i][1], b1, a[i]);
+        }
+        a += NEON_MR;
+        b += NEON_NR;
+    }
+    if (m == NEON_MR && n == NEON_NR)
+    {
+        for (int i = 0; i < NEON_MR; ++i)
+        {
+            float *row = C + i * ldc;
+            vst1q_f32(row, vaddq_f32(vld1q_f32(row), c[i][0]));
+            vst1q_f32(row + 4, vaddq_f32(vld1q_f32(row + 4), c[i][1]));
+        }
+        return;
+    }
+    float tile[NEON_MR * NEON_NR];
+    for (int i = 0; i < NEON_MR; ++i)
+    {
+        vst1q_f32(tile + i * NEON_NR, c[i][0]);
+        vst1q_f32(tile + i * NEON_NR + 4, c[i][1]);
+    }
+    store_tile(tile, NEON_NR, C, ldc, m, n);
+}
+
+static void scale_neon(int n, float *x, float c)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(x + i, vmulq_n_f32(vld1q_f32(x + i), c));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= c;
+    }
+}
+
+static void add_neon(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(x + i, vaddq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] += y[i];
+    }
+}
+
+static void sub_neon(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(x + i, vsubq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] -= y[i];
+    }
+}
+
+static void mult_neon(int n, float *x, const float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+    }
+    for (; i < n; ++i)
+    {
+        x[i] *= y[i];
+    }
+}
+
+static void axpy_neon(int n, float a, const float *x, float *y)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        vst1q_f32(y + i, NEON_FMA_N(vld1q_f32(y + i), vld1q_f32(x + i), a));
+    }
+    for (; i < n; ++i)
+    {
+        y[i] += a * x[i];
+    }
+}
+
+static float sum_squares_neon(int n, const float *x)
+{
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        float32x4_t x0 = vld1q_f32(x + i);
+        float32x4_t x1 = vld1q_f32(x + i + 4);
+        acc0 = NEON_FMA(acc0, x0, x0);
+        acc1 = NEON_FMA(acc1, x1, x1);
+    }
+    float lanes[4];
+    vst1q_f32(lanes, vaddq_f32(acc0, acc1));
+    float sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; ++i)
+    {
+        sum += x[i] * x[i];
+    }
+    return sum;
+}
+
+static void momentum_neon(int n, const struct optimizer_step *step, const float *g, float *v, float *w)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t v_i = NEON_FMA_N(vld1q_f32(g + i), vld1q_f32(v + i), step->beta1);
+        vst1q_f32(v + i, v_i);
+        vst1q_f32(w + i, vsubq_f32(vmulq_n_f32(vld1q_f32(w + i), step->decay), vmulq_n_f32(v_i, step->learning_rate)));
+    }
+    momentum_body(n - i, step, g + i, v + i, w + i);
+}
+
+#ifdef __aarch64__
+static void adam_neon(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w)
+{
+    const float32x4_t epsilon = vdupq_n_f32(step->epsilon);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t g_i = vld1q_f32(g + i);
+        float32x4_t m_i = NEON_FMA_N(vmulq_n_f32(g_i, 1.0f - step->beta1), vld1q_f32(m + i), step->beta1);
+        float32x4_t v_i = NEON_FMA_N(vmulq_n_f32(vmulq_f32(g_i, g_i), 1.0f - step->beta2), vld1q_f32(v + i), step->beta2);
+        vst1q_f32(m + i, m_i);
+        vst1q_f32(v + i, v_i);
+        float32x4_t denominator = vaddq_f32(vsqrtq_f32(vmulq_n_f32(v_i, step->correction2)), epsilon);
+        float32x4_t update = vdivq_f32(vmulq_n_f32(vmulq_n_f32(m_i, step->correction1), step->learning_rate), denominator);
+        vst1q_f32(w + i, vsubq_f32(vmulq_n_f32(vld1q_f32(w + i), step->decay), update));
+    }
+    adam_body(n - i, step, g + i, m + i, v + i, w + i);
+}
+#else
+// 32-bit NEON has no vector square root or division.
+#define adam_neon adam_generic
+#endif
+
+static const struct matrix_kernels kernels_neon = {
+    "neon", NEON_MR, NEON_NR, gemm_micro_neon,
+    scale_neon, add_neon, sub_neon, mult_neon, axpy_neon, sum_squares_neon,
+    bias_activation_generic, gemm_s8_generic, quantize_s8_generic,
+    load_half_generic, store_half_generic, gemv_generic,
+    momentum_neon, adam_neon, softmax_generic, squared_error_generic,
+    conv_taps_generic};
+
+#endif // MATRIX_KERNELS_NEON
+
+const struct matrix_kernels *matrix_kernels = &kernels_scalar;
+
+/*
+ * isa_supported
+ *
+ * Checks whether a kernel table was compiled in and can run on this CPU.
+ */
+static int isa_supported(const struct matrix_kernels *kernels)
+{
+#ifdef MATRIX_KERNELS_X86
+    __builtin_cpu_init();
+    if (kernels == &kernels_sse)
+    {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (kernels == &kernels_avx2)
+    {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    }
+    if (kernels == &kernels_avx512)
+    {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+               __builtin_cpu_supports("f16c");
+    }
+#endif
+    return 1;
+}
+
+// Kernel tables in order of preference.
+static const struct matrix_kernels *const all_kernels[] = {
+#ifdef MATRIX_KERNELS_X86
+    &kernels_avx512,
+    &kernels_avx2,
+    &kernels_sse,
+#endif
+#ifdef MATRIX_KERNELS_NEON
+    &kernels_neon,
+#endif
+    &kernels_scalar,
+};
+static const int num_kernels = sizeof(all_kernels) / sizeof(all_kernels[0]);
+
+/*
+ * matrix_set_isa
+ *
+ * Selects the kernel table used by the matrix primitives.
+ *
+ * Parameters:
+ * name: One of "scalar", "sse", "avx2", "avx512", "neon", or "auto" for the
+ *       best table supported by the CPU.
+ *
+ * Returns:
+ * 0 on success, or -1 if the instruction set is unknown, was not compiled in,
+ * or is not supported by the CPU. The selection is unchanged on failure.
+ *
+ * Side effects:
+ * Changes the kernels used by every subsequent matrix operation. Must not be
+ * called while other threads are running matrix operations.
+ */
+int matrix_set_isa(const char *name)
+{
+    for (int i = 0; i < num_kernels; ++i)
+    {
+        bool wanted = strcmp(name, "auto") == 0 || strcmp(name, all_kernels[i]->name) == 0;
+        if (wanted && isa_supported(all_kernels[i]))
+        {
+            matrix_kernels = all_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * matrix_get_isa
+ *
+ * Returns the name of the active kernel table.
+ */
+const char *matrix_get_isa(void)
+{
+    return matrix_kernels->name;
+}
+
+/*
+ * Picks the kernels at startup. MATRIX_ISA overrides the detection, which is
+ * useful for benchmarking one instruction set against another.
+ */
+__attribute__((constructor))
+static void matrix_kernels_init(void)
+{
+    const char *forced = getenv("MATRIX_ISA");
+    if (forced != NULL && matrix_set_isa(forced) == 0)
+    {
+        return;
+    }
+    if (forced != NULL)
+    {
+        fprintf(stderr, "MATRIX_ISA=%s is not available, using auto detection\n", forced);
+    }
+    matrix_set_isa("auto");
+}
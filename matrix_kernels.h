@@ -0,0 +1,56 @@
+#ifndef MATRIX_KERNELS_H
+#define MATRIX_KERNELS_H
+
+#include <stdint.h>
+
+// Rows per panel of the weights packed for gemv (see pack_gemv in matrix.c).
+#define GEMV_ROWS 8
+
+/*
+ * Scalars of one optimizer step, shared by every parameter tensor it updates
+ * (see optimizer.c).
+ */
+struct optimizer_step {
+    float learning_rate;
+    float beta1;       // Momentum, or Adam's first-moment decay
+    float beta2;       // Adam's second-moment decay
+    float epsilon;
+    float correction1; // Adam's bias correction 1 / (1 - beta1^t)
+    float correction2; // Adam's bias correction 1 / (1 - beta2^t)
+    float decay;       // Factor applied to the weights: 1 - learning_rate * weight_decay
+};
+
+/*
+ * A set of inner loops for one instruction set. matrix.c calls through the
+ * active table, which is chosen once at startup from the CPU features (or the
+ * MATRIX_ISA environment variable) and can be changed with matrix_set_isa.
+ */
+struct matrix_kernels {
+    const char *name;
+    int mr; // Rows in the GEMM register tile
+    int nr; // Columns in the GEMM register tile
+    void (*gemm_micro)(int kc, const float *a, const float *b, float *C, int ldc, int m, int n);
+    void (*scale)(int n, float *x, float c);
+    void (*add)(int n, float *x, const float *y);
+    void (*sub)(int n, float *x, const float *y);
+    void (*mult)(int n, float *x, const float *y);
+    void (*axpy)(int n, float a, const float *x, float *y);
+    float (*sum_squares)(int n, const float *x);
+    void (*bias_activation)(int activation, int rows, int cols, const float *bias,
+                            const float *Z, float *A, float *D);
+    void (*gemm_s8)(int m, int n, int k, const int8_t *a, const int8_t *b, int ldb, int32_t *C, int ldc);
+    void (*quantize_s8)(int n, const float *x, float inverse_scale, int8_t *y);
+    void (*load_half)(int type, int n, const uint16_t *x, float *y);  // Widen fp16 or bf16 to float
+    void (*store_half)(int type, int n, const float *x, uint16_t *y); // Round to nearest even
+    void (*gemv)(int activation, int m, int k, const float *panels, const float *bias, const float *x, float *y);
+    void (*momentum)(int n, const struct optimizer_step *step, const float *g, float *v, float *w);
+    void (*adam)(int n, const struct optimizer_step *step, const float *g, float *m, float *v, float *w);
+    float (*softmax)(int rows, int cols, const float *bias, const float *Z, const float *Y, float *A, float *D,
+                     int *confusion);
+    float (*squared_error)(int rows, int cols, const float *A, const float *Y, float *D, int *confusion);
+    void (*conv_taps)(int taps, int filters, int n, const float *w, const float *const *x, float *y, int ldy);
+};
+
+extern const struct matrix_kernels *matrix_kernels;
+
+#endif // MATRIX_KERNELS_H
@@ -9,8 +9,17 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "matrix.h"
 #include "neural_net.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "thread_pool.h"
 
 float sigmoid(float x)
 {
@@ -19,7 +28,8 @@ float sigmoid(float x)
 
 float sigmoid_derivative(float x)
 {
-    return 1.0f / (1.0f + expf(-x)) * (1.0f - 1.0f / (1.0f + expf(-x)));
+    float s = sigmoid(x);
+    return s * (1.0f - s);
 }
 
 float relu(float x)
@@ -41,10 +51,12 @@ float my_tanh_derivative(float x) {
     return 1.0f - tanh_x * tanh_x;
 }
 
-const int num_a_functions = 3;
-const char* a_functions_str[3] = {"sigmoid", "relu", "tanh"}; 
-const float (*a_functions_f[3])(float) = {&sigmoid, &relu, &my_tanh};
-const float (*a_functions_f_der[3])(float) = {&sigmoid_derivative, &relu_derivative, &my_tanh_derivative};
+// Softmax mixes the outputs of a sample, so it has no scalar form.
+const int num_a_functions = 4;
+const char* a_functions_str[4] = {"sigmoid", "relu", "tanh", "softmax"}; 
+const float (*a_functions_f[4])(float) = {&sigmoid, &relu, &my_tanh, NULL};
+const float (*a_functions_f_der[4])(float) = {&sigmoid_derivative, &relu_derivative, &my_tanh_derivative, NULL};
+const enum activation a_functions_type[4] = {ACTIVATION_SIGMOID, ACTIVATION_RELU, ACTIVATION_TANH, ACTIVATION_SOFTMAX};
 
 /*
  * print_neural_net
@@ -100,6 +112,232 @@ float randf(float a, float b)
     return ((float)rand() / (float)(RAND_MAX)) * (b - a) + a;
 }
 
+/*
+ * set_activation
+ *
+ * Looks up an activation by name and installs it on a layer.
+ *
+ * Returns:
+ * true if the name is known and allowed on the layer: softmax is only
+ * allowed on the output layer.
+ */
+static bool set_activation(struct neural_net *neural_net, int layer, const char *name)
+{
+    for (int i = 0; i < num_a_functions; ++i) {
+        if(strcmp(a_functions_str[i], name) == 0) {
+            if (a_functions_type[i] == ACTIVATION_SOFTMAX && layer != neural_net->num_layers - 2) {
+                return false;
+            }
+            neural_net->activations[layer] = a_functions_f[i];
+            neural_net->activations_derivatives[layer] = a_functions_f_der[i];
+            neural_net->activation_types[layer] = a_functions_type[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * new_profile
+ *
+ * Returns counters for a network with num_layers layers when the library is
+ * built with NN_PROFILE, and NULL otherwise.
+ */
+static struct profile_stats *new_profile(int num_layers)
+{
+#ifdef NN_PROFILE
+    return construct_profile(num_layers - 1);
+#else
+    (void)num_layers;
+    return NULL;
+#endif
+}
+
+/*
+ * set_view
+ *
+ * Makes a matrix header describe rows x cols fp32 entries owned by someone
+ * else.
+ */
+static void set_view(struct matrix *view, int rows, int cols, float *entries)
+{
+    view->rows = rows;
+    view->cols = cols;
+    view->size = rows * cols;
+    view->entries = entries;
+    view->type = ELEMENT_FP32;
+}
+
+// Allocates count matrix headers for views.
+static struct matrix **construct_views(int count)
+{
+    struct matrix **views = malloc(count * sizeof(struct matrix *));
+    for (int i = 0; i < count; ++i)
+    {
+        views[i] = malloc(sizeof(struct matrix));
+    }
+    return views;
+}
+
+// Frees headers made by construct_views, leaving the entries alone.
+static void destruct_views(int count, struct matrix **views)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        free(views[i]);
+    }
+    free(views);
+}
+
+/*
+ * weight_shape
+ *
+ * Gives the shape of a layer's weights: outputs x inputs for a dense layer,
+ * filters x taps for a convolution, and empty for pooling. The biases are a
+ * column with as many rows as the weights.
+ */
+static void weight_shape(struct neural_net *neural_net, int layer, int *rows, int *cols)
+{
+    const struct conv_shape *shape = &neural_net->shapes[layer];
+    switch (neural_net->layer_types[layer])
+    {
+    case LAYER_CONV2D:
+        *rows = neural_net->layers[layer + 1] / (shape->out_height * shape->out_width);
+        *cols = conv_taps(shape);
+        break;
+    case LAYER_MAX_POOL:
+        *rows = 0;
+        *cols = 0;
+        break;
+    default:
+        *rows = neural_net->layers[layer + 1];
+        *cols = neural_net->layers[layer];
+        break;
+    }
+}
+
+/*
+ * layout_parameters
+ *
+ * Lays out the weights and biases of a network in one buffer: every weight
+ * matrix in layer order, then every bias vector, each rounded up to 16 floats
+ * so that it starts on a 64-byte boundary.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network, whose layer sizes, types and
+ *             shapes are set.
+ * entries: The buffer, or NULL to only compute the layout.
+ * weights: Headers to point at the weights, or NULL.
+ * biases: Headers to point at the biases, or NULL.
+ * biases_offset: Set to the start of the first bias vector.
+ *
+ * Returns:
+ * The size of the buffer in floats, padding included.
+ *
+ * Side effects:
+ * Unless entries is NULL, fills in the weight and bias headers.
+ */
+static int layout_parameters(struct neural_net *neural_net, float *entries, struct matrix **weights,
+                             struct matrix **biases, int *biases_offset)
+{
+    int offset = 0;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        int rows, cols;
+        weight_shape(neural_net, layer, &rows, &cols);
+        if (entries != NULL)
+        {
+            set_view(weights[layer], rows, cols, entries + offset);
+        }
+        offset += (rows * cols + 15) / 16 * 16;
+    }
+    *biases_offset = offset;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        int rows, cols;
+        weight_shape(neural_net, layer, &rows, &cols);
+        if (entries != NULL)
+        {
+            set_view(biases[layer], rows, 1, entries + offset);
+        }
+        offset += (rows + 15) / 16 * 16;
+    }
+    return offset;
+}
+
+/*
+ * allocate_parameters
+ *
+ * Allocates a zeroed 64-byte aligned buffer for the parameters of a network,
+ * points the weight and bias headers into it and sets the network's
+ * whole-buffer view.
+ *
+ * Side effects:
+ * Allocates the buffer, which destruct_neural_net frees.
+ */
+static void allocate_parameters(struct neural_net *neural_net)
+{
+    int size = layout_parameters(neural_net, NULL, NULL, NULL, &neural_net->biases_offset);
+    float *entries = aligned_alloc(64, size * sizeof(float));
+    memset(entries, 0, size * sizeof(float));
+    layout_parameters(neural_net, entries, neural_net->weights, neural_net->biases, &neural_net->biases_offset);
+    set_view(&neural_net->parameters, size, 1, entries);
+}
+
+/*
+ * new_neural_net
+ *
+ * Allocates a network of dense layers with the given sizes and no parameter
+ * buffer yet; the callers set the layer types and activations.
+ *
+ * Side effects:
+ * Allocates the network and its per-layer arrays, including a copy of the
+ * layer sizes.
+ */
+static struct neural_net *new_neural_net(int num_layers, const int *layers)
+{
+    struct neural_net *neural_net = malloc(sizeof(struct neural_net));
+    neural_net->num_layers = num_layers;
+    neural_net->layers = malloc(num_layers * sizeof(int));
+    memcpy(neural_net->layers, layers, num_layers * sizeof(int));
+    neural_net->layer_types = calloc(num_layers - 1, sizeof(enum layer_type));
+    neural_net->shapes = calloc(num_layers - 1, sizeof(struct conv_shape));
+    neural_net->weights = construct_views(num_layers - 1);
+    neural_net->biases = construct_views(num_layers - 1);
+    set_view(&neural_net->parameters, 0, 1, NULL);
+    neural_net->biases_offset = 0;
+    neural_net->activations = calloc(num_layers - 1, sizeof(float (*)(float)));
+    neural_net->activations_derivatives = calloc(num_layers - 1, sizeof(float (*)(float)));
+    neural_net->activation_types = calloc(num_layers - 1, sizeof(enum activation));
+    neural_net->num_shards = 0;
+    neural_net->num_gradients = 0;
+    neural_net->gradients = NULL;
+    neural_net->workspaces = NULL;
+    neural_net->mapping = NULL;
+    neural_net->mapping_size = 0;
+    neural_net->weight_type = ELEMENT_FP32;
+    neural_net->activation_type = ELEMENT_FP32;
+    neural_net->reduced_weights = NULL;
+    neural_net->sparse_weights = NULL;
+    neural_net->single = NULL;
+    neural_net->optimizer = NULL;
+    neural_net->profile = new_profile(num_layers);
+    return neural_net;
+}
+
+// Draws every weight uniformly from [-0.5, 0.5]; the biases stay zero.
+static void randomize_weights(struct neural_net *neural_net)
+{
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        struct matrix *matrix = neural_net->weights[layer];
+        for (int entry = 0; entry < matrix->size; ++entry)
+        {
+            matrix->entries[entry] = randf(-0.5f, 0.5f);
+        }
+    }
+}
+
 /*
  * construct_neural_net
  *
@@ -107,45 +345,122 @@ float randf(float a, float b)
  *
  * Parameters:
  * num_layers: The number of layers in the neural network.
- * layers: An array of layer sizes.
+ * layers: An array of layer sizes, which is copied.
+ * activations: The activation of each weight layer: "sigmoid", "relu",
+ *              "tanh", or "softmax" for the output layer only. The output
+ *              activation selects the loss: cross-entropy with softmax,
+ *              squared error otherwise.
  *
  * Returns:
  * A pointer to the newly constructed neural network.
  *
  * Side effects:
- * Allocates memory for the neural network structure and its weights.
+ * Allocates memory for the neural network structure and one buffer for all of
+ * its weights and biases.
  */
 struct neural_net *construct_neural_net(int num_layers, int layers[], char **activations)
 {
-    struct neural_net *neural_net = malloc(sizeof(struct neural_net));
-    neural_net->num_layers = num_layers;
-    neural_net->layers = layers;
-    neural_net->weights = malloc((num_layers - 1) * sizeof(struct matrix *));
-    neural_net->biases = malloc((num_layers - 1) * sizeof(struct matrix *));
-    neural_net->activations = malloc((num_layers - 1) * sizeof(float (*)(float)));
-    neural_net->activations_derivatives = malloc((num_layers - 1) * sizeof(float (*)(float)));
+    struct neural_net *neural_net = new_neural_net(num_layers, layers);
+    allocate_parameters(neural_net);
+    randomize_weights(neural_net);
     for (int layer = 0; layer < num_layers - 1; ++layer)
     {
-        struct matrix *matrix = construct_matrix(layers[layer + 1], layers[layer]);
-        struct matrix *bias = construct_matrix(layers[layer + 1], 1);
-        for (int entry = 0; entry < matrix->size; ++entry)
+        bool known = set_activation(neural_net, layer, activations[layer]);
+        assert(known);
+        (void)known;
+    }
+    return neural_net;
+}
+
+/*
+ * construct_conv_net
+ *
+ * Constructs a network for images from a list of layers, for instance a
+ * convolution, a max pooling layer and a dense output layer. Each layer's
+ * input geometry follows from the previous one: a convolution outputs one
+ * channel per filter, pooling keeps the channels, and a dense layer flattens
+ * its input into a column of size channels.
+ *
+ * Parameters:
+ * channels: The number of channels of the input images.
+ * height: The height of the input images.
+ * width: The width of the input images.
+ * num_specs: The number of weight layers.
+ * specs: The layers, from the input to the output, which must be dense.
+ *        Activations are as for construct_neural_net.
+ *
+ * Returns:
+ * A pointer to the newly constructed neural network, whose layers[0] is
+ * channels x height x width.
+ *
+ * Side effects:
+ * Allocates memory for the neural network structure and one buffer for all of
+ * its weights and biases.
+ */
+struct neural_net *construct_conv_net(int channels, int height, int width, int num_specs, const struct layer_spec specs[])
+{
+    assert((num_specs >= 1) && (specs[num_specs - 1].type == LAYER_DENSE));
+    int layers[num_specs + 1];
+    struct conv_shape shapes[num_specs];
+    layers[0] = channels * height * width;
+    for (int layer = 0; layer < num_specs; ++layer)
+    {
+        const struct layer_spec *spec = &specs[layer];
+        memset(&shapes[layer], 0, sizeof(struct conv_shape));
+        if (spec->type == LAYER_DENSE)
         {
-            matrix->entries[entry] = randf(-0.5f, 0.5f);
+            channels = spec->size;
+            height = 1;
+            width = 1;
+        }
+        else
+        {
+            shapes[layer] = make_conv_shape(channels, height, width, spec->kernel, spec->stride, spec->padding);
+            channels = (spec->type == LAYER_CONV2D) ? spec->size : channels;
+            height = shapes[layer].out_height;
+            width = shapes[layer].out_width;
         }
-        neural_net->weights[layer] = matrix;
-        neural_net->biases[layer] = bias;
+        layers[layer + 1] = channels * height * width;
+    }
 
-        for (int i = 0; i < num_a_functions; ++i) {
-            if(strcmp(a_functions_str[i], activations[layer]) == 0) {
-                neural_net->activations[layer] = a_functions_f[i];
-                neural_net->activations_derivatives[layer] = a_functions_f_der[i];
-                break;
-            }
+    struct neural_net *neural_net = new_neural_net(num_specs + 1, layers);
+    for (int layer = 0; layer < num_specs; ++layer)
+    {
+        neural_net->layer_types[layer] = specs[layer].type;
+        neural_net->shapes[layer] = shapes[layer];
+    }
+    allocate_parameters(neural_net);
+    randomize_weights(neural_net);
+    for (int layer = 0; layer < num_specs; ++layer)
+    {
+        if (specs[layer].type != LAYER_MAX_POOL)
+        {
+            bool known = set_activation(neural_net, layer, specs[layer].activation);
+            assert(known);
+            (void)known;
         }
     }
     return neural_net;
 }
 
+// Frees the sparse forms of pruned layers, which lifts their masks.
+static void destruct_sparse_weights(struct neural_net *neural_net)
+{
+    if (neural_net->sparse_weights == NULL)
+    {
+        return;
+    }
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->sparse_weights[layer] != NULL)
+        {
+            destruct_sparse_matrix(neural_net->sparse_weights[layer]);
+        }
+    }
+    free(neural_net->sparse_weights);
+    neural_net->sparse_weights = NULL;
+}
+
 /*
  * destruct_neural_net
  *
@@ -162,116 +477,1841 @@ struct neural_net *construct_neural_net(int num_layers, int layers[], char **act
  */
 void destruct_neural_net(struct neural_net *neural_net)
 {
-    destruct_matrix_array(neural_net->num_layers - 1, neural_net->weights);
-    destruct_matrix_array(neural_net->num_layers - 1, neural_net->biases);
+    for (int i = 0; i < neural_net->num_gradients; ++i)
+    {
+        destruct_gradients(neural_net, neural_net->gradients[i]);
+    }
+    for (int i = 0; i < neural_net->num_shards; ++i)
+    {
+        destruct_workspace(neural_net->workspaces[i]);
+    }
+    free(neural_net->gradients);
+    free(neural_net->workspaces);
+    free(neural_net->activations);
+    free(neural_net->activations_derivatives);
+    free(neural_net->activation_types);
+    free(neural_net->layer_types);
+    free(neural_net->shapes);
+    if (neural_net->reduced_weights != NULL)
+    {
+        destruct_matrix_array(neural_net->num_layers - 1, neural_net->reduced_weights);
+    }
+    destruct_sparse_weights(neural_net);
+    if (neural_net->single != NULL)
+    {
+        free(neural_net->single->panels);
+        free(neural_net->single->offsets);
+        free(neural_net->single->ping);
+        free(neural_net->single);
+    }
+    if (neural_net->optimizer != NULL)
+    {
+        destruct_optimizer(neural_net->optimizer);
+    }
+#ifdef NN_PROFILE
+    destruct_profile(neural_net->profile);
+#endif
+    destruct_views(neural_net->num_layers - 1, neural_net->weights);
+    destruct_views(neural_net->num_layers - 1, neural_net->biases);
+    // The parameters of a loaded network are either views of the mapping or a
+    // copy made by load_neural_net.
+    const uint8_t *entries = (const uint8_t *)neural_net->parameters.entries;
+    const uint8_t *mapping = neural_net->mapping;
+    if (mapping == NULL || entries < mapping || entries >= mapping + neural_net->mapping_size)
+    {
+        free(neural_net->parameters.entries);
+    }
+    if (mapping != NULL)
+    {
+        munmap(neural_net->mapping, neural_net->mapping_size);
+    }
+    free(neural_net->layers);
     free(neural_net);
 }
 
+static uint64_t align_64(uint64_t offset)
+{
+    return (offset + 63) / 64 * 64;
+}
+
 /*
- * eval
+ * save_neural_net
  *
- * Evaluates the neural network with the given input data.
+ * Writes the layer sizes, types and geometry, activations, weights and biases
+ * of a network to a checkpoint file that load_neural_net can map. The file is
+ * written under a temporary name in the same directory and renamed over path,
+ * so a network loaded from path keeps its mapping of the old file and a failed
+ * save leaves the old checkpoint intact.
  *
  * Parameters:
  * neural_net: A pointer to the neural network.
- * in_data: A pointer to the input data matrix.
+ * path: The path of the checkpoint file to write.
  *
  * Returns:
- * A pointer to the output matrix.
+ * 0 on success, or -1 if the file cannot be written.
  *
  * Side effects:
- * Allocates and deallocates memory for intermediate matrices.
+ * Creates or replaces the checkpoint file.
  */
-struct matrix *eval(struct neural_net *neural_net, struct matrix *in_data)
+int save_neural_net(struct neural_net *neural_net, const char *path)
 {
-    struct matrix *current = copy_matrix(in_data);
-    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    char *temp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+    strcpy(temp_path, path);
+    strcat(temp_path, ".XXXXXX");
+    int fd = mkstemp(temp_path);
+    FILE *out = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (out == NULL)
     {
-        struct matrix *old = current;
-        current = mat_mult((neural_net->weights)[layer], current);
-        for (int col = 0; col < current->cols; ++col)
+        perror(path);
+        if (fd >= 0)
         {
-            for (int row = 0; row < current->rows; ++row)
-            {
-                current->entries[row * current->cols + col] += (((neural_net->biases)[layer])->entries)[row];
-            }
+            close(fd);
+            unlink(temp_path);
         }
-        unary_element_wise(current, neural_net->activations[layer]);
-        destruct_matrix(old);
+        free(temp_path);
+        return -1;
     }
-    return current;
-}
-
+    // mkstemp creates the file private; give it the mode fopen would have.
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
 
-// TODO make activation and derivative be vectorized functions. apply to columns to create array.
+    int num_weights = neural_net->num_layers - 1;
+    struct checkpoint_header header = {0};
+    memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+    header.version = CHECKPOINT_VERSION;
+    header.num_layers = neural_net->num_layers;
+    header.layers_offset = sizeof(struct checkpoint_header);
+    header.table_offset = align_64(header.layers_offset + neural_net->num_layers * sizeof(uint32_t));
+    fwrite(&header, sizeof(header), 1, out);
 
-float back_propagate(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, float learning_rate)
-{
-    struct matrix **Z = calloc(neural_net->num_layers - 1, sizeof(struct matrix *));
-    struct matrix **activations = calloc(neural_net->num_layers, sizeof(struct matrix *));
-    activations[0] = copy_matrix(in_data);
+    fseek(out, header.layers_offset, SEEK_SET);
+    for (int layer = 0; layer < neural_net->num_layers; ++layer)
+    {
+        uint32_t size = neural_net->layers[layer];
+        fwrite(&size, sizeof(size), 1, out);
+    }
 
-    // Forward pass
-    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    // The parameter buffer is written as is, so the blobs keep its layout.
+    uint64_t offset = align_64(header.table_offset + num_weights * sizeof(struct checkpoint_layer));
+    const float *entries = neural_net->parameters.entries;
+    struct checkpoint_layer *table = calloc(num_weights, sizeof(struct checkpoint_layer));
+    for (int layer = 0; layer < num_weights; ++layer)
     {
-        Z[layer] = mat_mult((neural_net->weights)[layer], activations[layer]);
-        for (int col = 0; col < Z[layer]->cols; ++col)
+        if (neural_net->layer_types[layer] != LAYER_MAX_POOL)
         {
-            for (int row = 0; row < Z[layer]->rows; ++row)
-            {
-                Z[layer]->entries[row * Z[layer]->cols + col] += (((neural_net->biases)[layer])->entries)[row];
-            }
+            strncpy(table[layer].activation, a_functions_str[neural_net->activation_types[layer]], sizeof(table[layer].activation) - 1);
+        }
+        table[layer].weights_offset = offset + (neural_net->weights[layer]->entries - entries) * sizeof(float);
+        table[layer].biases_offset = offset + (neural_net->biases[layer]->entries - entries) * sizeof(float);
+        table[layer].type = neural_net->layer_types[layer];
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            const struct conv_shape *shape = &neural_net->shapes[layer];
+            table[layer].channels = shape->channels;
+            table[layer].height = shape->height;
+            table[layer].width = shape->width;
+            table[layer].kernel = shape->kernel;
+            table[layer].stride = shape->stride;
+            table[layer].padding = shape->padding;
         }
+    }
+    fseek(out, header.table_offset, SEEK_SET);
+    fwrite(table, sizeof(struct checkpoint_layer), num_weights, out);
+    free(table);
+    fseek(out, offset, SEEK_SET);
+    fwrite(entries, sizeof(float), neural_net->parameters.size, out);
 
-        activations[layer + 1] = unary_element_wise(copy_matrix(Z[layer]), neural_net->activations[layer]);
+    int status = 0;
+    if (ferror(out))
+    {
+        perror(path);
+        status = -1;
+    }
+    if (fclose(out) != 0)
+    {
+        status = -1;
+    }
+    if (status == 0 && rename(temp_path, path) != 0)
+    {
+        perror(path);
+        status = -1;
+    }
+    if (status != 0)
+    {
+        unlink(temp_path);
     }
+    free(temp_path);
+    return status;
+}
 
-    struct matrix **dCdA = calloc(neural_net->num_layers - 1, sizeof(struct matrix *));
-    struct matrix **dCdZ = calloc(neural_net->num_layers - 1, sizeof(struct matrix *));
+// Whether a blob of size bytes at offset lies inside a file of file_size bytes.
+static bool blob_fits(uint64_t offset, uint64_t size, uint64_t file_size, uint64_t alignment)
+{
+    return offset % alignment == 0 && offset <= file_size && size <= file_size - offset;
+}
 
-    dCdA[neural_net->num_layers - 2] = matrix_sub(copy_matrix(activations[neural_net->num_layers - 1]), expected);
-    for (int layer = neural_net->num_layers - 2; layer >= 0; --layer)
+/*
+ * read_layer_geometry
+ *
+ * Sets the type and input geometry of a layer from its checkpoint entry.
+ *
+ * Returns:
+ * true if the entry names a known layer type whose geometry matches the
+ * layer sizes of the network.
+ */
+static bool read_layer_geometry(struct neural_net *neural_net, int layer, const struct checkpoint_layer *entry)
+{
+    if (entry->type == LAYER_DENSE)
+    {
+        neural_net->layer_types[layer] = LAYER_DENSE;
+        return true;
+    }
+    // Bounding the sides keeps every size below in range of an int.
+    const uint64_t limit = 1 << 16;
+    uint64_t inputs = neural_net->layers[layer];
+    uint64_t channels = entry->channels, height = entry->height, width = entry->width;
+    uint64_t kernel = entry->kernel, padding = entry->padding;
+    if ((entry->type != LAYER_CONV2D && entry->type != LAYER_MAX_POOL) || channels == 0 || height == 0 ||
+        width == 0 || kernel == 0 || entry->stride == 0 || height > limit || width > limit || kernel > limit ||
+        entry->stride > limit || padding >= kernel || channels * height * width != inputs ||
+        height + 2 * padding < kernel || width + 2 * padding < kernel)
     {
-        struct matrix *dAdZ = unary_element_wise(copy_matrix(Z[layer]), neural_net->activations_derivatives[layer]);
-        dCdZ[layer] = hadamard_product(copy_matrix(dCdA[layer]), dAdZ);
+        return false;
+    }
+    struct conv_shape shape = make_conv_shape(channels, height, width, kernel, entry->stride, padding);
+    uint64_t positions = (uint64_t)shape.out_height * shape.out_width;
+    uint64_t outputs = neural_net->layers[layer + 1];
+    if ((entry->type == LAYER_CONV2D) ? (outputs % positions != 0) : (outputs != channels * positions))
+    {
+        return false;
+    }
+    neural_net->layer_types[layer] = entry->type;
+    neural_net->shapes[layer] = shape;
+    return true;
+}
 
-        struct matrix *dZdW = copy_matrix(activations[layer]);
-        struct matrix *dZdW_transposed = transpose(dZdW);
+/*
+ * load_neural_net
+ *
+ * Maps a checkpoint written by save_neural_net and builds a network whose
+ * weight and bias entries point straight into the mapping, so start-up cost
+ * does not depend on the size of the model. A valid checkpoint whose blobs are
+ * not laid out like the parameter buffer is copied into a new buffer instead.
+ *
+ * Parameters:
+ * path: The path of the checkpoint file.
+ *
+ * Returns:
+ * A pointer to the loaded neural network, or NULL if the file cannot be read
+ * or is not a valid checkpoint.
+ *
+ * Side effects:
+ * Maps the file privately: pages are read on demand, and training the loaded
+ * network copies the pages it writes instead of modifying the file. The
+ * mapping is released by destruct_neural_net.
+ */
+struct neural_net *load_neural_net(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct checkpoint_header))
+    {
+        fprintf(stderr, "%s: not a checkpoint file\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror(path);
+        return NULL;
+    }
 
-        struct matrix *dCdW = scale_matrix(mat_mult(dCdZ[layer], dZdW_transposed), learning_rate);
-        matrix_sub(neural_net->weights[layer], dCdW);
+    const uint8_t *base = mapping;
+    const struct checkpoint_header *header = mapping;
+    uint64_t size = st.st_size;
+    int num_layers = header->num_layers;
+    size_t entry_size = (header->version == 1) ? CHECKPOINT_LAYER_V1_SIZE : sizeof(struct checkpoint_layer);
+    bool valid = memcmp(header->magic, CHECKPOINT_MAGIC, 4) == 0 &&
+                 (header->version == 1 || header->version == CHECKPOINT_VERSION) &&
+                 num_layers >= 2 && header->num_layers <= 1 << 16 &&
+                 blob_fits(header->layers_offset, num_layers * sizeof(uint32_t), size, sizeof(uint32_t)) &&
+                 blob_fits(header->table_offset, (num_layers - 1) * entry_size, size, 8);
+    const uint32_t *layers = (const uint32_t *)(base + header->layers_offset);
+    for (int layer = 0; valid && layer < num_layers; ++layer)
+    {
+        valid = layers[layer] > 0 && layers[layer] <= INT32_MAX;
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "%s: not a version %d checkpoint file\n", path, CHECKPOINT_VERSION);
+        munmap(mapping, size);
+        return NULL;
+    }
 
-        struct matrix *ones = construct_matrix(dCdZ[layer]->cols, 1);
-        for (size_t entry = 0; entry < ones->size; entry++)
+    // Version 1 entries are a prefix of the current ones; the rest reads as
+    // zero, which is a dense layer.
+    struct checkpoint_layer *table = calloc(num_layers - 1, sizeof(struct checkpoint_layer));
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        memcpy(&table[layer], base + header->table_offset + layer * entry_size, entry_size);
+    }
+    struct neural_net *neural_net = new_neural_net(num_layers, (const int *)layers);
+    neural_net->mapping = mapping;
+    neural_net->mapping_size = size;
+    for (int layer = 0; valid && layer < num_layers - 1; ++layer)
+    {
+        int rows, cols;
+        valid = read_layer_geometry(neural_net, layer, &table[layer]);
+        if (valid)
         {
-            ones->entries[entry] = 1.0f;
+            weight_shape(neural_net, layer, &rows, &cols);
+            valid = (uint64_t)rows * cols <= INT32_MAX &&
+                    memchr(table[layer].activation, '\0', sizeof(table[layer].activation)) != NULL &&
+                    blob_fits(table[layer].weights_offset, (uint64_t)rows * cols * sizeof(float), size, 64) &&
+                    blob_fits(table[layer].biases_offset, rows * sizeof(float), size, 64);
         }
-        struct matrix *dCdB = scale_matrix(mat_mult(dCdZ[layer], ones), learning_rate);
-        matrix_sub(neural_net->biases[layer], dCdB);
-
-        destruct_matrix(dCdB);
-        destruct_matrix(ones);
-        destruct_matrix(dCdW);
-        destruct_matrix(dZdW_transposed);
-        destruct_matrix(dZdW);
-        destruct_matrix(dAdZ);
+    }
+    if (!valid || neural_net->layer_types[num_layers - 2] != LAYER_DENSE)
+    {
+        fprintf(stderr, "%s: not a version %d checkpoint file\n", path, CHECKPOINT_VERSION);
+        free(table);
+        destruct_neural_net(neural_net);
+        return NULL;
+    }
 
-        if (layer != 0)
+    // Checkpoints written by save_neural_net hold the parameter buffer as is
+    // and are used in place; others are copied into a new buffer.
+    int parameters_size = layout_parameters(neural_net, NULL, NULL, NULL, &neural_net->biases_offset);
+    uint64_t start = table[0].weights_offset;
+    bool in_place = blob_fits(start, parameters_size * sizeof(float), size, 64);
+    if (in_place)
+    {
+        float *entries = (float *)(base + start);
+        layout_parameters(neural_net, entries, neural_net->weights, neural_net->biases, &neural_net->biases_offset);
+        set_view(&neural_net->parameters, parameters_size, 1, entries);
+        for (int layer = 0; layer < num_layers - 1; ++layer)
         {
-            struct matrix *dZdA = neural_net->weights[layer];
-            struct matrix *dZdA_transposed = transpose(dZdA);
-            dCdA[layer - 1] = mat_mult(dZdA_transposed, dCdZ[layer]);
-
-            destruct_matrix(dZdA_transposed);
+            in_place = in_place &&
+                       (const uint8_t *)neural_net->weights[layer]->entries == base + table[layer].weights_offset &&
+                       (const uint8_t *)neural_net->biases[layer]->entries == base + table[layer].biases_offset;
+        }
+    }
+    if (!in_place)
+    {
+        allocate_parameters(neural_net);
+        for (int layer = 0; layer < num_layers - 1; ++layer)
+        {
+            memcpy(neural_net->weights[layer]->entries, base + table[layer].weights_offset,
+                   neural_net->weights[layer]->size * sizeof(float));
+            memcpy(neural_net->biases[layer]->entries, base + table[layer].biases_offset,
+                   neural_net->biases[layer]->size * sizeof(float));
+        }
+    }
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_MAX_POOL &&
+            !set_activation(neural_net, layer, table[layer].activation))
+        {
+            fprintf(stderr, "%s: invalid activation '%s' for layer %d\n", path, table[layer].activation, layer);
+            free(table);
+            destruct_neural_net(neural_net);
+            return NULL;
         }
     }
+    free(table);
+    return neural_net;
+}
 
-    float cost = 0.5f * squared_2_norm(dCdA[neural_net->num_layers - 2]);
+/*
+ * set_neural_net_precision
+ *
+ * Chooses the storage format of the weights used by the products and of the
+ * hidden activations. The fp32 weights stay the master copy that training
+ * updates; with a reduced weight_type the products read a rounded copy that
+ * is refreshed after every update, halving the weight traffic of eval. With a
+ * reduced activation_type the hidden layers' activations are rounded when
+ * stored and widened again when packed for the next product. Network inputs,
+ * outputs, the activations around convolution and pooling layers and all
+ * gradients stay in fp32.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * weight_type: The format of the weights read by the forward and backward
+ *              products.
+ * activation_type: The format of the hidden activations.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Allocates or frees the reduced weight copies, and drops the network's
+ * workspaces and gradient buffers so they are rebuilt in the new layout.
+ */
+void set_neural_net_precision(struct neural_net *neural_net, enum element_type weight_type, enum element_type activation_type)
+{
+    for (int i = 0; i < neural_net->num_gradients; ++i)
+    {
+        destruct_gradients(neural_net, neural_net->gradients[i]);
+    }
+    for (int i = 0; i < neural_net->num_shards; ++i)
+    {
+        destruct_workspace(neural_net->workspaces[i]);
+    }
+    free(neural_net->gradients);
+    free(neural_net->workspaces);
+    neural_net->num_shards = 0;
+    neural_net->num_gradients = 0;
+    neural_net->gradients = NULL;
+    neural_net->workspaces = NULL;
 
-    destruct_matrix_array(neural_net->num_layers - 1, dCdA);
-    destruct_matrix_array(neural_net->num_layers - 1, dCdZ);
-    destruct_matrix_array(neural_net->num_layers, activations);
-    destruct_matrix_array(neural_net->num_layers - 1, Z);
+    if (neural_net->reduced_weights != NULL)
+    {
+        destruct_matrix_array(neural_net->num_layers - 1, neural_net->reduced_weights);
+        neural_net->reduced_weights = NULL;
+    }
+    if (weight_type != ELEMENT_FP32)
+    {
+        neural_net->reduced_weights = malloc((neural_net->num_layers - 1) * sizeof(struct matrix *));
+        for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+        {
+            neural_net->reduced_weights[layer] = convert_matrix(neural_net->weights[layer], weight_type);
+        }
+    }
+    neural_net->weight_type = weight_type;
+    neural_net->activation_type = activation_type;
+}
 
-    return cost;
-}
\ No newline at end of file
+/*
+ * set_neural_net_optimizer
+ *
+ * Chooses the update rule apply_gradients uses (see optimizer.h), with fresh
+ * zeroed state for the parameters. Its hyperparameters can be changed through
+ * neural_net->optimizer before training.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * name: "sgd", "momentum", "adam" or "adamw".
+ *
+ * Returns:
+ * 0 on success, or -1 if the name is unknown, in which case the current
+ * optimizer is kept.
+ *
+ * Side effects:
+ * Frees the previous optimizer and its state.
+ */
+int set_neural_net_optimizer(struct neural_net *neural_net, const char *name)
+{
+    // Tensor 0 is every weight and tensor 1 every bias, as laid out in the
+    // parameter buffer, so each update is one pass over one block.
+    int sizes[2] = {neural_net->biases_offset, neural_net->parameters.size - neural_net->biases_offset};
+    struct optimizer *optimizer = construct_optimizer(name, 2, sizes);
+    if (optimizer == NULL)
+    {
+        fprintf(stderr, "unknown optimizer '%s'\n", name);
+        return -1;
+    }
+    if (neural_net->optimizer != NULL)
+    {
+        destruct_optimizer(neural_net->optimizer);
+    }
+    neural_net->optimizer = optimizer;
+    return 0;
+}
+
+struct block_score {
+    float score;        // Mean magnitude of the weights of the block
+    int layer;
+    int block;          // Block row times the layer's columns plus the column
+};
+
+static int compare_block_scores(const void *a, const void *b)
+{
+    float x = ((const struct block_score *)a)->score, y = ((const struct block_score *)b)->score;
+    return (x > y) - (x < y);
+}
+
+static int block_count(struct matrix *weights, int block_rows)
+{
+    return (weights->rows + block_rows - 1) / block_rows * weights->cols;
+}
+
+/*
+ * block_weights
+ *
+ * Finds the weights of one block of a layer: the column and the first and
+ * past-the-end rows.
+ */
+static void block_weights(struct matrix *weights, int block_rows, int block, int *col, int *first, int *last)
+{
+    *col = block % weights->cols;
+    *first = block / weights->cols * block_rows;
+    *last = (*first + block_rows < weights->rows) ? *first + block_rows : weights->rows;
+}
+
+/*
+ * prune_neural_net
+ *
+ * Magnitude pruning: zeroes the given fraction of the weights of the dense
+ * layers, in blocks of block_rows consecutive rows of one column (single
+ * weights with block_rows 1). The blocks of all the layers are ranked
+ * together by the mean magnitude of their weights, so large layers with many
+ * small weights give up more than small ones. The survivors of each layer
+ * are recorded as a sparse matrix with the same blocks; layers left with at
+ * most SPARSE_MAX_DENSITY of their weights then evaluate with spmm, whose
+ * work and memory scale with the weights kept. Blocks of four rows fill the
+ * register tiles of its kernel, where scattered single weights do not. The
+ * pattern also acts as a mask for further training: each update keeps the
+ * pruned weights at zero, so training after pruning fine-tunes the remaining
+ * ones. Convolution weights are not pruned.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * sparsity: The fraction of the blocks to zero, in [0, 1). With 0 the masks
+ *           and sparse forms are dropped and the weights are left as they
+ *           are.
+ * block_rows: The rows per block, at least 1.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Modifies the weights in place, replaces the sparse forms of the layers,
+ * refreshes the reduced-precision copies of the weights if there are any, and
+ * marks the weights packed for eval_single as stale.
+ */
+void prune_neural_net(struct neural_net *neural_net, float sparsity, int block_rows)
+{
+    assert((sparsity >= 0.0f) && (sparsity < 1.0f) && (block_rows > 0));
+    destruct_sparse_weights(neural_net);
+    if (sparsity == 0.0f)
+    {
+        return;
+    }
+    int num_blocks = 0;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] == LAYER_DENSE)
+        {
+            num_blocks += block_count(neural_net->weights[layer], block_rows);
+        }
+    }
+    struct block_score *scores = malloc(num_blocks * sizeof(struct block_score));
+    int scored = 0;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            continue;
+        }
+        struct matrix *weights = neural_net->weights[layer];
+        for (int block = 0; block < block_count(weights, block_rows); ++block)
+        {
+            int col, first, last;
+            block_weights(weights, block_rows, block, &col, &first, &last);
+            float sum = 0.0f;
+            for (int row = first; row < last; ++row)
+            {
+                sum += fabsf(weights->entries[(size_t)row * weights->cols + col]);
+            }
+            scores[scored++] = (struct block_score){sum / (last - first), layer, block};
+        }
+    }
+    qsort(scores, num_blocks, sizeof(struct block_score), compare_block_scores);
+    for (int i = 0; i < (int)(sparsity * num_blocks); ++i)
+    {
+        struct matrix *weights = neural_net->weights[scores[i].layer];
+        int col, first, last;
+        block_weights(weights, block_rows, scores[i].block, &col, &first, &last);
+        for (int row = first; row < last; ++row)
+        {
+            weights->entries[(size_t)row * weights->cols + col] = 0.0f;
+        }
+    }
+    free(scores);
+
+    neural_net->sparse_weights = calloc(neural_net->num_layers - 1, sizeof(struct sparse_matrix *));
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            continue;
+        }
+        neural_net->sparse_weights[layer] = construct_sparse_matrix(neural_net->weights[layer], block_rows);
+        if (neural_net->reduced_weights != NULL)
+        {
+            copy_matrix_into(neural_net->weights[layer], neural_net->reduced_weights[layer]);
+        }
+    }
+    if (neural_net->single != NULL)
+    {
+        neural_net->single->stale = true;
+    }
+}
+
+/*
+ * sparse_weight_bytes
+ *
+ * Returns the memory the weights of a pruned network take for inference:
+ * the sparse form of each layer evaluated with spmm, and the dense weights of
+ * the others.
+ */
+size_t sparse_weight_bytes(struct neural_net *neural_net)
+{
+    size_t bytes = 0;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        struct sparse_matrix *sparse = (neural_net->sparse_weights != NULL) ? neural_net->sparse_weights[layer] : NULL;
+        if (sparse != NULL && sparse_density(sparse) <= SPARSE_MAX_DENSITY)
+        {
+            bytes += sparse_matrix_bytes(sparse);
+        }
+        else
+        {
+            bytes += neural_net->weights[layer]->size * element_size(neural_net->weight_type);
+        }
+    }
+    return bytes;
+}
+
+/*
+ * layer_weights
+ *
+ * Returns the weights the products of a layer read: the reduced-precision
+ * copy if there is one, otherwise the master weights.
+ */
+static struct matrix *layer_weights(struct neural_net *neural_net, int layer)
+{
+    return (neural_net->reduced_weights != NULL) ? neural_net->reduced_weights[layer] : neural_net->weights[layer];
+}
+
+/*
+ * construct_gradients
+ *
+ * Constructs a zeroed gradient buffer laid out like the network's parameters.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ *
+ * Returns:
+ * A pointer to the newly constructed gradients.
+ *
+ * Side effects:
+ * Allocates one buffer for all the gradients and a view per weight and bias.
+ */
+struct gradients *construct_gradients(struct neural_net *neural_net)
+{
+    struct gradients *gradients = malloc(sizeof(struct gradients));
+    gradients->weights = construct_views(neural_net->num_layers - 1);
+    gradients->biases = construct_views(neural_net->num_layers - 1);
+    int size = neural_net->parameters.size;
+    float *entries = aligned_alloc(64, size * sizeof(float));
+    memset(entries, 0, size * sizeof(float));
+    int biases_offset;
+    layout_parameters(neural_net, entries, gradients->weights, gradients->biases, &biases_offset);
+    set_view(&gradients->all, size, 1, entries);
+    return gradients;
+}
+
+/*
+ * destruct_gradients
+ *
+ * Deallocates a gradient buffer made by construct_gradients.
+ */
+void destruct_gradients(struct neural_net *neural_net, struct gradients *gradients)
+{
+    destruct_views(neural_net->num_layers - 1, gradients->weights);
+    destruct_views(neural_net->num_layers - 1, gradients->biases);
+    free(gradients->all.entries);
+    free(gradients);
+}
+
+/*
+ * gradients_norm
+ *
+ * Returns the 2-norm of all the gradients of a network taken together, for
+ * instance to clip them before apply_gradients.
+ */
+float gradients_norm(struct gradients *gradients)
+{
+    return sqrtf(squared_2_norm(&gradients->all));
+}
+
+/*
+ * hidden_type
+ *
+ * Returns the format of the activations a layer outputs: the network's
+ * activation_type between two dense layers, fp32 for the network's outputs
+ * and around convolution and pooling layers.
+ */
+static enum element_type hidden_type(struct neural_net *neural_net, int layer)
+{
+    bool dense = neural_net->layer_types[layer] == LAYER_DENSE &&
+                 layer + 1 < neural_net->num_layers - 1 && neural_net->layer_types[layer + 1] == LAYER_DENSE;
+    return dense ? neural_net->activation_type : ELEMENT_FP32;
+}
+
+/*
+ * layer_input
+ *
+ * Returns the matrix feeding a layer: the caller's input for the first layer,
+ * otherwise the previous layer's activations in the workspace.
+ */
+static struct matrix *layer_input(struct workspace *workspace, struct matrix *in_data, int layer)
+{
+    return (layer == 0) ? in_data : &workspace->activations[layer];
+}
+
+/*
+ * softmax_output
+ *
+ * Whether the network ends in softmax, and therefore trains with the
+ * cross-entropy loss instead of squared error.
+ */
+static bool softmax_output(struct neural_net *neural_net)
+{
+    return neural_net->activation_types[neural_net->num_layers - 2] == ACTIVATION_SOFTMAX;
+}
+
+/*
+ * bias_view
+ *
+ * Views a matrix laid out like a layer's outputs with one row per bias: as is
+ * for a dense layer, and as filters x (positions x samples) for a
+ * convolution, whose products and epilogue treat every position of a filter
+ * as one more column.
+ */
+static struct matrix bias_view(struct neural_net *neural_net, int layer, struct matrix *matrix)
+{
+    struct matrix view = *matrix;
+    view.rows = neural_net->biases[layer]->rows;
+    view.cols = matrix->size / view.rows;
+    return view;
+}
+
+/*
+ * layer_sparse
+ *
+ * Returns the sparse form of a pruned layer if its forward product should
+ * use it: the layer keeps at most SPARSE_MAX_DENSITY of its weights and the
+ * input is fp32. Returns NULL otherwise.
+ */
+static struct sparse_matrix *layer_sparse(struct neural_net *neural_net, int layer, struct matrix *input)
+{
+    struct sparse_matrix *sparse = (neural_net->sparse_weights != NULL) ? neural_net->sparse_weights[layer] : NULL;
+    if (sparse == NULL || input->type != ELEMENT_FP32 || sparse_density(sparse) > SPARSE_MAX_DENSITY)
+    {
+        return NULL;
+    }
+    return sparse;
+}
+
+/*
+ * Sizes of the workspace views a layer needs besides its activations and
+ * their gradient, which every layer has.
+ */
+struct layer_buffers {
+    int weighted_rows;      // Rows of Z and dCdZ, 0 without a weighted input
+    int column_rows;        // Rows of columns, 0 without them
+    int column_cols;        // Columns of columns per sample
+    bool forward_columns;   // The forward pass writes columns, not only the backward pass
+};
+
+/*
+ * The operations of one kind of layer. forward computes the layer's
+ * activations from its input; backward takes the layer's dCdA and leaves
+ * its parameter gradients and the dCdA of the previous layer; workspace_size
+ * tells the planner which views the two use. The passes run every layer
+ * through the table layer_ops, indexed by enum layer_type, so a new kind of
+ * layer or a fused one only supplies these hooks.
+ */
+struct layer_ops {
+    void (*workspace_size)(struct neural_net *neural_net, int layer, struct layer_buffers *buffers);
+    void (*forward)(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                    bool training, bool fused_loss);
+    void (*backward)(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                     struct gradients *gradients);
+};
+
+/*
+ * bias_activation_epilogue
+ *
+ * Applies the bias and activation of a layer to its weighted input in one
+ * fused pass; when training it also stores the activation derivative in
+ * dCdZ. With fused_loss a softmax output layer is left alone, because
+ * output_loss computes the probabilities together with the loss.
+ */
+static void bias_activation_epilogue(struct neural_net *neural_net, int layer, struct workspace *workspace, bool training,
+                                     bool fused_loss)
+{
+    if (neural_net->activation_types[layer] == ACTIVATION_SOFTMAX && fused_loss)
+    {
+        return;
+    }
+    struct matrix *Z = &workspace->Z[layer];
+    struct matrix *A = &workspace->activations[layer + 1];
+    bool derivative = training && neural_net->activation_types[layer] != ACTIVATION_SOFTMAX;
+    struct matrix Z_view = bias_view(neural_net, layer, Z);
+    struct matrix A_view = bias_view(neural_net, layer, A);
+    struct matrix D_view = bias_view(neural_net, layer, &workspace->dCdZ[layer]);
+    PROFILE_BEGIN(epilogue);
+    bias_activation(&Z_view, neural_net->biases[layer], neural_net->activation_types[layer], &A_view,
+                    derivative ? &D_view : NULL);
+    PROFILE_END(neural_net->profile, layer, PROFILE_BIAS_ACTIVATION, epilogue,
+                (Z->size + Z->rows + (derivative ? Z->size : 0)) * sizeof(float) + A->size * element_size(A->type),
+                Z->size);
+}
+
+/*
+ * activation_gradient
+ *
+ * Turns the activation derivative in a layer's dCdZ into dC/dZ by
+ * multiplying it with dC/dA. A softmax layer's dCdZ already holds dC/dZ.
+ */
+static void activation_gradient(struct neural_net *neural_net, int layer, struct workspace *workspace)
+{
+    if (neural_net->activation_types[layer] == ACTIVATION_SOFTMAX)
+    {
+        return;
+    }
+    struct matrix *dCdZ = &workspace->dCdZ[layer];
+    PROFILE_BEGIN(activation_gradient);
+    hadamard_product(dCdZ, &workspace->dCdA[layer]);
+    PROFILE_END(neural_net->profile, layer, PROFILE_ACTIVATION_GRADIENT, activation_gradient,
+                3 * dCdZ->size * sizeof(float), dCdZ->size);
+}
+
+// Stores the row sums of dC/dZ, seen with one row per bias, as the bias gradient.
+static void bias_gradient(struct neural_net *neural_net, int layer, struct matrix *dZ, struct gradients *gradients)
+{
+    PROFILE_BEGIN(bias_gradient);
+    float *dCdB = gradients->biases[layer]->entries;
+    for (int row = 0; row < dZ->rows; ++row)
+    {
+        float sum = 0;
+        for (int col = 0; col < dZ->cols; ++col)
+        {
+            sum += dZ->entries[row * dZ->cols + col];
+        }
+        dCdB[row] = sum;
+    }
+    PROFILE_END(neural_net->profile, layer, PROFILE_BIAS_GRADIENT, bias_gradient, (dZ->size + dZ->rows) * sizeof(float),
+                dZ->size);
+}
+
+static void dense_workspace_size(struct neural_net *neural_net, int layer, struct layer_buffers *buffers)
+{
+    *buffers = (struct layer_buffers){neural_net->layers[layer + 1], 0, 0, false};
+}
+
+/*
+ * dense_forward
+ *
+ * Z = W * input, as a sparse product for sufficiently pruned layers (see
+ * layer_sparse), then the epilogue.
+ */
+static void dense_forward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                          bool training, bool fused_loss)
+{
+    struct matrix *Z = &workspace->Z[layer];
+    struct matrix *W = layer_weights(neural_net, layer);
+    struct sparse_matrix *sparse = layer_sparse(neural_net, layer, input);
+    PROFILE_BEGIN(product);
+    if (sparse != NULL)
+    {
+        spmm(sparse, input, Z);
+    }
+    else
+    {
+        mat_mult_into(W, input, Z);
+    }
+    PROFILE_END(neural_net->profile, layer, PROFILE_FORWARD_GEMM, product,
+                ((sparse != NULL) ? sparse_matrix_bytes(sparse) : W->size * element_size(W->type)) +
+                    input->size * element_size(input->type) + Z->size * sizeof(float),
+                2.0 * Z->cols * ((sparse != NULL) ? (double)sparse->num_blocks * sparse->block_rows : W->size));
+    bias_activation_epilogue(neural_net, layer, workspace, training, fused_loss);
+}
+
+static void dense_backward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                           struct gradients *gradients)
+{
+    struct matrix *dCdZ = &workspace->dCdZ[layer];
+    activation_gradient(neural_net, layer, workspace);
+
+    PROFILE_BEGIN(weight_gradient);
+    gemm(false, true, 1.0f, dCdZ, input, 0.0f, gradients->weights[layer]);
+    PROFILE_END(neural_net->profile, layer, PROFILE_WEIGHT_GRADIENT, weight_gradient,
+                (dCdZ->size + gradients->weights[layer]->size) * sizeof(float) + input->size * element_size(input->type),
+                2.0 * gradients->weights[layer]->size * dCdZ->cols);
+    bias_gradient(neural_net, layer, dCdZ, gradients);
+
+    if (layer != 0)
+    {
+        struct matrix *W = layer_weights(neural_net, layer);
+        struct matrix *dCdA = &workspace->dCdA[layer - 1];
+        PROFILE_BEGIN(input_gradient);
+        gemm(true, false, 1.0f, W, dCdZ, 0.0f, dCdA);
+        PROFILE_END(neural_net->profile, layer, PROFILE_INPUT_GRADIENT, input_gradient,
+                    W->size * element_size(W->type) + (dCdZ->size + dCdA->size) * sizeof(float),
+                    2.0 * dCdZ->size * W->cols);
+    }
+}
+
+/*
+ * conv_workspace_size
+ *
+ * A convolution also needs its input lowered by im2col, taps x positions
+ * per sample. The forward pass only writes it when it goes through im2col;
+ * on the direct path the backward pass makes it for the weight gradient.
+ */
+static void conv_workspace_size(struct neural_net *neural_net, int layer, struct layer_buffers *buffers)
+{
+    const struct conv_shape *shape = &neural_net->shapes[layer];
+    *buffers = (struct layer_buffers){neural_net->layers[layer + 1], conv_taps(shape),
+                                      shape->out_height * shape->out_width, !conv_is_direct(shape)};
+}
+
+static void conv_forward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                         bool training, bool fused_loss)
+{
+    struct matrix *Z = &workspace->Z[layer];
+    struct matrix *W = layer_weights(neural_net, layer);
+    PROFILE_BEGIN(product);
+    conv2d(&neural_net->shapes[layer], W, input, &workspace->columns[layer], Z);
+    PROFILE_END(neural_net->profile, layer, PROFILE_FORWARD_GEMM, product,
+                W->size * element_size(W->type) + input->size * element_size(input->type) + Z->size * sizeof(float),
+                2.0 * Z->size * W->cols);
+    bias_activation_epilogue(neural_net, layer, workspace, training, fused_loss);
+}
+
+/*
+ * conv_backward
+ *
+ * The weight gradient is the product of dC/dZ, one row per filter, with the
+ * lowered input. The gradient with respect to the lowered input then takes
+ * its buffer, and col2im folds it back onto the images.
+ */
+static void conv_backward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                          struct gradients *gradients)
+{
+    const struct conv_shape *shape = &neural_net->shapes[layer];
+    activation_gradient(neural_net, layer, workspace);
+    struct matrix dZ = bias_view(neural_net, layer, &workspace->dCdZ[layer]);
+    struct matrix *columns = &workspace->columns[layer];
+
+    PROFILE_BEGIN(weight_gradient);
+    if (conv_is_direct(shape))
+    {
+        im2col(shape, input, columns);
+    }
+    gemm(false, true, 1.0f, &dZ, columns, 0.0f, gradients->weights[layer]);
+    PROFILE_END(neural_net->profile, layer, PROFILE_WEIGHT_GRADIENT, weight_gradient,
+                (dZ.size + gradients->weights[layer]->size) * sizeof(float) + input->size * element_size(input->type),
+                2.0 * gradients->weights[layer]->size * dZ.cols);
+    bias_gradient(neural_net, layer, &dZ, gradients);
+
+    if (layer != 0)
+    {
+        struct matrix *W = layer_weights(neural_net, layer);
+        struct matrix *dCdA = &workspace->dCdA[layer - 1];
+        PROFILE_BEGIN(input_gradient);
+        gemm(true, false, 1.0f, W, &dZ, 0.0f, columns);
+        col2im(shape, columns, dCdA);
+        PROFILE_END(neural_net->profile, layer, PROFILE_INPUT_GRADIENT, input_gradient,
+                    W->size * element_size(W->type) + (dZ.size + dCdA->size) * sizeof(float),
+                    2.0 * dZ.size * W->cols);
+    }
+}
+
+static void pool_workspace_size(struct neural_net *neural_net, int layer, struct layer_buffers *buffers)
+{
+    (void)neural_net;
+    (void)layer;
+    *buffers = (struct layer_buffers){0, 0, 0, false};
+}
+
+static void pool_forward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                         bool training, bool fused_loss)
+{
+    (void)training;
+    (void)fused_loss;
+    const struct conv_shape *shape = &neural_net->shapes[layer];
+    struct matrix *A = &workspace->activations[layer + 1];
+    PROFILE_BEGIN(product);
+    max_pool(shape, input, A);
+    PROFILE_END(neural_net->profile, layer, PROFILE_FORWARD_GEMM, product,
+                (input->size + A->size) * sizeof(float), (size_t)A->size * shape->kernel * shape->kernel);
+}
+
+static void pool_backward(struct neural_net *neural_net, int layer, struct workspace *workspace, struct matrix *input,
+                          struct gradients *gradients)
+{
+    (void)gradients;
+    if (layer == 0)
+    {
+        return;
+    }
+    const struct conv_shape *shape = &neural_net->shapes[layer];
+    struct matrix *gradient = &workspace->dCdA[layer];
+    PROFILE_BEGIN(input_gradient);
+    max_pool_backward(shape, input, gradient, &workspace->dCdA[layer - 1]);
+    PROFILE_END(neural_net->profile, layer, PROFILE_INPUT_GRADIENT, input_gradient,
+                (2 * input->size + gradient->size) * sizeof(float),
+                (size_t)gradient->size * shape->kernel * shape->kernel);
+}
+
+static const struct layer_ops layer_ops[] = {
+    [LAYER_DENSE] = {dense_workspace_size, dense_forward, dense_backward},
+    [LAYER_CONV2D] = {conv_workspace_size, conv_forward, conv_backward},
+    [LAYER_MAX_POOL] = {pool_workspace_size, pool_forward, pool_backward},
+};
+
+
+/*
+ * Steps of a training pass, in order, for the lifetimes of workspace views:
+ * step 0 copies the batch in, then come the forward step of every layer, the
+ * loss, and the backward step of every layer from the last. Evaluation runs
+ * a prefix of them.
+ */
+static int forward_step(int layer)
+{
+    return 1 + layer;
+}
+
+static int loss_step(struct neural_net *neural_net)
+{
+    return neural_net->num_layers;
+}
+
+static int backward_step(struct neural_net *neural_net, int layer)
+{
+    return 2 * neural_net->num_layers - 1 - layer;
+}
+
+// A workspace view with the steps it is live in, from the first that writes
+// it to the last that reads it.
+struct planned_view {
+    struct matrix *view;
+    size_t bytes;       // Rounded up to 64
+    int first;
+    int last;
+    size_t offset;      // Set by plan_views
+};
+
+/*
+ * plan_views
+ *
+ * Assigns each view an offset in the arena so that views live at the same
+ * step never overlap, while views whose lifetimes are disjoint may share
+ * memory. Views are placed from the largest down, each at the lowest offset
+ * clear of the views already placed that it coexists with.
+ *
+ * Returns:
+ * The number of bytes the arena needs.
+ */
+static size_t plan_views(int count, struct planned_view *views)
+{
+    int order[count];
+    for (int i = 0; i < count; ++i)
+    {
+        int j = i;
+        for (; j > 0 && views[order[j - 1]].bytes < views[i].bytes; --j)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    size_t size = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        struct planned_view *view = &views[order[i]];
+        view->offset = 0;
+        // Stepping past a conflicting view skips only offsets that overlap
+        // it, so this ends at the lowest free offset.
+        bool moved = view->bytes > 0;
+        while (moved)
+        {
+            moved = false;
+            for (int j = 0; j < i; ++j)
+            {
+                struct planned_view *placed = &views[order[j]];
+                bool coexist = placed->first <= view->last && view->first <= placed->last;
+                bool overlap = placed->offset < view->offset + view->bytes && view->offset < placed->offset + placed->bytes;
+                if (coexist && overlap)
+                {
+                    view->offset = placed->offset + placed->bytes;
+                    moved = true;
+                }
+            }
+        }
+        size = (view->offset + view->bytes > size) ? view->offset + view->bytes : size;
+    }
+    return size;
+}
+
+/*
+ * layout_workspace
+ *
+ * Gives every workspace view its shape and format, and lists it with its
+ * lifetime for plan_views. Hidden activations use the format given by
+ * hidden_type; everything else is fp32. The views a layer needs besides its
+ * activations and their gradient come from its workspace_size hook.
+ *
+ * Returns:
+ * The number of views listed, at most 5 * num_layers - 3.
+ */
+static int layout_workspace(struct neural_net *neural_net, struct workspace *workspace, struct planned_view *views)
+{
+    int count = 0;
+    int batch_size = workspace->batch_size;
+    int last = neural_net->num_layers - 2;
+
+#define TAKE(view, r, c, t, from, to)                                                                    \
+    do                                                                                                   \
+    {                                                                                                    \
+        (view).rows = (r);                                                                               \
+        (view).cols = (c);                                                                               \
+        (view).size = (r) * (c);                                                                         \
+        (view).type = (t);                                                                               \
+        (view).entries = NULL;                                                                           \
+        views[count++] = (struct planned_view){&(view), ((size_t)(view).size * element_size(t) + 63) / 64 * 64, \
+                                               (from), (to), 0};                                         \
+    } while (0)
+
+    TAKE(workspace->activations[0], neural_net->layers[0], batch_size, ELEMENT_FP32, 0, backward_step(neural_net, 0));
+    for (int layer = 0; layer <= last; ++layer)
+    {
+        int rows = neural_net->layers[layer + 1];
+        int forward = forward_step(layer), backward = backward_step(neural_net, layer);
+        struct layer_buffers buffers;
+        layer_ops[neural_net->layer_types[layer]].workspace_size(neural_net, layer, &buffers);
+        // The output layer's weighted input and activations are read by the
+        // loss, and its activation gradient is written there.
+        TAKE(workspace->Z[layer], buffers.weighted_rows, batch_size, ELEMENT_FP32, forward,
+             (layer == last) ? loss_step(neural_net) : forward);
+        TAKE(workspace->activations[layer + 1], rows, batch_size, hidden_type(neural_net, layer), forward,
+             (layer == last) ? loss_step(neural_net) : backward_step(neural_net, layer + 1));
+        TAKE(workspace->dCdZ[layer], buffers.weighted_rows, batch_size, ELEMENT_FP32, forward, backward);
+        TAKE(workspace->dCdA[layer], rows, batch_size, ELEMENT_FP32,
+             (layer == last) ? loss_step(neural_net) : backward_step(neural_net, layer + 1), backward);
+        TAKE(workspace->columns[layer], buffers.column_rows, buffers.column_cols * batch_size, ELEMENT_FP32,
+             buffers.forward_columns ? forward : backward, backward);
+    }
+    TAKE(workspace->expected, neural_net->layers[last + 1], batch_size, ELEMENT_FP32, 0, loss_step(neural_net));
+
+#undef TAKE
+    return count;
+}
+
+/*
+ * construct_workspace
+ *
+ * Constructs a workspace for passes of up to batch_size samples. The views
+ * are planned once, here, from their lifetimes over a training pass, so
+ * intermediates that are never needed at the same time share memory; a
+ * forward pass alone leaves every layer's activations intact.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * batch_size: The largest number of columns the workspace will be used with.
+ *
+ * Returns:
+ * A pointer to the newly constructed workspace.
+ *
+ * Side effects:
+ * Allocates the view arrays and one arena for all intermediates.
+ */
+struct workspace *construct_workspace(struct neural_net *neural_net, int batch_size)
+{
+    int layers = neural_net->num_layers;
+    struct workspace *workspace = malloc(sizeof(struct workspace));
+    workspace->batch_size = batch_size;
+    workspace->Z = malloc((5 * layers - 4) * sizeof(struct matrix));
+    workspace->activations = workspace->Z + (layers - 1);
+    workspace->dCdZ = workspace->activations + layers;
+    workspace->dCdA = workspace->dCdZ + (layers - 1);
+    workspace->columns = workspace->dCdA + (layers - 1);
+
+    struct planned_view views[5 * layers - 3];
+    int count = layout_workspace(neural_net, workspace, views);
+    workspace->arena_size = plan_views(count, views);
+    workspace->arena = aligned_alloc(64, (workspace->arena_size > 0) ? workspace->arena_size : 64);
+    for (int i = 0; i < count; ++i)
+    {
+        views[i].view->entries = (float *)((char *)workspace->arena + views[i].offset);
+    }
+    return workspace;
+}
+
+/*
+ * destruct_workspace
+ *
+ * Deallocates a workspace made by construct_workspace.
+ */
+void destruct_workspace(struct workspace *workspace)
+{
+    free(workspace->arena);
+    free(workspace->Z);
+    free(workspace);
+}
+
+/*
+ * bind_workspace
+ *
+ * Resizes the batch-dependent views of a workspace to cols columns, which
+ * must not exceed its capacity.
+ */
+static void bind_workspace(struct neural_net *neural_net, struct workspace *workspace, int cols)
+{
+    assert(cols <= workspace->batch_size);
+    struct matrix *views[] = {workspace->Z, workspace->activations + 1, workspace->dCdZ, workspace->dCdA};
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+        {
+            views[i][layer].cols = cols;
+            views[i][layer].size = views[i][layer].rows * cols;
+        }
+    }
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        struct layer_buffers buffers;
+        layer_ops[neural_net->layer_types[layer]].workspace_size(neural_net, layer, &buffers);
+        struct matrix *columns = &workspace->columns[layer];
+        columns->cols = buffers.column_cols * cols;
+        columns->size = columns->rows * columns->cols;
+    }
+    workspace->activations[0].cols = cols;
+    workspace->activations[0].size = workspace->activations[0].rows * cols;
+    workspace->expected.cols = cols;
+    workspace->expected.size = workspace->expected.rows * cols;
+}
+
+/*
+ * reserve_shards
+ *
+ * Makes sure the network owns at least count workspaces, each holding at
+ * least batch_size columns. Workspaces are kept across calls, so steady-state
+ * passes do not reallocate them. Inference needs nothing else; training also
+ * calls reserve_gradients.
+ */
+static void reserve_shards(struct neural_net *neural_net, int count, int batch_size)
+{
+    if (count > neural_net->num_shards)
+    {
+        neural_net->workspaces = realloc(neural_net->workspaces, count * sizeof(struct workspace *));
+        for (int i = neural_net->num_shards; i < count; ++i)
+        {
+            neural_net->workspaces[i] = construct_workspace(neural_net, batch_size);
+        }
+        neural_net->num_shards = count;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (neural_net->workspaces[i]->batch_size < batch_size)
+        {
+            destruct_workspace(neural_net->workspaces[i]);
+            neural_net->workspaces[i] = construct_workspace(neural_net, batch_size);
+        }
+    }
+}
+
+/*
+ * reserve_gradients
+ *
+ * Makes sure the network owns at least count gradient buffers, one per
+ * training shard. Like the workspaces they are kept across calls.
+ */
+static void reserve_gradients(struct neural_net *neural_net, int count)
+{
+    if (count > neural_net->num_gradients)
+    {
+        neural_net->gradients = realloc(neural_net->gradients, count * sizeof(struct gradients *));
+        for (int i = neural_net->num_gradients; i < count; ++i)
+        {
+            neural_net->gradients[i] = construct_gradients(neural_net);
+        }
+        neural_net->num_gradients = count;
+    }
+}
+
+
+/*
+ * forward
+ *
+ * Runs the forward pass through each layer's forward hook, leaving the
+ * activations of every layer in the workspace. When training the layers also
+ * store their activation derivatives in dCdZ; with fused_loss a softmax output
+ * layer stops after its product, because output_loss computes the
+ * probabilities together with the loss.
+ */
+static void forward(struct neural_net *neural_net, struct workspace *workspace, struct matrix *in_data, bool training,
+                    bool fused_loss)
+{
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        layer_ops[neural_net->layer_types[layer]].forward(neural_net, layer, workspace,
+                                                          layer_input(workspace, in_data, layer), training, fused_loss);
+    }
+}
+
+/*
+ * output_loss
+ *
+ * Computes the loss of the outputs of a forward pass run with fused_loss, and
+ * counts the samples by expected and predicted class, in one pass over the
+ * output layer.
+ * With a softmax output it also computes the probabilities, and the loss is
+ * the cross-entropy; otherwise it is the squared error.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * workspace: The workspace of the forward pass.
+ * expected: A pointer to the expected outputs, one sample per column.
+ * training: Whether to also store the gradient that starts the backward pass:
+ *           dC/dZ of the output layer in dCdZ with softmax, dC/dA in dCdA
+ *           otherwise.
+ * confusion: The confusion matrix to add the batch to (see struct
+ *            evaluation), or NULL.
+ *
+ * Returns:
+ * The loss summed over the batch.
+ */
+static float output_loss(struct neural_net *neural_net, struct workspace *workspace, struct matrix *expected,
+                         bool training, int *confusion)
+{
+    int last = neural_net->num_layers - 2;
+    struct matrix *A = &workspace->activations[last + 1];
+    float loss;
+    PROFILE_BEGIN(output_error);
+    if (softmax_output(neural_net))
+    {
+        loss = softmax_cross_entropy(&workspace->Z[last], neural_net->biases[last], expected, A,
+                                     training ? &workspace->dCdZ[last] : NULL, confusion);
+    }
+    else
+    {
+        loss = squared_error(A, expected, training ? &workspace->dCdA[last] : NULL, confusion);
+    }
+    PROFILE_END(neural_net->profile, last, PROFILE_OUTPUT_ERROR, output_error,
+                (3 + (training ? 1 : 0)) * A->size * sizeof(float), 3 * A->size);
+    return loss;
+}
+
+/*
+ * eval_workspace
+ *
+ * Evaluates the neural network with the given input data using a caller-owned
+ * workspace.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * workspace: A workspace with capacity for at least in_data->cols samples.
+ * in_data: A pointer to the input data matrix.
+ *
+ * Returns:
+ * A pointer to the output matrix, which lives in the workspace and is valid
+ * until the workspace is used again.
+ *
+ * Side effects:
+ * None; no memory is allocated.
+ */
+struct matrix *eval_workspace(struct neural_net *neural_net, struct workspace *workspace, struct matrix *in_data)
+{
+    bind_workspace(neural_net, workspace, in_data->cols);
+    forward(neural_net, workspace, in_data, false, false);
+    return &workspace->activations[neural_net->num_layers - 1];
+}
+
+/*
+ * eval
+ *
+ * Evaluates the neural network with the given input data.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * in_data: A pointer to the input data matrix.
+ *
+ * Returns:
+ * A pointer to the output matrix.
+ *
+ * Side effects:
+ * Allocates the output matrix. Intermediates live in the network's workspace,
+ * which grows if in_data has more columns than it has seen before.
+ */
+struct matrix *eval(struct neural_net *neural_net, struct matrix *in_data)
+{
+    reserve_shards(neural_net, 1, in_data->cols);
+    return copy_matrix(eval_workspace(neural_net, neural_net->workspaces[0], in_data));
+}
+
+/*
+ * construct_evaluation
+ *
+ * Allocates the results of evaluate for a network with num_classes outputs.
+ *
+ * Returns:
+ * A pointer to the results, all zero.
+ *
+ * Side effects:
+ * Allocates the results and their confusion matrix.
+ */
+struct evaluation *construct_evaluation(int num_classes)
+{
+    struct evaluation *evaluation = malloc(sizeof(struct evaluation));
+    evaluation->num_classes = num_classes;
+    evaluation->samples = 0;
+    evaluation->correct = 0;
+    evaluation->loss = 0.0f;
+    evaluation->confusion = calloc((size_t)num_classes * num_classes, sizeof(int));
+    return evaluation;
+}
+
+void destruct_evaluation(struct evaluation *evaluation)
+{
+    free(evaluation->confusion);
+    free(evaluation);
+}
+
+struct evaluate_job {
+    struct neural_net *neural_net;
+    struct matrix *in_data;
+    struct matrix *expected;
+    int num_chunks;
+    int num_shards;
+    float *losses;   // One per shard
+    int *confusions; // One confusion matrix per shard
+};
+
+/*
+ * evaluate_task
+ *
+ * Runs every num_shards-th chunk of the set, starting at chunk shard, through
+ * the shard's workspace and accumulates the loss and confusion counts of the
+ * shard. The assignment of chunks to shards is fixed, so the result does not
+ * depend on thread timing.
+ */
+static void evaluate_task(int shard, void *arg)
+{
+    struct evaluate_job *job = arg;
+    struct neural_net *neural_net = job->neural_net;
+    struct workspace *workspace = neural_net->workspaces[shard];
+    int classes = job->expected->rows;
+    int *confusion = job->confusions + (size_t)shard * classes * classes;
+    float loss = 0.0f;
+    for (int chunk = shard; chunk < job->num_chunks; chunk += job->num_shards)
+    {
+        int start = chunk * EVALUATION_CHUNK;
+        int end = (job->in_data->cols - start < EVALUATION_CHUNK) ? job->in_data->cols : start + EVALUATION_CHUNK;
+        bind_workspace(neural_net, workspace, end - start);
+        slice_col_into(job->in_data, start, end, &workspace->activations[0]);
+        slice_col_into(job->expected, start, end, &workspace->expected);
+        forward(neural_net, workspace, &workspace->activations[0], false, true);
+        loss += output_loss(neural_net, workspace, &workspace->expected, false, confusion);
+    }
+    job->losses[shard] = loss;
+}
+
+/*
+ * evaluate
+ *
+ * Measures the network on a labelled set. The set is streamed through chunks
+ * of EVALUATION_CHUNK samples spread over the thread pool, each shard reusing
+ * one workspace of that size, so memory does not grow with the set. The loss
+ * and the argmax of every sample are computed in one pass over the output
+ * layer, which also fills the confusion matrix; no output matrix is made.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * in_data: A pointer to the inputs, one sample per column.
+ * expected: A pointer to the expected outputs, one sample per column. The
+ *           expected class of a sample is the row of its largest value.
+ * evaluation: Receives the results; its number of classes must match the
+ *             network's outputs.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Overwrites the results. Uses the network's shard workspaces, allocating
+ * them on first use.
+ */
+void evaluate(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, struct evaluation *evaluation)
+{
+    int classes = evaluation->num_classes;
+    assert((expected->rows == classes) && (neural_net->layers[neural_net->num_layers - 1] == classes));
+    assert((in_data->rows == neural_net->layers[0]) && (expected->cols == in_data->cols));
+    int num_chunks = (in_data->cols + EVALUATION_CHUNK - 1) / EVALUATION_CHUNK;
+    int num_shards = (get_num_threads() < num_chunks) ? get_num_threads() : num_chunks;
+
+    memset(evaluation->confusion, 0, (size_t)classes * classes * sizeof(int));
+    evaluation->samples = in_data->cols;
+    evaluation->correct = 0;
+    evaluation->loss = 0.0f;
+    if (num_chunks == 0)
+    {
+        return;
+    }
+    int chunk = (in_data->cols < EVALUATION_CHUNK) ? in_data->cols : EVALUATION_CHUNK;
+    reserve_shards(neural_net, num_shards, chunk);
+
+    float losses[num_shards];
+    int *confusions = calloc((size_t)num_shards * classes * classes, sizeof(int));
+    struct evaluate_job job = {neural_net, in_data, expected, num_chunks, num_shards, losses, confusions};
+    parallel_for(num_shards, evaluate_task, &job);
+
+    for (int shard = 0; shard < num_shards; ++shard)
+    {
+        evaluation->loss += losses[shard];
+        for (int i = 0; i < classes * classes; ++i)
+        {
+            evaluation->confusion[i] += confusions[(size_t)shard * classes * classes + i];
+        }
+    }
+    for (int class = 0; class < classes; ++class)
+    {
+        evaluation->correct += evaluation->confusion[class * classes + class];
+    }
+    free(confusions);
+}
+
+/*
+ * construct_single_plan
+ *
+ * Allocates the packed weights and ping-pong vectors used by eval_single.
+ * The panels are filled in by eval_single, which repacks them whenever they
+ * are stale.
+ */
+static struct single_plan *construct_single_plan(struct neural_net *neural_net)
+{
+    struct single_plan *single = malloc(sizeof(struct single_plan));
+    single->offsets = malloc((neural_net->num_layers - 1) * sizeof(size_t));
+    size_t size = 0;
+    int width = 1;
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        single->offsets[layer] = size;
+        size += (gemv_panel_size(neural_net->layers[layer + 1], neural_net->layers[layer]) + 15) / 16 * 16;
+        if (layer < neural_net->num_layers - 2 && neural_net->layers[layer + 1] > width)
+        {
+            width = neural_net->layers[layer + 1];
+        }
+    }
+    single->panels = aligned_alloc(64, size * sizeof(float));
+    size_t vector = ((size_t)width + 15) / 16 * 16;
+    single->ping = aligned_alloc(64, 2 * vector * sizeof(float));
+    single->pong = single->ping + vector;
+    single->stale = true;
+    return single;
+}
+
+/*
+ * eval_single
+ *
+ * Evaluates the network on one sample with a chain of fused matrix-vector
+ * products, one per layer, for callers that need low latency rather than
+ * throughput. Hidden activations alternate between two vectors owned by the
+ * network, and the last layer writes straight into the caller's buffer.
+ * Uses the fp32 master weights whatever the network's precision. Networks
+ * with convolution or pooling layers run the batched forward pass on a
+ * one-column view of the input instead.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * input: The sample's layers[0] features, contiguous.
+ * output: Where the layers[num_layers - 1] outputs are written.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * The first call allocates the packed weights and scratch vectors, and the
+ * first call after a training step repacks the weights; otherwise nothing is
+ * allocated. Runs on the calling thread, and like eval it must not be called
+ * concurrently on the same network.
+ */
+void eval_single(struct neural_net *neural_net, const float *input, float *output)
+{
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            struct matrix column = {.rows = neural_net->layers[0], .cols = 1, .size = neural_net->layers[0],
+                                    .entries = (float *)input, .type = ELEMENT_FP32};
+            reserve_shards(neural_net, 1, 1);
+            struct matrix *out = eval_workspace(neural_net, neural_net->workspaces[0], &column);
+            memcpy(output, out->entries, out->size * sizeof(float));
+            return;
+        }
+    }
+    if (neural_net->single == NULL)
+    {
+        neural_net->single = construct_single_plan(neural_net);
+    }
+    struct single_plan *single = neural_net->single;
+    if (single->stale)
+    {
+        for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+        {
+            pack_gemv(neural_net->weights[layer], single->panels + single->offsets[layer]);
+        }
+        single->stale = false;
+    }
+
+    const float *x = input;
+    float *buffers[2] = {single->ping, single->pong};
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        float *y = (layer == neural_net->num_layers - 2) ? output : buffers[layer % 2];
+        gemv_packed(neural_net->layers[layer + 1], neural_net->layers[layer], single->panels + single->offsets[layer],
+                    neural_net->biases[layer]->entries, neural_net->activation_types[layer], x, y);
+        x = y;
+    }
+}
+
+/*
+ * compute_gradients
+ *
+ * Runs the forward and backward passes for a batch and stores the gradient of
+ * the cost, summed over the batch, without touching the network's parameters.
+ * The cost is the cross-entropy for a softmax output layer and the squared
+ * error otherwise.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * workspace: A workspace with capacity for at least in_data->cols samples.
+ * in_data: A pointer to the input batch, one sample per column.
+ * expected: A pointer to the expected outputs, one sample per column.
+ * gradients: Where the weight and bias gradients are written.
+ *
+ * Returns:
+ * The cost of the batch.
+ *
+ * Side effects:
+ * Overwrites gradients and the workspace; no memory is allocated.
+ */
+float compute_gradients(struct neural_net *neural_net, struct workspace *workspace, struct matrix *in_data, struct matrix *expected, struct gradients *gradients)
+{
+    int last = neural_net->num_layers - 2;
+    bind_workspace(neural_net, workspace, in_data->cols);
+    forward(neural_net, workspace, in_data, true, true);
+    float cost = output_loss(neural_net, workspace, expected, true, NULL);
+
+    for (int layer = last; layer >= 0; --layer)
+    {
+        layer_ops[neural_net->layer_types[layer]].backward(neural_net, layer, workspace,
+                                                           layer_input(workspace, in_data, layer), gradients);
+    }
+
+    return cost;
+}
+
+/*
+ * apply_gradients
+ *
+ * Takes one optimizer step. Without an optimizer every parameter moves by
+ * -learning_rate times its gradient in one pass over the parameter buffer;
+ * otherwise the network's optimizer updates all the weights and then all the
+ * biases in one fused pass each, with weight decay applied to the weights
+ * only.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * gradients: A pointer to the gradients, as produced by compute_gradients.
+ * learning_rate: The step size.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Updates the network's weights and biases and the optimizer state in place,
+ * zeroes the pruned weights again and refreshes the sparse forms of pruned
+ * layers, refreshes the reduced-precision copies of the weights if there are
+ * any, and marks the weights packed for eval_single as stale.
+ */
+void apply_gradients(struct neural_net *neural_net, struct gradients *gradients, float learning_rate)
+{
+    struct optimizer *optimizer = neural_net->optimizer;
+    struct matrix *parameters = &neural_net->parameters;
+    PROFILE_BEGIN(update);
+    if (optimizer != NULL)
+    {
+        struct optimizer_step step = optimizer_begin_step(optimizer, learning_rate);
+        int split = neural_net->biases_offset;
+        struct matrix weights, biases, weight_gradients, bias_gradients;
+        set_view(&weights, split, 1, parameters->entries);
+        set_view(&biases, parameters->size - split, 1, parameters->entries + split);
+        set_view(&weight_gradients, split, 1, gradients->all.entries);
+        set_view(&bias_gradients, parameters->size - split, 1, gradients->all.entries + split);
+        optimizer_update(optimizer, &step, 0, true, &weight_gradients, &weights);
+        optimizer_update(optimizer, &step, 1, false, &bias_gradients, &biases);
+    }
+    else
+    {
+        matrix_axpy(-learning_rate, &gradients->all, parameters);
+    }
+    PROFILE_END(neural_net->profile, 0, PROFILE_WEIGHT_UPDATE, update,
+                (3 + 2 * ((optimizer != NULL) ? optimizer->num_moments : 0)) * parameters->size * sizeof(float),
+                2 * parameters->size);
+    if (neural_net->sparse_weights != NULL)
+    {
+        for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+        {
+            if (neural_net->sparse_weights[layer] != NULL)
+            {
+                PROFILE_BEGIN(mask);
+                sparse_refresh(neural_net->sparse_weights[layer], neural_net->weights[layer]);
+                PROFILE_END(neural_net->profile, layer, PROFILE_WEIGHT_UPDATE, mask,
+                            neural_net->weights[layer]->size * sizeof(float) +
+                                sparse_matrix_bytes(neural_net->sparse_weights[layer]), 0);
+            }
+        }
+    }
+    if (neural_net->reduced_weights != NULL)
+    {
+        for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+        {
+            PROFILE_BEGIN(convert);
+            copy_matrix_into(neural_net->weights[layer], neural_net->reduced_weights[layer]);
+            PROFILE_END(neural_net->profile, layer, PROFILE_WEIGHT_UPDATE, convert,
+                        neural_net->weights[layer]->size * (sizeof(float) + element_size(neural_net->weight_type)), 0);
+        }
+    }
+    if (neural_net->single != NULL)
+    {
+        neural_net->single->stale = true;
+    }
+}
+
+/*
+ * back_propagate
+ *
+ * Trains the network on one batch with a single optimizer step (see
+ * apply_gradients).
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * in_data: A pointer to the input batch, one sample per column.
+ * expected: A pointer to the expected outputs, one sample per column.
+ * learning_rate: The step size.
+ *
+ * Returns:
+ * The cost of the batch before the update.
+ *
+ * Side effects:
+ * Updates the network's weights and biases in place. Only allocates when the
+ * batch is larger than any seen before.
+ */
+float back_propagate(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, float learning_rate)
+{
+    reserve_shards(neural_net, 1, in_data->cols);
+    reserve_gradients(neural_net, 1);
+    float cost = compute_gradients(neural_net, neural_net->workspaces[0], in_data, expected, neural_net->gradients[0]);
+    apply_gradients(neural_net, neural_net->gradients[0], learning_rate);
+    return cost;
+}
+
+struct shard_job {
+    struct neural_net *neural_net;
+    struct matrix *in_data;
+    struct matrix *expected;
+    int num_shards;
+    float *costs;
+    int stride; // Distance between the buffers combined in a reduction round
+};
+
+static void shard_range(struct shard_job *job, int shard, int *start, int *end)
+{
+    int cols = job->in_data->cols;
+    *start = (int)((long)cols * shard / job->num_shards);
+    *end = (int)((long)cols * (shard + 1) / job->num_shards);
+}
+
+static void shard_task(int shard, void *arg)
+{
+    struct shard_job *job = arg;
+    struct workspace *workspace = job->neural_net->workspaces[shard];
+    int start, end;
+    shard_range(job, shard, &start, &end);
+    bind_workspace(job->neural_net, workspace, end - start);
+    slice_col_into(job->in_data, start, end, &workspace->activations[0]);
+    slice_col_into(job->expected, start, end, &workspace->expected);
+    job->costs[shard] = compute_gradients(job->neural_net, workspace, &workspace->activations[0], &workspace->expected, job->neural_net->gradients[shard]);
+}
+static void reduce_task(int index, void *arg)
+{
+    struct shard_job *job = arg;
+    int target = index * 2 * job->stride;
+    int source = target + job->stride;
+    if (source >= job->num_shards)
+    {
+        return;
+    }
+    struct gradients *into = job->neural_net->gradients[target];
+    struct gradients *from = job->neural_net->gradients[source];
+    PROFILE_BEGIN(reduce);
+    matrix_add(&into->all, &from->all);
+    PROFILE_END(job->neural_net->profile, 0, PROFILE_GRADIENT_REDUCE, reduce, 3 * into->all.size * sizeof(float),
+                into->all.size);
+}
+
+/*
+ * back_propagate_parallel
+ *
+ * Trains the network on one batch with a single optimizer step, like
+ * back_propagate, but splits the batch column-wise into shards that run their
+ * forward and backward passes on the thread pool. Each shard writes into its
+ * own gradient buffer; the buffers are then summed pairwise in a tree before
+ * the one update, so the result matches back_propagate up to rounding.
+ *
+ * Parameters:
+ * neural_net: A pointer to the neural network.
+ * in_data: A pointer to the input batch, one sample per column.
+ * expected: A pointer to the expected outputs, one sample per column.
+ * learning_rate: The step size.
+ * num_shards: The number of shards, usually get_num_threads(). It is capped
+ *             at the batch size.
+ *
+ * Returns:
+ * The cost of the batch before the update.
+ *
+ * Side effects:
+ * Updates the network's weights and biases in place.
+ */
+float back_propagate_parallel(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, float learning_rate, int num_shards)
+{
+    if (num_shards > in_data->cols)
+    {
+        num_shards = in_data->cols;
+    }
+    if (num_shards <= 1)
+    {
+        return back_propagate(neural_net, in_data, expected, learning_rate);
+    }
+    reserve_shards(neural_net, num_shards, (in_data->cols + num_shards - 1) / num_shards);
+    reserve_gradients(neural_net, num_shards);
+
+    float costs[num_shards];
+    struct shard_job job = {neural_net, in_data, expected, num_shards, costs, 0};
+    parallel_for(num_shards, shard_task, &job);
+
+    for (job.stride = 1; job.stride < num_shards; job.stride *= 2)
+    {
+        parallel_for((num_shards + 2 * job.stride - 1) / (2 * job.stride), reduce_task, &job);
+    }
+    apply_gradients(neural_net, neural_net->gradients[0], learning_rate);
+
+    float cost = 0;
+    for (int shard = 0; shard < num_shards; ++shard)
+    {
+        cost += costs[shard];
+    }
+    return cost;
+}
@@ -1,21 +1,204 @@
 #ifndef NEURAL_NET_H
 #define NEURAL_NET_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "matrix.h"
+
+#define CHECKPOINT_MAGIC "NNCK"
+#define CHECKPOINT_VERSION 2
+
+/*
+ * On-disk layout of a checkpoint: this 64-byte header, num_layers uint32 layer
+ * sizes, one checkpoint_layer per weight layer, then the row-major float
+ * weights and biases of every layer. Each blob starts on a 64-byte boundary so
+ * a mapped file can be used in place; all values are little endian.
+ * save_neural_net writes the blobs in the order of the parameter buffer (every
+ * weight matrix, then every bias vector), so the whole buffer is a single
+ * write and a single view of the mapping. Version 1 files, whose table
+ * entries end after biases_offset and describe dense layers only, still load.
+ */
+struct checkpoint_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_layers;
+    uint32_t reserved;
+    uint64_t layers_offset;
+    uint64_t table_offset;
+    uint8_t padding[32];
+};
+
+struct checkpoint_layer {
+    char activation[16];    // NUL-terminated activation name, empty for pooling
+    uint64_t weights_offset;
+    uint64_t biases_offset;
+    uint32_t type;          // enum layer_type
+    uint32_t channels;      // Input geometry of convolution and pooling layers, zero for dense ones
+    uint32_t height;
+    uint32_t width;
+    uint32_t kernel;
+    uint32_t stride;
+    uint32_t padding;
+    uint32_t reserved;
+};
+
+// Size of the version 1 table entries.
+#define CHECKPOINT_LAYER_V1_SIZE 32
+
+/*
+ * Cost gradients with respect to every weight and bias matrix of a network.
+ * The per-layer matrices are views into one buffer laid out like the
+ * network's parameters, so whole-model passes can sweep it linearly.
+ */
+struct gradients {
+    struct matrix **weights;
+    struct matrix **biases;
+    struct matrix all;          // Every gradient as one column, padding included
+};
+
+/*
+ * Preallocated intermediates for one forward/backward pass. Every matrix is a
+ * view into a single arena sized from the layer list and a batch capacity, so
+ * a pass that fits the capacity does not allocate. construct_workspace plans
+ * the views by lifetime: views never live at the same step of a training pass
+ * may share memory, so a view only holds its data from the step that writes
+ * it to the last that reads it. The activations survive a forward pass.
+ */
+struct workspace {
+    int batch_size;             // Capacity in columns (samples)
+    float *arena;
+    size_t arena_size;          // Bytes, after sharing
+    struct matrix *Z;           // Weighted inputs before the bias, one per weight layer; empty for pooling
+    struct matrix *activations; // activations[0] holds copied inputs
+    struct matrix *dCdZ;        // Holds the activation derivative after the forward pass; empty for pooling
+    struct matrix *dCdA;
+    struct matrix *columns;     // Inputs of convolution layers lowered by im2col, then their gradient; empty otherwise
+    struct matrix expected;     // Copied expected outputs
+};
+
+/*
+ * State for eval_single: the weights of every layer packed for gemv into one
+ * buffer, and two ping-pong vectors that hold the hidden activations of one
+ * sample.
+ */
+struct single_plan {
+    float *panels;
+    size_t *offsets;    // Start of each layer's panels
+    float *ping;
+    float *pong;
+    bool stale;         // The weights changed since they were packed
+};
+
+// Samples per chunk streamed through a workspace by evaluate.
+#define EVALUATION_CHUNK 512
+
+// Pruned dense layers that keep at most this fraction of their weights run
+// their forward products as spmm instead of gemm.
+#define SPARSE_MAX_DENSITY 0.3f
+
+/*
+ * Results of evaluate on a labelled set. The confusion matrix counts samples
+ * by expected class (row) and predicted class (column), the classes being the
+ * rows of the largest expected and output values; correct is its trace.
+ */
+struct evaluation {
+    int num_classes;
+    int samples;
+    int correct;
+    float loss;         // Summed over the samples: cross-entropy for softmax outputs, squared error otherwise
+    int *confusion;     // num_classes x num_classes, row-major
+};
+
+/*
+ * Kinds of weight layer. A dense layer multiplies its whole input by a
+ * weight matrix. A convolution slides a bank of filters over the input,
+ * seen as images of channels x height x width (see struct conv_shape), and
+ * outputs one image per filter; its weights have one filter per row and its
+ * biases one entry per filter. A max pooling layer downsamples each channel
+ * and has no parameters or activation. All of them read and write one sample
+ * per column, so they chain freely; the output layer must be dense.
+ */
+enum layer_type {
+    LAYER_DENSE,
+    LAYER_CONV2D,
+    LAYER_MAX_POOL
+};
+
+// One layer of a network built by construct_conv_net.
+struct layer_spec {
+    enum layer_type type;
+    int size;               // Outputs of a dense layer, or filters of a convolution
+    int kernel;             // Window width and height of a convolution or pooling layer
+    int stride;
+    int padding;            // Zeros around each side of the input
+    const char *activation; // Ignored for pooling
+};
+
+struct optimizer;
+struct profile_stats;
+
+/*
+ * The weights and biases of a network live in one 64-byte aligned buffer:
+ * every weight matrix in layer order, then every bias vector, each starting on
+ * a 64-byte boundary with zeroed padding in between. weights and biases are
+ * views into it, and parameters views the whole buffer as one column so the
+ * optimizer step, gradient reduction and checkpointing are single sweeps.
+ * Pooling layers have empty weight and bias views.
+ */
 struct neural_net {
     int num_layers;
-    int *layers;
+    int *layers;                       // Size of each layer, channels x height x width for images
+    enum layer_type *layer_types;      // Kind of each weight layer
+    struct conv_shape *shapes;         // Input geometry of convolution and pooling layers
     struct matrix **weights;
     struct matrix **biases;
+    struct matrix parameters;          // Every weight, then every bias, padding included
+    int biases_offset;                 // Start of the first bias vector in parameters
     float (*(*activations))(float);
     float (*(*activations_derivatives))(float);
+    enum activation *activation_types; // Selects the fused kernel for each layer
+    int num_shards;                // Number of shard workspaces allocated so far
+    int num_gradients;             // Number of shard gradient buffers, only made by training
+    struct gradients **gradients;  // One private gradient buffer per data-parallel shard
+    struct workspace **workspaces; // One workspace per data-parallel shard
+    void *mapping;                 // Mapped checkpoint, or NULL
+    size_t mapping_size;
+    enum element_type weight_type;     // Format of the weights used by the products
+    enum element_type activation_type; // Format of the hidden activations in workspaces
+    struct matrix **reduced_weights;   // Copies of weights in weight_type, or NULL for fp32
+    struct sparse_matrix **sparse_weights; // Pattern and values of each pruned layer, or NULL if none is
+    struct single_plan *single;        // Built by the first eval_single, or NULL
+    struct optimizer *optimizer;       // Update rule of apply_gradients, or NULL for plain SGD
+    struct profile_stats *profile;     // Per-layer counters when built with NN_PROFILE, or NULL
 };
 
 // Function declarations
 void print_neural_net(struct neural_net *neural_net);
 float randf(float a, float b);
 struct neural_net *construct_neural_net(int num_layers, int layers[], char **activations);
+struct neural_net *construct_conv_net(int channels, int height, int width, int num_specs, const struct layer_spec specs[]);
 void destruct_neural_net(struct neural_net *neural_net);
+int save_neural_net(struct neural_net *neural_net, const char *path);
+struct neural_net *load_neural_net(const char *path);
+void set_neural_net_precision(struct neural_net *neural_net, enum element_type weight_type, enum element_type activation_type);
+int set_neural_net_optimizer(struct neural_net *neural_net, const char *name);
+void prune_neural_net(struct neural_net *neural_net, float sparsity, int block_rows);
+size_t sparse_weight_bytes(struct neural_net *neural_net);
+struct workspace *construct_workspace(struct neural_net *neural_net, int batch_size);
+void destruct_workspace(struct workspace *workspace);
 struct matrix *eval(struct neural_net *neural_net, struct matrix *in_data);
+struct matrix *eval_workspace(struct neural_net *neural_net, struct workspace *workspace, struct matrix *in_data);
+void eval_single(struct neural_net *neural_net, const float *input, float *output);
+struct evaluation *construct_evaluation(int num_classes);
+void destruct_evaluation(struct evaluation *evaluation);
+void evaluate(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, struct evaluation *evaluation);
+struct gradients *construct_gradients(struct neural_net *neural_net);
+void destruct_gradients(struct neural_net *neural_net, struct gradients *gradients);
+float gradients_norm(struct gradients *gradients);
+float compute_gradients(struct neural_net *neural_net, struct workspace *workspace, struct matrix *in_data, struct matrix *expected, struct gradients *gradients);
+void apply_gradients(struct neural_net *neural_net, struct gradients *gradients, float learning_rate);
 float back_propagate(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, float learning_rate);
+float back_propagate_parallel(struct neural_net *neural_net, struct matrix *in_data, struct matrix *expected, float learning_rate, int num_shards);
 
 #endif // NEURAL_NET_H
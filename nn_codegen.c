@@ -0,0 +1,37 @@
+/*
+ * nn_codegen.c
+ *
+ * Command line tool that compiles a checkpoint written by save_neural_net into
+ * a standalone C source file with a heap-free prediction function.
+ */
+
+#include <stdio.h>
+#include "codegen.h"
+#include "neural_net.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        fprintf(stderr, "usage: %s checkpoint.nn output.c [function]\n", argv[0]);
+        return 2;
+    }
+    const char *name = (argc == 4) ? argv[3] : "predict";
+    struct neural_net *neural_net = load_neural_net(argv[1]);
+    if (neural_net == NULL)
+    {
+        return 1;
+    }
+    int status = generate_neural_net_source(neural_net, argv[2], name, argv[1]);
+    if (status == 0)
+    {
+        printf("%s: %s() for", argv[2], name);
+        for (int layer = 0; layer < neural_net->num_layers; ++layer)
+        {
+            printf("%s%d", (layer == 0) ? " " : "-", neural_net->layers[layer]);
+        }
+        printf("\n");
+    }
+    destruct_neural_net(neural_net);
+    return (status == 0) ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+/*
+ * optimizer.c
+ *
+ * This file implements the update rules that apply_gradients can use in
+ * place of plain gradient descent: SGD with momentum, Adam and AdamW. Each
+ * update is one fused pass over a parameter tensor, its gradient and its
+ * optimizer state, run by the kernels in matrix_kernels.c.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "optimizer.h"
+
+static const char *const optimizer_names[] = {"sgd", "momentum", "adam", "adamw"};
+static const int optimizer_moments[] = {0, 1, 2, 2};
+
+/*
+ * construct_optimizer
+ *
+ * Creates an optimizer by name with the usual hyperparameters: momentum 0.9
+ * for "momentum"; beta1 0.9, beta2 0.999 and epsilon 1e-8 for "adam" and
+ * "adamw"; and weight decay 0.01 for "adamw". They can be changed before the
+ * first step.
+ *
+ * Parameters:
+ * name: "sgd", "momentum", "adam" or "adamw".
+ * num_tensors: The number of parameter tensors it will update.
+ * sizes: The number of entries in each tensor.
+ *
+ * Returns:
+ * A pointer to the optimizer, or NULL if the name is unknown.
+ *
+ * Side effects:
+ * Allocates the optimizer and its zeroed state.
+ */
+struct optimizer *construct_optimizer(const char *name, int num_tensors, const int sizes[])
+{
+    int type = 0;
+    while (type <= OPTIMIZER_ADAMW && strcmp(optimizer_names[type], name) != 0)
+    {
+        ++type;
+    }
+    if (type > OPTIMIZER_ADAMW)
+    {
+        return NULL;
+    }
+
+    struct optimizer *optimizer = malloc(sizeof(struct optimizer));
+    optimizer->type = type;
+    optimizer->beta1 = (type == OPTIMIZER_SGD) ? 0.0f : 0.9f;
+    optimizer->beta2 = 0.999f;
+    optimizer->epsilon = 1e-8f;
+    optimizer->weight_decay = (type == OPTIMIZER_ADAMW) ? 0.01f : 0.0f;
+    optimizer->steps = 0;
+    optimizer->num_tensors = num_tensors;
+    optimizer->offsets = malloc((num_tensors + 1) * sizeof(size_t));
+    optimizer->offsets[0] = 0;
+    for (int tensor = 0; tensor < num_tensors; ++tensor)
+    {
+        optimizer->offsets[tensor + 1] = optimizer->offsets[tensor] + sizes[tensor];
+    }
+    optimizer->num_moments = optimizer_moments[type];
+    size_t floats = optimizer->num_moments * optimizer->offsets[num_tensors];
+    optimizer->state = (floats > 0) ? calloc(floats, sizeof(float)) : NULL;
+    return optimizer;
+}
+
+void destruct_optimizer(struct optimizer *optimizer)
+{
+    free(optimizer->state);
+    free(optimizer->offsets);
+    free(optimizer);
+}
+
+const char *optimizer_name(struct optimizer *optimizer)
+{
+    return optimizer_names[optimizer->type];
+}
+
+/*
+ * optimizer_begin_step
+ *
+ * Counts one more update and computes the scalars it shares across tensors,
+ * including Adam's bias corrections for the new step count.
+ *
+ * Parameters:
+ * optimizer: A pointer to the optimizer.
+ * learning_rate: The step size of this update.
+ *
+ * Returns:
+ * The scalars to pass to optimizer_update for every tensor of this update.
+ *
+ * Side effects:
+ * Increments the step count.
+ */
+struct optimizer_step optimizer_begin_step(struct optimizer *optimizer, float learning_rate)
+{
+    ++optimizer->steps;
+    struct optimizer_step step = {
+        .learning_rate = learning_rate,
+        .beta1 = optimizer->beta1,
+        .beta2 = optimizer->beta2,
+        .epsilon = optimizer->epsilon,
+        .correction1 = 1.0f / (1.0f - powf(optimizer->beta1, (float)optimizer->steps)),
+        .correction2 = 1.0f / (1.0f - powf(optimizer->beta2, (float)optimizer->steps)),
+        .decay = 1.0f - learning_rate * optimizer->weight_decay,
+    };
+    return step;
+}
+
+/*
+ * optimizer_update
+ *
+ * Applies the update rule to one parameter tensor in a single pass.
+ *
+ * Parameters:
+ * optimizer: A pointer to the optimizer.
+ * step: The scalars from optimizer_begin_step.
+ * tensor: The index of the tensor, which selects its state.
+ * decay: Whether weight decay applies to this tensor; biases usually skip it.
+ * gradient: A pointer to the gradient, the same size as the parameters.
+ * parameter: A pointer to the parameters to update.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Updates the parameters and the tensor's optimizer state in place.
+ */
+void optimizer_update(struct optimizer *optimizer, const struct optimizer_step *step, int tensor, bool decay,
+                      struct matrix *gradient, struct matrix *parameter)
+{
+    size_t offset = optimizer->offsets[tensor];
+    size_t block = optimizer->offsets[optimizer->num_tensors];
+    assert((gradient->size == parameter->size) && (offset + parameter->size == optimizer->offsets[tensor + 1]));
+    assert((gradient->type == ELEMENT_FP32) && (parameter->type == ELEMENT_FP32));
+
+    struct optimizer_step tensor_step = *step;
+    if (!decay)
+    {
+        tensor_step.decay = 1.0f;
+    }
+    switch (optimizer->type)
+    {
+    case OPTIMIZER_SGD:
+        matrix_axpy(-step->learning_rate, gradient, parameter);
+        break;
+    case OPTIMIZER_MOMENTUM:
+        matrix_kernels->momentum(parameter->size, &tensor_step, gradient->entries, optimizer->state + offset,
+                                 parameter->entries);
+        break;
+    case OPTIMIZER_ADAM:
+        // Adam is AdamW without the decoupled decay.
+        tensor_step.decay = 1.0f;
+        // fall through
+    case OPTIMIZER_ADAMW:
+        matrix_kernels->adam(parameter->size, &tensor_step, gradient->entries, optimizer->state + offset,
+                             optimizer->state + block + offset, parameter->entries);
+        break;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "matrix_kernels.h"
+
+enum optimizer_type {
+    OPTIMIZER_SGD,      // w -= learning_rate g
+    OPTIMIZER_MOMENTUM, // Heavy-ball momentum
+    OPTIMIZER_ADAM,
+    OPTIMIZER_ADAMW     // Adam with decoupled weight decay
+};
+
+/*
+ * An update rule and its state for every parameter tensor of one network.
+ * The state is one buffer holding one block per moment the rule keeps (none
+ * for SGD, the velocity for momentum, the first and second moments for
+ * Adam); each block lists the tensors back to back at the same offsets, so a
+ * tensor's moments are contiguous and parallel to its parameters.
+ */
+struct optimizer {
+    enum optimizer_type type;
+    float beta1;        // Momentum, or Adam's first-moment decay
+    float beta2;        // Adam's second-moment decay
+    float epsilon;      // Added to Adam's denominator
+    float weight_decay; // Decoupled decay of the weights for momentum and AdamW
+    long steps;         // Updates taken so far
+    int num_tensors;
+    size_t *offsets;    // Start of each tensor in a block; offsets[num_tensors] is the block size
+    int num_moments;
+    float *state;       // num_moments blocks, zero-initialized
+};
+
+// Function declarations
+struct optimizer *construct_optimizer(const char *name, int num_tensors, const int sizes[]);
+void destruct_optimizer(struct optimizer *optimizer);
+const char *optimizer_name(struct optimizer *optimizer);
+struct optimizer_step optimizer_begin_step(struct optimizer *optimizer, float learning_rate);
+void optimizer_update(struct optimizer *optimizer, const struct optimizer_step *step, int tensor, bool decay,
+                      struct matrix *gradient, struct matrix *parameter);
+
+#endif // OPTIMIZER_H
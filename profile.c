@@ -0,0 +1,207 @@
+/*
+ * profile.c
+ *
+ * This file holds the counters behind the NN_PROFILE instrumentation and the
+ * heap allocation counter shared with the benchmark suite.
+ *
+ * Allocations are counted by wrappers that the linker substitutes for the
+ * allocator: every program that links this file must be linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=aligned_alloc, as
+ * the Makefile does for bench_suite and for builds with PROFILE=1.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+static uint64_t allocations = 0;
+static _Thread_local uint64_t thread_allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+static void count_allocation(void)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    ++thread_allocations;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    count_allocation();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    count_allocation();
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    count_allocation();
+    return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    count_allocation();
+    return __real_aligned_alloc(alignment, size);
+}
+
+/*
+ * allocation_count
+ *
+ * Returns the number of heap allocations made by all threads so far.
+ */
+uint64_t allocation_count(void)
+{
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+/*
+ * thread_allocation_count
+ *
+ * Returns the number of heap allocations made by the calling thread so far.
+ */
+uint64_t thread_allocation_count(void)
+{
+    return thread_allocations;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*
+ * construct_profile
+ *
+ * Allocates zeroed counters for a network with num_layers weight layers.
+ *
+ * Returns:
+ * A pointer to the counters.
+ *
+ * Side effects:
+ * Allocates memory for the counters.
+ */
+struct profile_stats *construct_profile(int num_layers)
+{
+    struct profile_stats *stats = malloc(sizeof(struct profile_stats) +
+                                         (size_t)num_layers * PROFILE_PHASES * sizeof(struct profile_counter));
+    stats->num_layers = num_layers;
+    reset_profile(stats);
+    return stats;
+}
+
+void destruct_profile(struct profile_stats *stats)
+{
+    free(stats);
+}
+
+/*
+ * reset_profile
+ *
+ * Zeroes every counter and restarts the reference used to convert cycles to
+ * seconds.
+ *
+ * Side effects:
+ * Overwrites the counters. Must not run concurrently with an instrumented
+ * pass on the same network.
+ */
+void reset_profile(struct profile_stats *stats)
+{
+    memset(stats->counters, 0, (size_t)stats->num_layers * PROFILE_PHASES * sizeof(struct profile_counter));
+    stats->cycles0 = profile_cycles();
+    stats->seconds0 = monotonic_seconds();
+}
+
+struct profile_counter *profile_counter(struct profile_stats *stats, int layer, enum profile_phase phase)
+{
+    return &stats->counters[layer * PROFILE_PHASES + phase];
+}
+
+/*
+ * profile_cycles_per_second
+ *
+ * Estimates the rate of the timestamp counter from the cycles and the
+ * monotonic time that passed since the last reset.
+ *
+ * Returns:
+ * Cycles per second, or 0 if too little time has passed to tell.
+ */
+double profile_cycles_per_second(struct profile_stats *stats)
+{
+    double elapsed = monotonic_seconds() - stats->seconds0;
+    if (elapsed < 1e-3)
+    {
+        return 0.0;
+    }
+    return (double)(profile_cycles() - stats->cycles0) / elapsed;
+}
+
+const char *profile_phase_name(enum profile_phase phase)
+{
+    static const char *const names[PROFILE_PHASES] = {
+        "forward gemm", "bias+activation", "output error", "activation grad", "weight grad gemm",
+        "bias grad", "input grad gemm", "gradient reduce", "weight update",
+    };
+    return names[phase];
+}
+
+/*
+ * print_profile
+ *
+ * Prints one row per layer and phase that ran since the last reset: calls,
+ * total time, share of the instrumented time, GFLOP/s, GB/s and allocations,
+ * followed by the totals.
+ *
+ * Side effects:
+ * Writes the table to out.
+ */
+void print_profile(struct profile_stats *stats, FILE *out)
+{
+    double rate = profile_cycles_per_second(stats);
+    uint64_t total_cycles = 0;
+    struct profile_counter total = {0};
+    for (int i = 0; i < stats->num_layers * PROFILE_PHASES; ++i)
+    {
+        total_cycles += stats->counters[i].cycles;
+    }
+
+    fprintf(out, "%5s %-17s %8s %12s %9s %6s %8s %8s %7s\n", "layer", "phase", "calls", "Mcycles", "ms", "%",
+            "GFLOP/s", "GB/s", "allocs");
+    for (int layer = 0; layer < stats->num_layers; ++layer)
+    {
+        for (int phase = 0; phase < PROFILE_PHASES; ++phase)
+        {
+            struct profile_counter *counter = profile_counter(stats, layer, phase);
+            if (counter->calls == 0)
+            {
+                continue;
+            }
+            double seconds = (rate > 0.0) ? counter->cycles / rate : 0.0;
+            fprintf(out, "%5d %-17s %8llu %12.2f %9.2f %6.1f %8.2f %8.2f %7llu\n", layer, profile_phase_name(phase),
+                    (unsigned long long)counter->calls, counter->cycles * 1e-6, seconds * 1e3,
+                    (total_cycles > 0) ? 100.0 * counter->cycles / total_cycles : 0.0,
+                    (seconds > 0.0) ? counter->flops / seconds * 1e-9 : 0.0,
+                    (seconds > 0.0) ? counter->bytes / seconds * 1e-9 : 0.0,
+                    (unsigned long long)counter->allocations);
+            total.calls += counter->calls;
+            total.bytes += counter->bytes;
+            total.flops += counter->flops;
+            total.allocations += counter->allocations;
+        }
+    }
+    double seconds = (rate > 0.0) ? total_cycles / rate : 0.0;
+    fprintf(out, "%5s %-17s %8llu %12.2f %9.2f %6.1f %8.2f %8.2f %7llu\n", "all", "", (unsigned long long)total.calls,
+            total_cycles * 1e-6, seconds * 1e3, 100.0, (seconds > 0.0) ? total.flops / seconds * 1e-9 : 0.0,
+            (seconds > 0.0) ? total.bytes / seconds * 1e-9 : 0.0, (unsigned long long)total.allocations);
+}
@@ -0,0 +1,129 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Phases of a forward/backward pass that the instrumentation tells apart.
+ * Transposes do not appear: gemm reads transposed operands while packing
+ * them, so their cost is part of the backward products.
+ */
+enum profile_phase {
+    PROFILE_FORWARD_GEMM,        // Z = W * A, convolutions with their im2col, and max pooling
+    PROFILE_BIAS_ACTIVATION,     // A = f(Z + b), and f'(Z + b) when training
+    PROFILE_OUTPUT_ERROR,        // The loss and dC/dA of the last layer, or with softmax the
+                                 // probabilities and dC/dZ in one pass
+    PROFILE_ACTIVATION_GRADIENT, // dC/dZ = f'(Z + b) .* dC/dA, except for softmax
+    PROFILE_WEIGHT_GRADIENT,     // dC/dW = dC/dZ * A^T, with A lowered by im2col for convolutions
+    PROFILE_BIAS_GRADIENT,       // dC/db = row sums of dC/dZ
+    PROFILE_INPUT_GRADIENT,      // dC/dA of the previous layer = W^T * dC/dZ, folded back by
+                                 // col2im for convolutions; routed to the maxima for pooling
+    PROFILE_GRADIENT_REDUCE,     // Summing the shard gradients, all layers under layer 0
+    PROFILE_WEIGHT_UPDATE,       // Applying the gradients, all layers under layer 0, then
+                                 // re-masking pruned layers and refreshing each layer's
+                                 // reduced-precision weights
+    PROFILE_PHASES
+};
+
+// Totals for one phase of one layer.
+struct profile_counter {
+    uint64_t calls;
+    uint64_t cycles;      // Timestamp counter ticks, summed over threads
+    uint64_t bytes;       // Estimated bytes read and written
+    uint64_t flops;       // Floating point operations
+    uint64_t allocations; // Heap allocations made during the phase
+};
+
+/*
+ * Counters of a network, one per weight layer and phase. They are filled in
+ * by the instrumented passes when the library is built with NN_PROFILE, and
+ * stay all zero otherwise.
+ */
+struct profile_stats {
+    int num_layers;      // Weight layers
+    uint64_t cycles0;    // Timestamp counter at the last reset
+    double seconds0;     // Monotonic clock at the last reset
+    struct profile_counter counters[]; // num_layers * PROFILE_PHASES, by layer
+};
+
+// State captured at the start of an instrumented phase.
+struct profile_scope {
+    uint64_t cycles;
+    uint64_t allocations;
+};
+
+// Function declarations
+struct profile_stats *construct_profile(int num_layers);
+void destruct_profile(struct profile_stats *stats);
+void reset_profile(struct profile_stats *stats);
+struct profile_counter *profile_counter(struct profile_stats *stats, int layer, enum profile_phase phase);
+double profile_cycles_per_second(struct profile_stats *stats);
+void print_profile(struct profile_stats *stats, FILE *out);
+const char *profile_phase_name(enum profile_phase phase);
+uint64_t allocation_count(void);
+uint64_t thread_allocation_count(void);
+
+/*
+ * profile_cycles
+ *
+ * Reads the timestamp counter: rdtsc on x86-64, the virtual counter on
+ * AArch64 and the monotonic clock in nanoseconds elsewhere.
+ */
+static inline uint64_t profile_cycles(void)
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+#endif
+}
+
+static inline struct profile_scope profile_begin(void)
+{
+    struct profile_scope scope = {profile_cycles(), thread_allocation_count()};
+    return scope;
+}
+
+/*
+ * profile_end
+ *
+ * Adds the time and allocations since profile_begin, and the given bytes and
+ * flops, to a counter. Shards of back_propagate_parallel record concurrently,
+ * so the additions are atomic.
+ */
+static inline void profile_end(struct profile_stats *stats, int layer, enum profile_phase phase,
+                               struct profile_scope *scope, uint64_t bytes, uint64_t flops)
+{
+    uint64_t cycles = profile_cycles() - scope->cycles;
+    uint64_t allocations = thread_allocation_count() - scope->allocations;
+    struct profile_counter *counter = &stats->counters[layer * PROFILE_PHASES + phase];
+    __atomic_fetch_add(&counter->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->flops, flops, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->allocations, allocations, __ATOMIC_RELAXED);
+}
+
+/*
+ * Instrumentation of the hot paths. Without NN_PROFILE both macros expand to
+ * nothing and their arguments are not evaluated, so the passes compile to the
+ * same code as without them.
+ */
+#ifdef NN_PROFILE
+#define PROFILE_BEGIN(scope) struct profile_scope scope = profile_begin()
+#define PROFILE_END(stats, layer, phase, scope, bytes, flops) \
+    profile_end((stats), (layer), (phase), &(scope), (uint64_t)(bytes), (uint64_t)(flops))
+#else
+#define PROFILE_BEGIN(scope) do { } while (0)
+#define PROFILE_END(stats, layer, phase, scope, bytes, flops) do { } while (0)
+#endif
+
+#endif // PROFILE_H
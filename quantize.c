@@ -0,0 +1,242 @@
+/*
+ * quantize.c
+ *
+ * This file implements post-training int8 quantization: converting a trained
+ * network with per-channel weight scales and calibrated activation scales,
+ * and evaluating the result with an integer GEMM.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "matrix.h"
+#include "matrix_kernels.h"
+#include "neural_net.h"
+#include "quantize.h"
+#include "thread_pool.h"
+
+// Samples evaluated together by one task; their int8 inputs stay in cache.
+#define QUANTIZED_BLOCK 256
+
+static float max_abs(int n, const float *x)
+{
+    float max = 0.0f;
+    for (int i = 0; i < n; ++i)
+    {
+        max = fmaxf(max, fabsf(x[i]));
+    }
+    return max;
+}
+
+/*
+ * quantize_neural_net
+ *
+ * Converts a trained network to int8. Each output row of a weight matrix gets
+ * its own scale so that small and large rows keep the same relative precision.
+ * The input scale of every layer comes from the largest magnitude seen while
+ * running the float network on the calibration samples.
+ *
+ * Parameters:
+ * neural_net: A pointer to the trained network; it is not modified.
+ * calibration: A representative batch of inputs, one sample per column.
+ *
+ * Returns:
+ * A pointer to the newly constructed quantized network, or NULL if the
+ * network has convolution or pooling layers, which are not supported.
+ *
+ * Side effects:
+ * Allocates the quantized network and a temporary workspace.
+ */
+struct quantized_net *quantize_neural_net(struct neural_net *neural_net, struct matrix *calibration)
+{
+    assert(calibration->rows == neural_net->layers[0]);
+    for (int layer = 0; layer < neural_net->num_layers - 1; ++layer)
+    {
+        if (neural_net->layer_types[layer] != LAYER_DENSE)
+        {
+            fprintf(stderr, "layer %d is not dense; only dense networks can be quantized\n", layer);
+            return NULL;
+        }
+    }
+    struct workspace *workspace = construct_workspace(neural_net, calibration->cols);
+    eval_workspace(neural_net, workspace, calibration);
+
+    int num_layers = neural_net->num_layers;
+    struct quantized_net *quantized_net = malloc(sizeof(struct quantized_net));
+    quantized_net->num_layers = num_layers;
+    quantized_net->layers = malloc(num_layers * sizeof(int));
+    memcpy(quantized_net->layers, neural_net->layers, num_layers * sizeof(int));
+    quantized_net->quantized = malloc((num_layers - 1) * sizeof(struct quantized_layer));
+    for (int layer = 0; layer < num_layers - 1; ++layer)
+    {
+        struct matrix *weights = neural_net->weights[layer];
+        struct matrix *input = (layer == 0) ? calibration : &workspace->activations[layer];
+        struct matrix *widened = (input->type != ELEMENT_FP32) ? convert_matrix(input, ELEMENT_FP32) : NULL;
+        input = (widened != NULL) ? widened : input;
+        struct quantized_layer *quantized = &quantized_net->quantized[layer];
+        quantized->rows = weights->rows;
+        quantized->cols = weights->cols;
+        quantized->weights = malloc((size_t)weights->size * sizeof(int8_t));
+        quantized->scales = malloc(weights->rows * sizeof(float));
+        quantized->bias = copy_matrix(neural_net->biases[layer]);
+        quantized->activation = neural_net->activation_types[layer];
+
+        float input_max = max_abs(input->size, input->entries);
+        quantized->input_scale = (input_max > 0.0f) ? input_max / 127.0f : 1.0f;
+        if (widened != NULL)
+        {
+            destruct_matrix(widened);
+        }
+        for (int row = 0; row < weights->rows; ++row)
+        {
+            const float *w = weights->entries + (size_t)row * weights->cols;
+            float row_max = max_abs(weights->cols, w);
+            float scale = (row_max > 0.0f) ? row_max / 127.0f : 1.0f;
+            matrix_kernels->quantize_s8(weights->cols, w, 1.0f / scale, quantized->weights + (size_t)row * weights->cols);
+            quantized->scales[row] = scale * quantized->input_scale;
+        }
+    }
+    destruct_workspace(workspace);
+    return quantized_net;
+}
+
+/*
+ * destruct_quantized_net
+ *
+ * Deallocates a network made by quantize_neural_net.
+ */
+void destruct_quantized_net(struct quantized_net *quantized_net)
+{
+    for (int layer = 0; layer < quantized_net->num_layers - 1; ++layer)
+    {
+        free(quantized_net->quantized[layer].weights);
+        free(quantized_net->quantized[layer].scales);
+        destruct_matrix(quantized_net->quantized[layer].bias);
+    }
+    free(quantized_net->quantized);
+    free(quantized_net->layers);
+    free(quantized_net);
+}
+
+/*
+ * quantized_weight_bytes
+ *
+ * Returns the storage taken by the int8 weights of a quantized network.
+ */
+size_t quantized_weight_bytes(struct quantized_net *quantized_net)
+{
+    size_t bytes = 0;
+    for (int layer = 0; layer < quantized_net->num_layers - 1; ++layer)
+    {
+        bytes += (size_t)quantized_net->quantized[layer].rows * quantized_net->quantized[layer].cols;
+    }
+    return bytes;
+}
+
+/*
+ * Scratch space for one block of samples, allocated once per thread and grown
+ * when a wider network is evaluated, so steady-state inference does not
+ * allocate beyond its result.
+ */
+static _Thread_local void *quantized_scratch = NULL;
+static _Thread_local size_t quantized_scratch_size = 0;
+
+struct quantized_job {
+    struct quantized_net *quantized_net;
+    struct matrix *in_data;
+    struct matrix *out;
+    int width; // Widest layer
+};
+
+static void quantized_task(int index, void *arg)
+{
+    struct quantized_job *job = arg;
+    struct quantized_net *quantized_net = job->quantized_net;
+    int first = index * QUANTIZED_BLOCK;
+    int cols = (job->in_data->cols - first < QUANTIZED_BLOCK) ? job->in_data->cols - first : QUANTIZED_BLOCK;
+
+    size_t block_size = (size_t)QUANTIZED_BLOCK * job->width;
+    size_t size = block_size * (sizeof(int32_t) + 2 * sizeof(float) + sizeof(int8_t));
+    if (quantized_scratch_size < size)
+    {
+        free(quantized_scratch);
+        quantized_scratch = malloc(size);
+        quantized_scratch_size = size;
+    }
+    int32_t *products = quantized_scratch;
+    float *Z = (float *)(products + block_size);
+    float *A = Z + block_size;
+    int8_t *inputs = (int8_t *)(A + block_size);
+
+    // Every buffer keeps the column-per-sample layout of the float network,
+    // with rows of cols entries, so no step needs a transpose.
+    struct quantized_layer *quantized = &quantized_net->quantized[0];
+    for (int feature = 0; feature < quantized->cols; ++feature)
+    {
+        matrix_kernels->quantize_s8(cols, job->in_data->entries + (size_t)feature * job->in_data->cols + first,
+                                    1.0f / quantized->input_scale, inputs + (size_t)feature * cols);
+    }
+
+    for (int layer = 0; layer < quantized_net->num_layers - 1; ++layer)
+    {
+        quantized = &quantized_net->quantized[layer];
+        matrix_kernels->gemm_s8(quantized->rows, cols, quantized->cols, quantized->weights, inputs, cols, products, cols);
+        for (int row = 0; row < quantized->rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                Z[row * cols + col] = products[row * cols + col] * quantized->scales[row];
+            }
+        }
+        struct matrix Z_view = {.rows = quantized->rows, .cols = cols, .size = quantized->rows * cols, .entries = Z};
+        struct matrix A_view = {.rows = quantized->rows, .cols = cols, .size = quantized->rows * cols, .entries = A};
+        bias_activation(&Z_view, quantized->bias, quantized->activation, &A_view, NULL);
+
+        for (int row = 0; row < quantized->rows; ++row)
+        {
+            if (layer == quantized_net->num_layers - 2)
+            {
+                memcpy(job->out->entries + (size_t)row * job->out->cols + first, A + row * cols, cols * sizeof(float));
+            }
+            else
+            {
+                // Requantize with the next layer's input scale.
+                matrix_kernels->quantize_s8(cols, A + row * cols, 1.0f / quantized_net->quantized[layer + 1].input_scale,
+                                            inputs + row * cols);
+            }
+        }
+    }
+}
+
+/*
+ * eval_quantized
+ *
+ * Evaluates a quantized network. Every layer multiplies int8 weights by int8
+ * inputs into int32, scales the sums back to float, applies the bias and
+ * activation, and requantizes the result as the next layer's input.
+ *
+ * Parameters:
+ * quantized_net: A pointer to the quantized network.
+ * in_data: A pointer to the input data matrix, one sample per column.
+ *
+ * Returns:
+ * A pointer to the output matrix, laid out like the result of eval.
+ *
+ * Side effects:
+ * Allocates the output matrix. Blocks of samples are spread over the thread
+ * pool.
+ */
+struct matrix *eval_quantized(struct quantized_net *quantized_net, struct matrix *in_data)
+{
+    assert(in_data->rows == quantized_net->layers[0]);
+    struct quantized_job job = {quantized_net, in_data, NULL, 0};
+    job.out = construct_matrix(quantized_net->layers[quantized_net->num_layers - 1], in_data->cols);
+    for (int layer = 0; layer < quantized_net->num_layers; ++layer)
+    {
+        job.width = (quantized_net->layers[layer] > job.width) ? quantized_net->layers[layer] : job.width;
+    }
+    parallel_for((in_data->cols + QUANTIZED_BLOCK - 1) / QUANTIZED_BLOCK, quantized_task, &job);
+    return job.out;
+}
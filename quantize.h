@@ -0,0 +1,36 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include "matrix.h"
+#include "neural_net.h"
+
+/*
+ * One layer of a quantized network. Weights are int8 with one scale per
+ * output row, inputs are int8 with one scale per layer fixed by calibration,
+ * and products accumulate exactly in int32 before being scaled back to float
+ * for the bias and activation.
+ */
+struct quantized_layer {
+    int rows;               // Outputs
+    int cols;               // Inputs
+    int8_t *weights;        // rows x cols, row-major, in [-127, 127]
+    float *scales;          // Per row: weight scale times input scale
+    struct matrix *bias;
+    float input_scale;      // Real value of one int8 step of the input
+    enum activation activation;
+};
+
+struct quantized_net {
+    int num_layers;
+    int *layers;
+    struct quantized_layer *quantized; // num_layers - 1 layers
+};
+
+// Function declarations
+struct quantized_net *quantize_neural_net(struct neural_net *neural_net, struct matrix *calibration);
+void destruct_quantized_net(struct quantized_net *quantized_net);
+struct matrix *eval_quantized(struct quantized_net *quantized_net, struct matrix *in_data);
+size_t quantized_weight_bytes(struct quantized_net *quantized_net);
+
+#endif // QUANTIZE_H
@@ -0,0 +1,257 @@
+/*
+ * thread_pool.c
+ *
+ * This file implements a persistent pool of worker threads shared by the
+ * matrix and neural network code. Workers are created once and sleep on a
+ * condition variable between calls, so a training step never creates threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "thread_pool.h"
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+// Serializes callers of parallel_for that are not pool workers.
+static pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t *workers = NULL;
+static int num_workers = 0;
+static int requested_threads = 0; // 0 until set_num_threads or first use
+
+// The job currently being run, published under pool_mutex.
+static void (*job_task)(int, void *) = NULL;
+static void *job_arg = NULL;
+static int job_tasks = 0;
+static atomic_int job_next;
+static int job_generation = 0;
+static int job_pending = 0;
+static bool shutting_down = false;
+
+// Set on pool workers and on a caller while it runs a job, so that nested
+// parallel_for calls run inline instead of deadlocking.
+static _Thread_local bool in_parallel_region = false;
+
+static void run_tasks(void)
+{
+    int index;
+    while ((index = atomic_fetch_add(&job_next, 1)) < job_tasks)
+    {
+        job_task(index, job_arg);
+    }
+}
+
+static void *worker_main(void *unused)
+{
+    (void)unused;
+    in_parallel_region = true;
+    int seen_generation = 0;
+    pthread_mutex_lock(&pool_mutex);
+    for (;;)
+    {
+        while (job_generation == seen_generation && !shutting_down)
+        {
+            pthread_cond_wait(&work_cond, &pool_mutex);
+        }
+        if (shutting_down)
+        {
+            break;
+        }
+        seen_generation = job_generation;
+        pthread_mutex_unlock(&pool_mutex);
+
+        run_tasks();
+
+        pthread_mutex_lock(&pool_mutex);
+        if (--job_pending == 0)
+        {
+            pthread_cond_signal(&done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+/*
+ * start_workers
+ *
+ * Creates the pool so that, together with the calling thread, it has
+ * num_threads threads. Must be called with submit_mutex held and no workers
+ * running.
+ */
+static void start_workers(int num_threads)
+{
+    num_workers = num_threads - 1;
+    if (num_workers <= 0)
+    {
+        num_workers = 0;
+        return;
+    }
+    workers = malloc(num_workers * sizeof(pthread_t));
+    for (int i = 0; i < num_workers; ++i)
+    {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+        {
+            fprintf(stderr, "thread_pool: could only start %d workers\n", i);
+            num_workers = i;
+            break;
+        }
+    }
+}
+
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&pool_mutex);
+    shutting_down = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    for (int i = 0; i < num_workers; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+    shutting_down = false;
+    job_generation = 0;
+}
+
+static int default_num_threads(void)
+{
+    const char *env = getenv("NN_NUM_THREADS");
+    if (env != NULL && atoi(env) > 0)
+    {
+        return atoi(env);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? (int)cpus : 1;
+}
+
+/*
+ * set_num_threads
+ *
+ * Sets the number of threads (including the caller) used by parallel_for.
+ * The default is the NN_NUM_THREADS environment variable, or the number of
+ * online CPUs.
+ *
+ * Parameters:
+ * num_threads: The number of threads; values below 1 are treated as 1.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Restarts the worker threads if the count changes. Must not be called from
+ * inside a parallel_for task.
+ */
+void set_num_threads(int num_threads)
+{
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    pthread_mutex_lock(&submit_mutex);
+    if (num_threads != requested_threads)
+    {
+        stop_workers();
+        requested_threads = num_threads;
+        start_workers(num_threads);
+    }
+    pthread_mutex_unlock(&submit_mutex);
+}
+
+/*
+ * get_num_threads
+ *
+ * Returns the number of threads used by parallel_for.
+ */
+int get_num_threads(void)
+{
+    if (requested_threads == 0)
+    {
+        set_num_threads(default_num_threads());
+    }
+    return requested_threads;
+}
+
+/*
+ * parallel_for
+ *
+ * Runs task(index, arg) for every index in [0, num_tasks) on the pool. The
+ * calling thread takes part and the call returns once every task is done.
+ *
+ * Parameters:
+ * num_tasks: The number of tasks.
+ * task: The function to run for each task index.
+ * arg: Passed through to task.
+ *
+ * Returns:
+ * None.
+ *
+ * Side effects:
+ * Runs the tasks serially on the calling thread when it is already inside a
+ * parallel_for, when there is a single thread, or when another thread is
+ * using the pool.
+ */
+void parallel_for(int num_tasks, void (*task)(int index, void *arg), void *arg)
+{
+    bool serial = in_parallel_region || num_tasks <= 1 || get_num_threads() <= 1;
+    if (!serial && pthread_mutex_trylock(&submit_mutex) != 0)
+    {
+        serial = true;
+    }
+    if (serial || num_workers == 0)
+    {
+        if (!serial)
+        {
+            pthread_mutex_unlock(&submit_mutex);
+        }
+        for (int index = 0; index < num_tasks; ++index)
+        {
+            task(index, arg);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    job_task = task;
+    job_arg = arg;
+    job_tasks = num_tasks;
+    atomic_store(&job_next, 0);
+    job_pending = num_workers;
+    ++job_generation;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    in_parallel_region = true;
+    run_tasks();
+    in_parallel_region = false;
+
+    pthread_mutex_lock(&pool_mutex);
+    while (job_pending > 0)
+    {
+        pthread_cond_wait(&done_cond, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_mutex_unlock(&submit_mutex);
+}
+
+/*
+ * destruct_thread_pool
+ *
+ * Stops and joins the worker threads. The pool is recreated on the next
+ * parallel_for call.
+ */
+void destruct_thread_pool(void)
+{
+    pthread_mutex_lock(&submit_mutex);
+    stop_workers();
+    requested_threads = 0;
+    pthread_mutex_unlock(&submit_mutex);
+}
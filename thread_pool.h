@@ -0,0 +1,10 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Function declarations
+void set_num_threads(int num_threads);
+int get_num_threads(void);
+void parallel_for(int num_tasks, void (*task)(int index, void *arg), void *arg);
+void destruct_thread_pool(void);
+
+#endif // THREAD_POOL_H